@@ -15,6 +15,9 @@
     along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cctype>
+#include <fstream>
 #include <iostream>
 #include <string>
 
@@ -27,6 +30,8 @@
 
 
 std::string net_filename = "";
+// large net of the cascade, empty if none
+std::string large_net_filename = "";
 std::unique_ptr<gmgm::PositionEval> position_eval;
 gmgm::Board board("smsm", "smsm");
 gmgm::Search search;
@@ -165,9 +170,44 @@ public:
     }
 };
 
+class ChoiceSet : public Parameter {
+private:
+    std::string & sval_;
+    std::vector<std::string> choices_;
+    std::function<void(void)> post_update_func_;
+public:
+    ChoiceSet(
+        std::string cmdname, std::string help, std::string & sval,
+        std::vector<std::string> choices,
+        std::function<void(void)> post_update_func = [](){}
+    ) : Parameter(cmdname, help), sval_(sval), choices_(choices), post_update_func_(post_update_func) {}
+
+    virtual bool set(std::string s1) {
+        for(auto & x : choices_) {
+            if(s1 == x) {
+                sval_ = s1;
+                post_update_func_();
+                return true;
+            }
+        }
+        return false;
+    }
+    virtual std::string get() {
+        return sval_;
+    }
+};
+
 static void help(std::string s);
 
-static std::string load_net() {
+// swapnet replaces the weights in the background and may fail, so only
+// the net itself knows which file it is running
+static std::string current_net_filename() {
+    auto network = dynamic_cast<Network*>(position_eval.get());
+    return network != nullptr ? network->weights_file() : net_filename;
+}
+
+static std::string load_net(const std::string & filename = current_net_filename()) {
+    net_filename = filename;
     if(net_filename == "") {
         return "";
     }
@@ -184,6 +224,16 @@ static std::string load_net() {
         net_filename = "";
     }
 
+    // a main net without its large net is still usable, so only report this
+    if(network != nullptr && large_net_filename != "") {
+        try {
+            network->load_large_net(large_net_filename);
+        } catch(std::runtime_error &x) {
+            std::cout << "Failed loading large net : " << x.what() << std::endl;
+            large_net_filename = "";
+        }
+    }
+
     if(network != nullptr) {
         position_eval.reset(network);
     }
@@ -191,6 +241,26 @@ static std::string load_net() {
     return ret;
 }
 
+// the positions argument of calibrate and comparebackends.  every position
+// keeps its input planes in memory, so cap the count well below what would
+// exhaust it.  returns 0 after saying why if s is not a usable count
+static size_t parse_positions(const std::string & s) {
+    constexpr auto MAX_POSITIONS = size_t{65536};
+    auto positions = size_t{0};
+    if(!s.empty() && std::all_of(begin(s), end(s), [](char c) { return std::isdigit(c); })) {
+        try {
+            positions = std::stoul(s);
+        } catch(std::out_of_range &) {
+            positions = MAX_POSITIONS + 1;
+        }
+    }
+    if(positions == 0 || positions > MAX_POSITIONS) {
+        std::cout << "Positions should be a number between 1 and " << MAX_POSITIONS << std::endl;
+        return 0;
+    }
+    return positions;
+}
+
 static void think() {
     if(board.winner() != gmgm::Side::NONE) {
         std::cout << "Game already over. "
@@ -247,18 +317,96 @@ auto create_param_list = []() {
     std::initializer_list<Parameter*> param_list = {
         new UIntSet("batch_size", "Neural net batch size.  Optimal size may differ from GPU to GPU", gmgm::globals::batch_size, 
             [](){
-                if(position_eval != nullptr) {
+                // the cpu scheduler reads batch_size on every batch, only OpenCL sizes its buffers with it
+                auto network = dynamic_cast<Network*>(position_eval.get());
+                if(network != nullptr && !network->uses_cpu_backend()) {
                     std::cout << "Reloading net as we changed batch size..." << std::endl;
                     load_net();
                 }
             }
         ),
+        new ChoiceSet("backend", "Neural net evaluation backend : cpu, opencl or auto.  auto falls back to cpu if there is no usable OpenCL device", gmgm::globals::backend,
+            {"cpu", "opencl", "auto"},
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed backend..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new ChoiceSet("opencl_precision", "Arithmetic of the OpenCL backend : fp16 or fp32.  See comparebackends for the accuracy and speed of each", gmgm::globals::opencl_precision,
+            {"fp16", "fp32"},
+            [](){
+                auto network = dynamic_cast<Network*>(position_eval.get());
+                if(network != nullptr && !network->uses_cpu_backend()) {
+                    std::cout << "Reloading net as we changed OpenCL precision..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new UIntSet("cpu_threads", "Number of cores a single cpu backend evaluation is split across.  Higher values reduce latency, 1 maximizes throughput", gmgm::globals::cpu_threads,
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed cpu threads..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new ChoiceSet("cpu_simd", "Instruction set for the cpu backend winograd transforms : auto, avx512, avx2 or scalar.  Unsupported choices fall back to the next best one", gmgm::globals::cpu_simd,
+            {"auto", "avx512", "avx2", "scalar"},
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed cpu simd..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new ChoiceSet("cpu_precision", "Precision of the cpu backend residual tower : fp32 or int8.  int8 is calibrated against fp32 when the net is loaded, see calibrate", gmgm::globals::cpu_precision,
+            {"fp32", "int8"},
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed cpu precision..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new ChoiceSet("cpu_weights", "Storage of the transformed convolution weights of the cpu backend : fp32, fp16 or bf16.  16 bit storage halves the weight memory and bandwidth, the math stays fp32", gmgm::globals::cpu_weights,
+            {"fp32", "fp16", "bf16"},
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed cpu weight storage..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new ChoiceSet("cpu_winograd", "Winograd tiles of the cpu backend convolutions : f4x4, f5x3 or f2x2.  f5x3 covers the 9x10 board exactly with 6 tiles and is the fastest, f2x2 is the most accurate.  Needs a text net", gmgm::globals::cpu_winograd,
+            {"f4x4", "f5x3", "f2x2"},
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed cpu winograd tiles..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
+        new ChoiceSet("cpu_layout", "Activation layout of the cpu backend residual tower : nchw, or blocked which interleaves 8 (avx2) or 16 (avx512) channels so the transforms, batchnorm and SE work on whole vectors.  Not used with int8", gmgm::globals::cpu_layout,
+            {"nchw", "blocked"},
+            [](){
+                if(position_eval != nullptr) {
+                    std::cout << "Reloading net as we changed cpu layout..." << std::endl;
+                    load_net();
+                }
+            }
+        ),
         new UIntSet("cache_size", "Neural net evaluation cache size.  1 entry consumes roughly 4kB of system memory", gmgm::globals::cache_size),
+        new UIntSet("prefetch_children", "Number of top-prior children of each newly expanded node to evaluate speculatively on idle batch slots.  0 disables prefetch", gmgm::globals::prefetch_children),
+        new UIntSet("large_net_depth", "Positions less than this many plies below the search root are evaluated by the large net, if one is loaded.  See loadlargenet", gmgm::globals::large_net_depth),
+        new UIntSet("large_net_visits", "Children of nodes with at least this many visits are evaluated by the large net, if one is loaded.  0 disables", gmgm::globals::large_net_visits),
         new UIntSet("num_threads", "Search evaluation parallelism.  Recommended size is at least 2x of batch_size", search.num_threads),
         new UIntSet("print_period", "Print period.  How often you print verbose messages while searching", search.print_period),
         new BoolSet("verbose_mode", "Verbose mode.  If true, will dump more diagnostic messages", gmgm::globals::verbose_mode),
         new UIntSet("search_num", "Amount of searches to do per move", search_num),
-        new UIntSet("search_time_ms", "Maximum time to search, in milliseconds", search_time_ms)
+        new UIntSet("search_time_ms", "Maximum time to search, in milliseconds", search_time_ms),
+        new UIntSet("max_tree_mb", "Maximum search tree size in megabytes, for the whole process.  Least visited subtrees are pruned when exceeded.  0 is unlimited", search.max_tree_mb)
     };
 
     std::vector<std::unique_ptr<Parameter>> p;
@@ -343,8 +491,7 @@ std::vector<Command> command_list {
             CHECK_PARAM_1();
 
             std::cout << "Loading net " << s1 << "..." << std::endl;
-            net_filename = s1;
-            auto msg = load_net();
+            auto msg = load_net(s1);
             
             if(msg != "") {
                 std::cout <<"Failed loading net :" << msg << std::endl;
@@ -352,6 +499,145 @@ std::vector<Command> command_list {
             return true;
         }
     ),
+    Command("swapnet", "[neural_net_filename]",
+        "Replace the loaded net by another one with the same number of channels, in the background.\nEvaluations keep running on the old net until the new one is ready",
+        [](auto s1, auto s2, auto s3, auto s4) {
+            CHECK_PARAM_1();
+            auto network = dynamic_cast<Network*>(position_eval.get());
+            if(network == nullptr) {
+                std::cout << "No net loaded.  Type loadnet [net file] first." << std::endl;
+                return true;
+            }
+            std::cout << "Swapping in net " << s1 << "..." << std::endl;
+            network->swap_weights_async(s1);
+            return true;
+        }
+    ),
+    Command("loadlargenet", "[neural_net_filename]",
+        "Load a second, usually larger, net for the positions near the search root, see\nlarge_net_depth and large_net_visits.  Both nets share the evaluation threads and\nhave separate caches.  Nodes kept from the previous search that come under these\nrules are evaluated again by the large net before the next search starts.  'none' drops the large net",
+        [](auto s1, auto s2, auto s3, auto s4) {
+            CHECK_PARAM_1();
+            auto network = dynamic_cast<Network*>(position_eval.get());
+            if(network == nullptr) {
+                std::cout << "No net loaded.  Type loadnet [net file] first." << std::endl;
+                return true;
+            }
+            if(s1 == "none") {
+                large_net_filename = "";
+                std::cout << "Reloading net without the large net..." << std::endl;
+                load_net();
+                return true;
+            }
+            std::cout << "Loading large net " << s1 << "..." << std::endl;
+            try {
+                network->load_large_net(s1);
+                large_net_filename = s1;
+            } catch(std::runtime_error &x) {
+                std::cout << "Failed loading large net : " << x.what() << std::endl;
+            }
+            return true;
+        }
+    ),
+    Command("convertnet", "[text_net_filename] [binary_net_filename]",
+        "Convert a text (or gzipped text) net into the binary format.  Binary nets are stored\nready to run and get memory mapped by loadnet, so they load much faster and\nprocesses on the same host share their memory.  An existing binary net is replaced\natomically (written to a temporary file, then renamed), so engines that have it\nloaded keep running on the old weights until they load it again",
+        [](auto s1, auto s2, auto s3, auto s4) {
+            CHECK_PARAM_2();
+            try {
+                Network().convert_network(s1, s2);
+                std::cout << "Wrote " << s2 << std::endl;
+            } catch(std::runtime_error &x) {
+                std::cout << "Failed converting net : " << x.what() << std::endl;
+            }
+            return true;
+        }
+    ),
+    Command("calibrate", "[positions]",
+        "Recalibrate the int8 cpu backend on the given number of positions (default 256)\nand report its accuracy against fp32.  Needs cpu_precision int8",
+        [](auto s1, auto s2, auto s3, auto s4) {
+            if(s1 != "") {
+                CHECK_PARAM_1();
+            }
+            auto network = dynamic_cast<Network*>(position_eval.get());
+            if(network == nullptr) {
+                std::cout << "No net loaded.  Type loadnet [net file] first." << std::endl;
+                return true;
+            }
+            size_t positions = Network::DEFAULT_CALIBRATION_POSITIONS;
+            if(s1 != "") {
+                positions = parse_positions(s1);
+                if(positions == 0) {
+                    return true;
+                }
+            }
+            try {
+                if(!network->calibrate_int8(positions)) {
+                    std::cout << "Net was not loaded for int8.  Type setparam cpu_precision int8 first." << std::endl;
+                }
+            } catch(std::exception &x) {
+                std::cout << "Failed calibrating : " << x.what() << std::endl;
+            }
+            return true;
+        }
+    ),
+    Command("comparebackends", "[positions]",
+        "Run positions (default 256) through the cpu backend with fp32, fp16 and bf16 weights\nand through OpenCL fp32 and fp16, if there is an OpenCL device.  Reports the policy KL,\ntop-1 agreement and value error of each against cpu fp32, and its throughput",
+        [](auto s1, auto s2, auto s3, auto s4) {
+            if(s1 != "") {
+                CHECK_PARAM_1();
+            }
+            const auto filename = current_net_filename();
+            if(filename == "") {
+                std::cout << "No net loaded.  Type loadnet [net file] first." << std::endl;
+                return true;
+            }
+            size_t positions = Network::DEFAULT_CALIBRATION_POSITIONS;
+            if(s1 != "") {
+                positions = parse_positions(s1);
+                if(positions == 0) {
+                    return true;
+                }
+            }
+            try {
+                Network().compare_backends(filename, positions);
+            } catch(std::exception &x) {
+                std::cout << "Failed comparing backends : " << x.what() << std::endl;
+            }
+            return true;
+        }
+    ),
+    Command("profile", "[on|off|reset|dump] [filename]",
+        "Per layer and per kernel timing of the net evaluations.  on starts collecting and off\nstops, reset clears what was collected.  With no argument, prints the time, share,\nmemory bandwidth and GFLOP/s of every layer and kernel, per backend and net\n(main, large or the OpenCL selfcheck).  dump writes them tab\nseparated to filename, or prints them if no filename is given",
+        [](auto s1, auto s2, auto s3, auto s4) {
+            if(s3 != "" || s4 != "" || (s2 != "" && s1 != "dump")) {
+                return false;
+            }
+            if(s1 == "") {
+                if(!Profiler::enabled()) {
+                    std::cout << "Profiling is off.  Type profile on first." << std::endl;
+                }
+                std::cout << Profiler::report();
+            } else if(s1 == "on") {
+                Profiler::set_enabled(true);
+            } else if(s1 == "off") {
+                Profiler::set_enabled(false);
+            } else if(s1 == "reset") {
+                Profiler::reset();
+            } else if(s1 == "dump") {
+                if(s2 == "") {
+                    std::cout << Profiler::dump();
+                } else {
+                    std::ofstream ofs(s2);
+                    ofs << Profiler::dump();
+                    if(!ofs) {
+                        std::cout << "Failed writing " << s2 << std::endl;
+                    }
+                }
+            } else {
+                return false;
+            }
+            return true;
+        }
+    ),
     Command("think", "", "Let AI play",
         [](auto s1, auto s2, auto s3, auto s4) {
             CHECK_PARAM_0();
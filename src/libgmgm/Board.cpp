@@ -27,6 +27,10 @@
 
 #include "BoardHashConstants.h"
 
+#ifndef NDEBUG
+gmgm::movegen_stats_t gmgm::movegen_stats;
+#endif
+
 gmgm::Board::Board(std::string cho_state, std::string han_state) {
     auto convert = [](std::string x) {
         if(x == "msms") return StartingState::MSMS;
@@ -858,17 +862,9 @@ gmgm::Side gmgm::Board::winner() const {
     size_t repeat_cnt = 0;
     if (globals::board_based_repetitive_move) {
         int sz = history.size();
-        int pt = sz-1;
     
         if( sz >= 8 && !history[sz-1].move.is_pass() ) {
-            while(repeat_cnt < 3 && pt >= 0) {
-                if(history[sz-1].boardhash == history[pt].boardhash) {
-                    repeat_cnt++;
-                    pt -= 4;
-                } else {
-                    break;
-                }
-            }
+            repeat_cnt = history[sz-1].board_repeat;
         }
 
         if(repeat_cnt >= 3) {
@@ -881,17 +877,8 @@ gmgm::Side gmgm::Board::winner() const {
 
     } else {
         int sz = history.size();
-        int pt = sz-5;
     
-        // Ugh.  We need our custom == operator
-        // Because KakaoJangi compares (piece,destination) rather
-        // than (source,destination)
-        // note that if we capture something successfully it doesn't count
-        // as repeativie move (do we?)
-        auto move_equals = [this](const Move & x, const Move &y) {
-            return (x.piece == y.piece && x.yx_to == y.yx_to);
-        };
-        if(pt >= 0) {
+        if(sz >= 5) {
             const auto & mv = history[sz-1].move;
             if(mv.is_pass()) {
                 // pass doesn't count as repeatitive move
@@ -899,16 +886,7 @@ gmgm::Side gmgm::Board::winner() const {
                    || mv.piece == 16 || mv.piece == 17 || mv.piece == 18) {
                 // goong and sa doesn't count as repeatitive move
             } else {
-                while(repeat_cnt < 2 && pt >= 0) {
-                    if(history[pt].move.is_pass()) {
-                        pt -= 4;
-                    } else if(mv.captured == 0x20 && history[pt].move.captured == 0x20 && move_equals(mv, history[pt].move)) {
-                        repeat_cnt++;
-                        pt -= 4;
-                    } else {
-                        break;
-                    }
-                }
+                repeat_cnt = history[sz-1].move_repeat;
             }
         }
         // jang doesn't count as repeat move
@@ -1184,6 +1162,14 @@ void gmgm::Board::unmove_piece_only(const gmgm::Move & m) const {
 }
 
 void gmgm::Board::move(const gmgm::Move & m) {
+    __move(m, -1);
+}
+
+void gmgm::Board::move(const gmgm::Move & m, bool was_jang) {
+    __move(m, was_jang ? 1 : 0);
+}
+
+void gmgm::Board::__move(const gmgm::Move & m, int was_jang) {
 #if 0
     {
         auto moves = get_legal_moves();
@@ -1215,7 +1201,8 @@ void gmgm::Board::move(const gmgm::Move & m) {
     apply(m.yx_from/10, m.yx_from%10, piece);
 
     // need to be called AFTER board changed
-    history.emplace_back(m, old_boardhash, old_playhash, is_jang());
+    history.emplace_back(m, old_boardhash, old_playhash, was_jang < 0 ? is_jang() : was_jang != 0);
+    update_repetition_index();
 
     switch(m.captured) {
         case 0: // Goong
@@ -1263,8 +1250,39 @@ void gmgm::Board::move(const gmgm::Move & m) {
     }
 }
 
+void gmgm::Board::update_repetition_index() {
+    int i = history.size() - 1;
+    auto & h = history[i];
+
+    if(h.move.is_pass()) {
+        h.nonpass = (i >= 4) ? history[i-4].nonpass : -1;
+    } else {
+        h.nonpass = i;
+    }
+
+    // board-based rule : same board every 4 plies
+    h.board_repeat = 1;
+    if(i >= 4 && history[i-4].boardhash == h.boardhash) {
+        h.board_repeat = std::min(3, 1 + history[i-4].board_repeat);
+    }
+
+    // KakaoJangi rule : same (piece, destination) every 4 plies, passes skipped.
+    // note that if we capture something successfully it doesn't count
+    // as repeativie move (do we?)
+    h.move_repeat = 0;
+    int j = (i >= 4) ? history[i-4].nonpass : -1;
+    if(!h.move.is_pass() && j >= 0) {
+        const auto & prev = history[j].move;
+        if(h.move.captured == 0x20 && prev.captured == 0x20
+            && h.move.piece == prev.piece && h.move.yx_to == prev.yx_to)
+        {
+            h.move_repeat = std::min(2, 1 + history[j].move_repeat);
+        }
+    }
+}
+
 bool gmgm::Board::is_jang() const {
-    auto mv = get_legal_moves_if_opponent();
+    const auto & mv = get_legal_moves_if_opponent();
     for(auto & m : mv) {
         auto piece = m.captured;
         if(m.yx_from != m.yx_to && (piece == 0x0 || piece == 0x10)) {
@@ -1276,6 +1294,9 @@ bool gmgm::Board::is_jang() const {
 
 const std::vector<gmgm::Move> & gmgm::Board::get_legal_moves() const {
     if(legal_move_cache.empty()) {
+#ifndef NDEBUG
+        movegen_stats.legal_moves++;
+#endif
         legal_move_cache.clear();
         if(globals::jang_move_is_illegal) {
             __get_legal_moves([&](int8_t yx_from_, int8_t yx_to_, int8_t captured_) {
@@ -1302,6 +1323,9 @@ const std::vector<gmgm::Move>& gmgm::Board::get_legal_moves_if_opponent() const
         return legal_move_opponent_cache;
     }
 
+#ifndef NDEBUG
+    movegen_stats.opponent_moves++;
+#endif
     legal_move_opponent_cache.clear();
 
     to_move = opponent(to_move);
@@ -24,6 +24,7 @@
 #include <deque>
 #include <iostream>
 #include <cassert>
+#include <atomic>
 
 #include <chrono>
 
@@ -33,6 +34,15 @@ class lua_State;
 
 namespace gmgm {
 
+#ifndef NDEBUG
+struct movegen_stats_t {
+    // number of legal move lists generated (cache misses on the board)
+    std::atomic<size_t> legal_moves{0};
+    std::atomic<size_t> opponent_moves{0};
+};
+extern movegen_stats_t movegen_stats;
+#endif
+
 static auto constexpr BOARD_W = 9;
 static auto constexpr BOARD_H = 10;
 
@@ -120,6 +130,16 @@ private:
         std::uint64_t boardhash;
         std::uint64_t playhash;
         bool was_jang;
+
+        // repetition index, updated incrementally on every move so that
+        // winner() doesn't have to walk back through the history.
+        // nonpass : nearest entry at this index or 4n plies before that is not a pass, -1 if none
+        // move_repeat : number of times this move was played every 4 plies in a row (passes skipped), max 2
+        // board_repeat : number of times this boardhash showed up every 4 plies in a row, max 3
+        int nonpass = -1;
+        std::int8_t move_repeat = 0;
+        std::int8_t board_repeat = 0;
+
         BoardHistory(const Move & m, std::uint64_t bh, std::uint64_t ph, bool jang) :
             move(m), boardhash(bh), playhash(ph), was_jang(jang) {}
     };
@@ -130,6 +150,9 @@ private:
     mutable std::vector<Move> legal_move_opponent_cache;
     template <typename T> void __get_legal_moves(T callback) const;
 
+    // was_jang < 0 means we don't know yet and have to check
+    void __move(const Move & m, int was_jang);
+    void update_repetition_index();
     void move_piece_only(const Move & m) const;
     void unmove_piece_only(const Move & m) const;
     Side winner_piece_only() const;
@@ -181,6 +204,12 @@ public:
 
     int get_movenum() const { return history.size(); }
     void move(const Move & m);
+    // same as move(m), but skips the jang check (and the opponent move generation
+    // it needs) when the caller already knows if the move resulted in a jang
+    void move(const Move & m, bool was_jang);
+    bool last_move_was_jang() const {
+        return !history.empty() && history.back().was_jang;
+    }
     Move unmove();
     Side get_to_move() const { return to_move; }
     Side opponent(Side x) const {
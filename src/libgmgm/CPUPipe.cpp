@@ -20,12 +20,17 @@
 */
 
 
+#include <cmath>
 #include <Eigen/Dense>
 
 #include "CPUPipe.h"
 #include "Network.h"
-#include "Im2Col.h"
 #include "Board.h"
+#include "globals.h"
+#include "PackedInput.h"
+#include "Profiler.h"
+
+using gmgm::globals::myprintf;
 
 #ifndef USE_BLAS
 // Eigen helpers
@@ -45,16 +50,53 @@ using ConstEigenMatrixMap =
 
 void CPUPipe::initialize(int channels) {
     m_input_channels = channels;
+
+    m_isa = WinogradKernels::select(gmgm::globals::cpu_simd);
+    myprintf("CPU winograd transforms : %s\n", WinogradKernels::name(m_isa));
+    m_int8_isa = Int8Kernels::select(gmgm::globals::cpu_simd);
+
+    m_threads = std::max(1u, gmgm::globals::cpu_threads);
+}
+
+gmgm::ThreadPool& CPUPipe::pool() {
+    // the calling thread always takes a share of the work, so the pool
+    // only needs the remaining m_threads - 1 threads
+    if (t_pool == nullptr || t_pool->size() != m_threads - 1) {
+        t_pool.reset();
+        t_pool = std::make_unique<gmgm::ThreadPool>();
+        t_pool->initialize(m_threads - 1);
+    }
+    return *t_pool;
+}
+
+template<class F>
+void CPUPipe::parallel_planes(const size_t batch_size, const size_t channels, F&& f) {
+    pool().parallel_for(batch_size * channels, [&f, channels](size_t begin, size_t end) {
+        while (begin < end) {
+            const auto n = begin / channels;
+            const auto c = begin % channels;
+            const auto c_end = std::min(channels, c + (end - begin));
+            f(n, c, c_end);
+            begin += c_end - c;
+        }
+    });
 }
 
 void CPUPipe::winograd_transform_in(const std::vector<float>& in,
                                     std::vector<float>& V,
-                                    const int C) {
+                                    const int C,
+                                    const int batch_size,
+                                    const int ch_begin,
+                                    const int ch_end) {
     constexpr auto W = gmgm::BOARD_W;
     constexpr auto H = gmgm::BOARD_H;
     constexpr auto WTILES = WINOGRAD_WTILES;
     constexpr auto P = WINOGRAD_P;
 
+    // positions in a batch are stacked along the tile dimension,
+    // so that the GEMMs get batch_size * P columns
+    const auto PB = P * batch_size;
+
     constexpr auto Wpad = 2 + WINOGRAD_M * WTILES;
 
     constexpr auto buffersize = 32;
@@ -94,10 +136,13 @@ void CPUPipe::winograd_transform_in(const std::vector<float>& in,
         o5 = i1 + i3 * (-5.0f/2.0f) + i5;
     };
 
-    for (auto ch = 0; ch < C; ch++) {
+    // iterating channels on the outer loop and batch entries on the inner loop
+    // means we write V in order, so the buffer below always holds a contiguous run
+    for (auto ch = ch_begin; ch < ch_end; ch++) {
+      for (auto n = 0; n < batch_size; n++) {
         for (auto yin = 0; yin < H; yin++) {
             for (auto xin = 0; xin < W; xin++) {
-                in_pad[yin + 1][xin + 1] = in[ch*(W*H) + yin*W + xin];
+                in_pad[yin + 1][xin + 1] = in[n*C*(W*H) + ch*(W*H) + yin*W + xin];
             }
         }
         for (auto block_y = 0; block_y < WTILES; block_y++) {
@@ -150,32 +195,37 @@ void CPUPipe::winograd_transform_in(const std::vector<float>& in,
                 MULTIPLY_B(5)
 
                 if (buffer_entries == 0) {
-                    buffer_offset = ch * P + block_y * WTILES + block_x;
+                    buffer_offset = ch * PB + n * P + block_y * WTILES + block_x;
                 }
                 buffer_entries++;
 
                 if (buffer_entries >= buffersize ||
-                    (ch == C - 1 && block_x == WTILES - 1 && block_y == WTILES - 1)) {
+                    (ch == ch_end - 1 && n == batch_size - 1
+                     && block_x == WTILES - 1 && block_y == WTILES - 1)) {
 
                     for (auto i = 0; i < WINOGRAD_ALPHA * WINOGRAD_ALPHA; i++) {
                         for (auto entry = 0; entry < buffer_entries; entry++) {
-                            V[i*C*P + buffer_offset + entry] = buffer[i*buffersize + entry];
+                            V[i*C*PB + buffer_offset + entry] = buffer[i*buffersize + entry];
                         }
                     }
                     buffer_entries = 0;
                 }
             }
         }
+      }
     }
 }
 
-void CPUPipe::winograd_sgemm(const std::vector<float>& U,
+void CPUPipe::winograd_sgemm(const float* U,
                              const std::vector<float>& V,
                              std::vector<float>& M,
-                             const int C, const int K) {
-    constexpr auto P = WINOGRAD_P;
+                             const int C, const int K,
+                             const int batch_size,
+                             const int tile_begin,
+                             const int tile_end) {
+    const auto P = WinogradKernels::tiles(m_tiling) * batch_size;
 
-    for (auto b = 0; b < WINOGRAD_TILE; b++) {
+    for (auto b = tile_begin; b < tile_end; b++) {
         const auto offset_u = b * K * C;
         const auto offset_v = b * C * P;
         const auto offset_m = b * K * P;
@@ -183,7 +233,7 @@ void CPUPipe::winograd_sgemm(const std::vector<float>& U,
         cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
                     K, P, C,
                     1.0f,
-                    &U[offset_u], K,
+                    U + offset_u, K,
                     &V[offset_v], P,
                     0.0f,
                     &M[offset_m], P);
@@ -191,18 +241,23 @@ void CPUPipe::winograd_sgemm(const std::vector<float>& U,
         auto C_mat = EigenMatrixMap<float>(M.data() + offset_m, P, K);
         C_mat.noalias() =
            ConstEigenMatrixMap<float>(V.data() + offset_v, P, C)
-            * ConstEigenMatrixMap<float>(U.data() + offset_u, K, C).transpose();
+            * ConstEigenMatrixMap<float>(U + offset_u, K, C).transpose();
 #endif
     }
 }
 
 void CPUPipe::winograd_transform_out(const std::vector<float>& M,
                                      std::vector<float>& Y,
-                                     const int K) {
+                                     const int K,
+                                     const int batch_size,
+                                     const int k_begin,
+                                     const int k_end,
+                                     const WinogradKernels::Epilogue& ep) {
     constexpr auto W = gmgm::BOARD_W;
     constexpr auto H = gmgm::BOARD_H;
     constexpr auto WTILES = WINOGRAD_WTILES;
     constexpr auto P = WINOGRAD_P;
+    const auto PB = P * batch_size;
 
     // multiple vector [i0..i5] by At and produce [o0..o3]
     // const auto At = std::array<float, WINOGRAD_ALPHA * WINOGRAD_M>
@@ -225,7 +280,8 @@ void CPUPipe::winograd_transform_out(const std::vector<float>& M,
         o3 = t1m2 + t3m4 + t3m4 + i5;
     };
 
-    for (auto k = 0; k < K; k++) {
+    for (auto k = k_begin; k < k_end; k++) {
+      for (auto n = 0; n < batch_size; n++) {
         for (auto block_x = 0; block_x < WTILES; block_x++) {
             const auto x = WINOGRAD_M * block_x;
             for (auto block_y = 0; block_y < WTILES; block_y++) {
@@ -238,7 +294,7 @@ void CPUPipe::winograd_transform_out(const std::vector<float>& M,
                 for (auto xi = 0; xi < WINOGRAD_ALPHA; xi++) {
                     for (auto nu = 0; nu < WINOGRAD_ALPHA; nu++) {
                         temp_m[xi][nu] =
-                            M[(xi*WINOGRAD_ALPHA + nu)*K*P + k*P + b];
+                            M[(xi*WINOGRAD_ALPHA + nu)*K*PB + k*PB + n*P + b];
                     }
                 }
                 std::array<std::array<float, WINOGRAD_ALPHA>, WINOGRAD_M> temp;
@@ -259,7 +315,7 @@ void CPUPipe::winograd_transform_out(const std::vector<float>& M,
                     );
                 }
 
-                const auto y_ind = k * H * W + y * W + x;
+                const auto y_ind = n * K * H * W + k * H * W + y * W + x;
                 for (auto i = 0; i < WINOGRAD_M; i++) {
                     for (auto j = 0; j < WINOGRAD_M; j++) {
                         if (y + i < H && x + j < W) {
@@ -269,104 +325,347 @@ void CPUPipe::winograd_transform_out(const std::vector<float>& M,
                 }
             }
         }
+        WinogradKernels::finish_plane<NUM_INTERSECTIONS>(
+            ep, &Y[n * K * H * W + k * H * W], n, k, K);
+      }
     }
 }
 
-void CPUPipe::winograd_convolve3(const int outputs,
+void CPUPipe::winograd_sgemm16(const std::vector<uint16_t>& U,
+                               const std::vector<float>& V,
+                               std::vector<float>& M,
+                               const int C, const int K,
+                               const int batch_size,
+                               const int tile_begin,
+                               const int tile_end) {
+    const auto P = WinogradKernels::tiles(m_tiling) * batch_size;
+    if (WinogradKernels::sgemm16(m_isa, m_weight_storage, U.data(), V.data(), M.data(),
+                                 C, K, P, tile_begin, tile_end)) {
+        return;
+    }
+
+    // no vector kernel for this one, widen a tile at a time and use the fp32 path
+    std::vector<float> Uf(WinogradKernels::tile_elements(m_tiling) * K * C);
+    for (auto b = tile_begin; b < tile_end; b++) {
+        for (auto i = b * K * C; i < (b + 1) * K * C; i++) {
+            Uf[i] = WinogradKernels::widen(m_weight_storage, U[i]);
+        }
+    }
+    winograd_sgemm(Uf.data(), V, M, C, K, batch_size, tile_begin, tile_end);
+}
+
+void CPUPipe::winograd_convolve3(const size_t layer,
+                                 const int outputs,
                                  const std::vector<float>& input,
-                                 const std::vector<float>& U,
                                  std::vector<float>& V,
                                  std::vector<float>& M,
-                                 std::vector<float>& output) {
+                                 std::vector<float>& output,
+                                 const int batch_size,
+                                 const WinogradKernels::Epilogue& ep,
+                                 const WinogradKernels::Layout in_layout,
+                                 const WinogradKernels::Layout out_layout) {
+
+    const auto filter_len = static_cast<size_t>(WinogradKernels::tile_elements(m_tiling));
+    const auto f4x4 = m_tiling == WinogradKernels::Tiling::F4X4;
+    const auto use_16bit = !m_weights->m_conv_weights_16.empty();
+    const auto U = use_16bit
+        ? std::make_pair(static_cast<const float*>(nullptr), m_weights->m_conv_weights_16[layer].size())
+        : m_weights->conv_weights(layer);
+    const auto input_channels = U.second / (outputs * filter_len);
+
+    // transforms split by channel, GEMMs split by tile.  blocked activations
+    // are split on whole blocks
+    const auto width = static_cast<size_t>(WinogradKernels::block_width(m_isa));
+    const auto in_step = in_layout == WinogradKernels::Layout::BLOCKED ? width : 1;
+    const auto out_step = out_layout == WinogradKernels::Layout::BLOCKED ? width : 1;
+
+    const auto P = static_cast<double>(WinogradKernels::tiles(m_tiling)) * batch_size;
+    const auto in_bytes = 4.0 * input_channels * NUM_INTERSECTIONS * batch_size;
+    const auto out_bytes = 4.0 * outputs * NUM_INTERSECTIONS * batch_size;
+    const auto V_bytes = 4.0 * filter_len * input_channels * P;
+    const auto M_bytes = 4.0 * filter_len * outputs * P;
+    const auto U_bytes = (use_16bit ? 2.0 : 4.0) * filter_len * input_channels * outputs;
+
+    Profiler::Timer t_in(Profiler::Kind::KERNEL, "cpu", m_profile_net, "wino_in", -1, in_bytes + V_bytes);
+    pool().parallel_for(input_channels / in_step, [&](size_t begin, size_t end) {
+        begin *= in_step;
+        end *= in_step;
+        if (!f4x4) {
+            WinogradKernels::transform_in(m_isa, m_tiling, input.data(), V.data(),
+                                          input_channels, batch_size, begin, end, in_layout);
+        } else if (!WinogradKernels::transform_in(m_isa, input.data(), V.data(),
+                                                  input_channels, batch_size, begin, end,
+                                                  in_layout)) {
+            winograd_transform_in(input, V, input_channels, batch_size, begin, end);
+        }
+    });
+    t_in.stop();
+
+    Profiler::Timer t_gemm(Profiler::Kind::KERNEL, "cpu", m_profile_net, "sgemm", -1, U_bytes + V_bytes + M_bytes,
+                           2.0 * filter_len * input_channels * outputs * P);
+    pool().parallel_for(filter_len, [&](size_t begin, size_t end) {
+        if (use_16bit) {
+            winograd_sgemm16(m_weights->m_conv_weights_16[layer], V, M,
+                             input_channels, outputs, batch_size, begin, end);
+        } else {
+            winograd_sgemm(U.first, V, M,
+                           input_channels, outputs, batch_size, begin, end);
+        }
+    });
+    t_gemm.stop();
+
+    Profiler::Timer t_out(Profiler::Kind::KERNEL, "cpu", m_profile_net, "wino_out", -1, M_bytes + out_bytes);
+    pool().parallel_for(outputs / out_step, [&](size_t begin, size_t end) {
+        begin *= out_step;
+        end *= out_step;
+        if (!f4x4) {
+            WinogradKernels::transform_out(m_isa, m_tiling, M.data(), output.data(),
+                                           outputs, batch_size, begin, end, ep, out_layout);
+        } else if (!WinogradKernels::transform_out(m_isa, M.data(), output.data(),
+                                                   outputs, batch_size, begin, end, ep,
+                                                   out_layout)) {
+            winograd_transform_out(M, output, outputs, batch_size, begin, end, ep);
+        }
+    });
+}
 
-    constexpr unsigned int filter_len = WINOGRAD_ALPHA * WINOGRAD_ALPHA;
-    const auto input_channels = U.size() / (outputs * filter_len);
+void CPUPipe::convolve3(const size_t layer,
+                        const int outputs,
+                        const std::vector<float>& input,
+                        std::vector<float>& V,
+                        std::vector<float>& M,
+                        std::vector<float>& output,
+                        const int batch_size,
+                        const WinogradKernels::Epilogue& ep,
+                        const WinogradKernels::Layout in_layout,
+                        const WinogradKernels::Layout out_layout) {
+    if (m_act_max != nullptr) {
+        auto & act_max = (*m_act_max)[layer];
+        for (auto x : input) {
+            act_max = std::max(act_max, x);
+        }
+    }
 
-    winograd_transform_in(input, V, input_channels);
-    winograd_sgemm(U, V, M, input_channels, outputs);
-    winograd_transform_out(M, output, outputs);
+    // layer 0 is the input convolution, then two per residual block
+    const auto int8 = m_use_int8 && !m_int8_layers.empty();
+    const auto channels = input.size() / (NUM_INTERSECTIONS * batch_size);
+    const auto weight_bytes = int8 ? static_cast<double>(m_int8_layers[layer].weights.size())
+        : !m_weights->m_conv_weights_16.empty() ? 2.0 * m_weights->m_conv_weights_16[layer].size()
+        : 4.0 * m_weights->conv_weights(layer).second;
+    Profiler::Timer t(Profiler::Kind::LAYER, "cpu", m_profile_net,
+                      layer == 0 ? "input_conv" : layer % 2 == 1 ? "res_conv1" : "res_conv2",
+                      layer == 0 ? -1 : static_cast<int>((layer - 1) / 2),
+                      4.0 * (channels + outputs) * NUM_INTERSECTIONS * batch_size + weight_bytes,
+                      2.0 * 9 * channels * outputs * NUM_INTERSECTIONS * batch_size);
+    if (int8) {
+        int8_convolve3(m_int8_layers[layer], outputs, input, output, batch_size, ep);
+    } else {
+        winograd_convolve3(layer, outputs, input, V, M, output, batch_size, ep,
+                           in_layout, out_layout);
+    }
 }
 
-template<unsigned int filter_size>
-void convolve(const size_t outputs,
-              const std::vector<float>& input,
-              const std::vector<float>& weights,
-              const std::vector<float>& biases,
-              std::vector<float>& output) {
-    // The size of the board is defined at compile time
-    constexpr unsigned int width = gmgm::BOARD_W;
-    constexpr unsigned int height = gmgm::BOARD_H;
-    constexpr auto num_intersections = width * height;
-    constexpr auto filter_len = filter_size * filter_size;
-    const auto input_channels = weights.size() / (biases.size() * filter_len);
-    const auto filter_dim = filter_len * input_channels;
-    assert(outputs * num_intersections == output.size());
-
-    std::vector<float> col(filter_dim * width * height);
-    im2col<filter_size>(input_channels, input, col);
-
-    // Weight shape (output, input, filter_size, filter_size)
-    // 96 18 3 3
-    // C←αAB + βC
-    // outputs[96,19x19] = weights[96,18x3x3] x col[18x3x3,19x19]
-    // M Number of rows in matrices A and C.
-    // N Number of columns in matrices B and C.
-    // K Number of columns in matrix A; number of rows in matrix B.
-    // lda The size of the first dimention of matrix A; if you are
-    // passing a matrix A[m][n], the value should be m.
-    //    cblas_sgemm(CblasRowMajor, TransA, TransB, M, N, K, alpha, A, lda, B,
-    //                ldb, beta, C, N);
-#ifdef USE_BLAS
-    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
-                // M        N            K
-                outputs, num_intersections, filter_dim,
-                1.0f, &weights[0], filter_dim,
-                &col[0], num_intersections,
-                0.0f, &output[0], num_intersections);
-#else
-    auto C_mat = EigenMatrixMap<float>(output.data(),
-                                       num_intersections, outputs);
-    C_mat.noalias() =
-        ConstEigenMatrixMap<float>(col.data(), num_intersections, filter_dim)
-        * ConstEigenMatrixMap<float>(weights.data(), filter_dim, outputs);
-#endif
+void CPUPipe::int8_convolve3(const Int8Layer& layer,
+                             const int outputs,
+                             const std::vector<float>& input,
+                             std::vector<float>& output,
+                             const int batch_size,
+                             const WinogradKernels::Epilogue& ep) {
+    constexpr auto W = gmgm::BOARD_W;
+    constexpr auto H = gmgm::BOARD_H;
+    const auto C = layer.channels;
+    const auto kpad = layer.kpad;
+    const auto npix = batch_size * NUM_INTERSECTIONS;
+
+    auto & ws = t_workspace;
+    auto & rows = ws.im2row;
+    auto & acc = ws.int8_acc;
+    rows.resize(npix * kpad);
+    acc.resize(outputs * npix);
+
+    // one row per output pixel holding its 3x3 neighbourhood of every input
+    // channel, in the same [channel][ky][kx] order as the raw filters
+    Profiler::Timer t_rows(Profiler::Kind::KERNEL, "cpu", m_profile_net, "int8_im2row", -1,
+                           4.0 * C * npix + 1.0 * kpad * npix);
+    pool().parallel_for(npix, [&](size_t begin, size_t end) {
+        for (auto p = begin; p < end; p++) {
+            const auto n = p / NUM_INTERSECTIONS;
+            const auto y = (p % NUM_INTERSECTIONS) / W;
+            const auto x = (p % NUM_INTERSECTIONS) % W;
+            const auto row = &rows[p * kpad];
+            for (auto c = 0; c < C; c++) {
+                const auto plane = &input[(n * C + c) * NUM_INTERSECTIONS];
+                for (auto ky = 0; ky < 3; ky++) {
+                    for (auto kx = 0; kx < 3; kx++) {
+                        const auto yy = static_cast<int>(y) + ky - 1;
+                        const auto xx = static_cast<int>(x) + kx - 1;
+                        auto q = 0;
+                        if (yy >= 0 && yy < H && xx >= 0 && xx < W) {
+                            q = static_cast<int>(plane[yy * W + xx] * layer.act_quant + 0.5f);
+                            q = std::min(127, std::max(0, q));
+                        }
+                        row[c * 9 + ky * 3 + kx] = static_cast<uint8_t>(q);
+                    }
+                }
+            }
+            std::fill(row + C * 9, row + kpad, 0);
+        }
+    });
+    t_rows.stop();
+
+    Profiler::Timer t_gemm(Profiler::Kind::KERNEL, "cpu", m_profile_net, "int8_gemm", -1,
+                           1.0 * layer.weights.size() + 1.0 * kpad * npix + 4.0 * outputs * npix,
+                           2.0 * kpad * outputs * npix);
+    pool().parallel_for(npix, [&](size_t begin, size_t end) {
+        Int8Kernels::gemm(m_int8_isa, layer.weights.data(), rows.data(), acc.data(),
+                          kpad, outputs, begin, end);
+    });
+    t_gemm.stop();
+
+    Profiler::Timer t_out(Profiler::Kind::KERNEL, "cpu", m_profile_net, "int8_out", -1, 8.0 * outputs * npix);
+    pool().parallel_for(outputs, [&](size_t begin, size_t end) {
+        for (auto k = begin; k < end; k++) {
+            const auto scale = layer.scales[k];
+            for (auto n = 0; n < batch_size; n++) {
+                const auto plane = &output[(n * outputs + k) * NUM_INTERSECTIONS];
+                const auto src = &acc[n * NUM_INTERSECTIONS * outputs + k];
+                for (auto b = 0; b < NUM_INTERSECTIONS; b++) {
+                    plane[b] = src[b * outputs] * scale;
+                }
+                WinogradKernels::finish_plane<NUM_INTERSECTIONS>(ep, plane, n, k, outputs);
+            }
+        }
+    });
+}
+
+// the tail of an SE block (channel scale, residual add and relu) for one
+// block of channels in the blocked layout : data and eltwise are [90][WIDTH]
+// and scale is [WIDTH], so every step is a full width vector operation
+template <size_t WIDTH>
+void se_tail_blocked(float* const data,
+                     const float* const eltwise,
+                     const float* const scale) {
+    for (auto b = size_t{0}; b < NUM_INTERSECTIONS; b++) {
+        const auto arr = &data[b * WIDTH];
+        const auto res = &eltwise[b * WIDTH];
+        for (auto j = size_t{0}; j < WIDTH; j++) {
+            const auto val = arr[j] * scale[j] + res[j];
+            arr[j] = val > 0.0f ? val : 0.0f;
+        }
+    }
+}
+
+// one [90][width] block of the blocked layout back to width NCHW planes
+void unblock(const size_t width, const float* const in, float* const out) {
+    for (auto j = size_t{0}; j < width; j++) {
+        for (auto b = size_t{0}; b < NUM_INTERSECTIONS; b++) {
+            out[j * NUM_INTERSECTIONS + b] = in[b * width + j];
+        }
+    }
+}
 
-    for (unsigned int o = 0; o < outputs; o++) {
-        for (unsigned int b = 0; b < num_intersections; b++) {
-            output[(o * num_intersections) + b] += biases[o];
+// the kernels whose trip counts depend on the width of the tower.  CHANNELS
+// is one of the common widths, so that every matrix has a compile time size
+// and Eigen fully unrolls the channel loops, or 0 for the generic version
+// which takes the width at runtime
+template <int CHANNELS>
+struct TowerKernels {
+    static constexpr int C = CHANNELS != 0 ? CHANNELS : Eigen::Dynamic;
+    static constexpr int SE = CHANNELS != 0 ? CHANNELS / 8 : Eigen::Dynamic;
+
+    // squeeze and excitation of one position : the channel averages avg
+    // go through both fully connected layers, scale gets the sigmoid of
+    // the result.  mid is scratch space for the channels / 8 hidden units
+    static void se(const int channels, const float* avg, const float* w1,
+                   const float* w2, float* mid, float* scale) {
+        const auto se_channels = channels / 8;
+        using Avg = Eigen::Matrix<float, C, 1>;
+        using Mid = Eigen::Matrix<float, SE, 1>;
+        using W1 = Eigen::Matrix<float, SE, C, Eigen::RowMajor>;
+        using W2 = Eigen::Matrix<float, C, SE, Eigen::RowMajor>;
+        auto hidden = Eigen::Map<Mid>(mid, se_channels);
+        hidden.noalias() = Eigen::Map<const W1>(w1, se_channels, channels)
+                           * Eigen::Map<const Avg>(avg, channels);
+        hidden = hidden.cwiseMax(0.0f);
+        auto out = Eigen::Map<Avg>(scale, channels);
+        out.noalias() = Eigen::Map<const W2>(w2, channels, se_channels) * hidden;
+        for (auto c = 0; c < channels; c++) {
+            scale[c] = 1.0f / (1.0f + exp(-scale[c]));
         }
     }
+
+    // 1x1 convolution of a single position.  input is [channels][intersections],
+    // which is exactly the column matrix a 1x1 filter needs, so no im2col here.
+    // weights / biases / output point at the first output channel to compute,
+    // so a subset of the outputs can be done at a time.
+    static void convolve1(const size_t outputs, const int channels,
+                          const float* input, const float* weights,
+                          const float* biases, float* output) {
+        using In = Eigen::Matrix<float, NUM_INTERSECTIONS, C>;
+        using W = Eigen::Matrix<float, C, Eigen::Dynamic>;
+        auto y = EigenMatrixMap<float>(output, NUM_INTERSECTIONS, outputs);
+        y.noalias() = Eigen::Map<const In>(input, NUM_INTERSECTIONS, channels)
+                      * Eigen::Map<const W>(weights, channels, outputs);
+        for (auto o = size_t{0}; o < outputs; o++) {
+            for (auto b = 0; b < NUM_INTERSECTIONS; b++) {
+                output[o * NUM_INTERSECTIONS + b] += biases[o];
+            }
+        }
+    }
+};
+
+template <int CHANNELS>
+static CPUPipe::ChannelKernels channel_kernels() {
+    return {CHANNELS, TowerKernels<CHANNELS>::se, TowerKernels<CHANNELS>::convolve1};
+}
+
+static CPUPipe::ChannelKernels select_channel_kernels(const int channels) {
+    switch (channels) {
+        case 64: return channel_kernels<64>();
+        case 128: return channel_kernels<128>();
+        case 192: return channel_kernels<192>();
+        case 256: return channel_kernels<256>();
+        default: return channel_kernels<0>();
+    }
 }
 
+// fully connected layer over a whole batch.  input is [batch_size][inputs],
+// output is [batch_size][outputs], so this is a single GEMM rather than batch_size GEMVs.
 template<unsigned int inputs,
          unsigned int outputs,
          bool ReLU>
-std::vector<float> innerproduct(const std::vector<float>& input,
-                                const std::vector<float>& weights,
-                                const std::vector<float>& biases) {
-    std::vector<float> output(outputs);
-
-    EigenVectorMap<float> y(output.data(), outputs);
-    y.noalias() =
-        ConstEigenMatrixMap<float>(weights.data(),
-                                   inputs,
-                                   outputs).transpose()
-        * ConstEigenVectorMap<float>(input.data(), inputs);
-    const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
-                                                          val : 0.0f; };
-    for (unsigned int o = 0; o < outputs; o++) {
-        auto val = biases[o] + output[o];
-        if (ReLU) {
-            val = lambda_ReLU(val);
+void innerproduct(const std::vector<float>& input,
+                  const std::vector<float>& weights,
+                  const std::vector<float>& biases,
+                  std::vector<float>& output,
+                  const size_t batch_size,
+                  gmgm::ThreadPool& pool) {
+    output.resize(outputs * batch_size);
+
+    // split by output rows
+    pool.parallel_for(outputs, [&](size_t begin, size_t end) {
+        EigenMatrixMap<float> y(output.data(), outputs, batch_size);
+        y.middleRows(begin, end - begin).noalias() =
+            ConstEigenMatrixMap<float>(weights.data(),
+                                       inputs,
+                                       outputs).middleCols(begin, end - begin).transpose()
+            * ConstEigenMatrixMap<float>(input.data(), inputs, batch_size);
+        const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
+                                                              val : 0.0f; };
+        for (auto n = size_t{0}; n < batch_size; n++) {
+            for (auto o = begin; o < end; o++) {
+                auto val = biases[o] + output[n * outputs + o];
+                if (ReLU) {
+                    val = lambda_ReLU(val);
+                }
+                output[n * outputs + o] = val;
+            }
         }
-        output[o] = val;
-    }
-
-    return output;
+    });
 }
 
 template <size_t spatial_size>
-void relu(const size_t channels, std::vector<float>& data) {
+void relu(const size_t channels, float* const data) {
     const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
                                                           val : 0.0f; };
     for (auto c = size_t{0}; c < channels; ++c) {
@@ -377,19 +676,9 @@ void relu(const size_t channels, std::vector<float>& data) {
     }
 }
 
-template <size_t spatial_size>
-void sigmoid(const size_t channels, std::vector<float>& data) {
-    for (auto c = size_t{0}; c < channels; ++c) {
-        const auto arr = &data[c * spatial_size];
-        for (auto b = size_t{0}; b < spatial_size; b++) {
-            arr[b] = 1.0f / (1.0f + exp(-arr[b]));
-        }
-    }
-}
-
 template <size_t spatial_size>
 void eltwise_add(const size_t channels,
-               std::vector<float>& data,
+               float* const data,
                const float* const eltwise) {
     for (auto c = size_t{0}; c < channels; ++c) {
         const auto arr = &data[c * spatial_size];
@@ -402,7 +691,7 @@ void eltwise_add(const size_t channels,
 
 template <size_t spatial_size>
 void channel_scale(const size_t channels,
-               std::vector<float>& data,
+               float* const data,
                const float* const scale) {
     for (auto c = size_t{0}; c < channels; ++c) {
         const auto arr = &data[c * spatial_size];
@@ -412,28 +701,52 @@ void channel_scale(const size_t channels,
     }
 }
 
-template <size_t spatial_size>
-std::vector<float> channel_average(
-               const size_t channels,
-               std::vector<float>& data) {
-    std::vector<float> ret;
-    ret.reserve(channels);
-    for (auto c = size_t{0}; c < channels; ++c) {
-        const auto arr = &data[c * spatial_size];
-        float sum=0;
-        for (auto b = size_t{0}; b < spatial_size; b++) {
-            sum += arr[b];
+// the policy fully connected layer, only for the rows of legal moves.  the
+// legal move planes of the input are laid out like the policy outputs, so
+// they tell which rows are needed.  rows are computed for the whole batch if
+// any position needs them (each row is loaded once that way) and everything
+// else is left 0, as Network::process_output() ignores it
+void legal_policy_innerproduct(const std::vector<float>& net_input,
+                               const std::vector<float>& input,
+                               const std::vector<float>& weights,
+                               const std::vector<float>& biases,
+                               std::vector<float>& output,
+                               std::vector<int>& rows,
+                               const size_t batch_size,
+                               gmgm::ThreadPool& pool) {
+    constexpr auto inputs = 16 * NUM_INTERSECTIONS;
+    constexpr auto outputs = POTENTIAL_MOVES;
+    constexpr auto in_size = Network::INPUT_CHANNELS * NUM_INTERSECTIONS;
+    constexpr auto legal_offset = Network::INPUT_LEGAL_PLANE * NUM_INTERSECTIONS;
+
+    rows.clear();
+    for (auto o = 0; o < outputs; o++) {
+        for (auto n = size_t{0}; n < batch_size; n++) {
+            if (net_input[n * in_size + legal_offset + o] > 0.5f) {
+                rows.push_back(o);
+                break;
+            }
         }
-        ret.push_back(sum / spatial_size);
     }
-    return ret;
-}
-
 
+    output.assign(outputs * batch_size, 0.0f);
+    const auto x = ConstEigenMatrixMap<float>(input.data(), inputs, batch_size);
+    pool.parallel_for(rows.size(), [&](size_t begin, size_t end) {
+        Eigen::VectorXf y(batch_size);
+        for (auto r = begin; r < end; r++) {
+            const auto o = rows[r];
+            y.noalias() = x.transpose()
+                * ConstEigenVectorMap<float>(weights.data() + o * inputs, inputs);
+            for (auto n = size_t{0}; n < batch_size; n++) {
+                output[n * outputs + o] = y[n] + biases[o];
+            }
+        }
+    });
+}
 
 template <size_t spatial_size>
 void batchnorm(const size_t channels,
-               std::vector<float>& data,
+               float* const data,
                const float* const means,
                const float* const stddevs) {
     for (auto c = size_t{0}; c < channels; ++c) {
@@ -447,11 +760,39 @@ void batchnorm(const size_t channels,
     }
 }
 
+thread_local CPUPipe::Workspace CPUPipe::t_workspace;
+thread_local std::unique_ptr<gmgm::ThreadPool> CPUPipe::t_pool;
+
 void CPUPipe::forward(const std::vector<float>& input,
                       std::vector<float>& output_pol,
                       std::vector<float>& output_val) {
+    forward(input, output_pol, output_val, 1);
+}
+
+void CPUPipe::forward_packed(const std::vector<std::uint64_t>& packed,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val,
+                             const size_t batch_size) {
+    auto & input = t_workspace.input;
+    input.resize(PackedInput::BITS * batch_size);
+    {
+        Profiler::Timer t(Profiler::Kind::LAYER, "cpu", m_profile_net, "unpack_input", -1,
+                          (8.0 * PackedInput::WORDS + 4.0 * PackedInput::BITS) * batch_size);
+        pool().parallel_for(batch_size, [&](size_t begin, size_t end) {
+            PackedInput::unpack(m_isa, packed.data() + begin * PackedInput::WORDS,
+                                input.data() + begin * PackedInput::BITS, end - begin);
+        });
+    }
+    forward(input, output_pol, output_val, batch_size);
+}
+
+void CPUPipe::forward(const std::vector<float>& input,
+                      std::vector<float>& output_pol,
+                      std::vector<float>& output_val,
+                      const size_t batch_size) {
     // Input convolution
-    constexpr auto P = WINOGRAD_P;
+    const auto P = WinogradKernels::tiles(m_tiling);
+    const auto tile_len = WinogradKernels::tile_elements(m_tiling);
     // Calculate output channels
     const auto output_channels = m_input_channels;
     // input_channels is the maximum number of input channels of any
@@ -459,88 +800,172 @@ void CPUPipe::forward(const std::vector<float>& input,
     // might be bigger when the network has very few filters
     const auto input_channels = std::max(static_cast<size_t>(output_channels),
                                          static_cast<size_t>(Network::INPUT_CHANNELS));
-    auto conv_out = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-
-    auto V = std::vector<float>(WINOGRAD_TILE * input_channels * P);
-    auto M = std::vector<float>(WINOGRAD_TILE * output_channels * P);
-
-    winograd_convolve3(output_channels, input, m_weights->m_conv_weights[0], V, M, conv_out);
-    batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                 m_weights->m_batchnorm_means[0].data(),
-                                 m_weights->m_batchnorm_stddevs[0].data());
-    relu<NUM_INTERSECTIONS>(output_channels, conv_out);
+    const auto n_batch = static_cast<int>(batch_size);
+    const auto plane_size = output_channels * NUM_INTERSECTIONS;
+
+    // everything below lives in the calling thread's workspace, which only
+    // ever grows, so steady state evaluation does not touch the heap.
+    // pool threads reach it through these references, never through t_workspace
+    auto & ws = t_workspace;
+    auto & V = ws.V;
+    auto & M = ws.M;
+    auto & conv_out = ws.conv_out;
+    auto & conv_in = ws.conv_in;
+    auto & res = ws.res;
+    auto & se_avg = ws.se_avg;
+    auto & se_mid = ws.se_mid;
+    auto & se_end = ws.se_end;
+    V.resize(tile_len * input_channels * P * batch_size);
+    M.resize(tile_len * output_channels * P * batch_size);
+    conv_out.resize(plane_size * batch_size);
+    conv_in.resize(plane_size * batch_size);
+    res.resize(plane_size * batch_size);
+    se_avg.resize(output_channels * batch_size);
+    se_mid.resize(output_channels / 8 * batch_size);
+    se_end.resize(output_channels * batch_size);
+
+    // the int8 tower only reads NCHW
+    using WinogradKernels::Layout;
+    const auto int8 = m_use_int8 && !m_int8_layers.empty();
+    const auto layout = int8 ? Layout::NCHW : m_layout;
+    const auto width = static_cast<size_t>(WinogradKernels::block_width(m_isa));
+
+    WinogradKernels::Epilogue ep;
+    ep.means = m_weights->m_batchnorm_means[0].data();
+    ep.stddevs = m_weights->m_batchnorm_stddevs[0].data();
+    ep.relu = true;
+    convolve3(0, output_channels, input, V, M, conv_out, n_batch, ep, Layout::NCHW, layout);
 
     // Residual tower
-    auto conv_in = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-    auto res = std::vector<float>(output_channels * NUM_INTERSECTIONS);
-    for (auto i = size_t{1}; i < m_weights->m_conv_weights.size(); i += 2) {
+    for (auto i = size_t{1}; i < m_weights->m_batchnorm_means.size(); i += 2) {
         auto output_channels = m_input_channels;
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           m_weights->m_conv_weights[i], V, M, conv_out);
-        batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                     m_weights->m_batchnorm_means[i].data(),
-                                     m_weights->m_batchnorm_stddevs[i].data());
-        relu<NUM_INTERSECTIONS>(output_channels, conv_out);
+        WinogradKernels::Epilogue ep1;
+        ep1.means = m_weights->m_batchnorm_means[i].data();
+        ep1.stddevs = m_weights->m_batchnorm_stddevs[i].data();
+        ep1.relu = true;
+        convolve3(i, output_channels, conv_in, V, M, conv_out, n_batch, ep1, layout, layout);
         assert(m_weights->m_squeeze_1[i].size() == 0);
 
         std::swap(conv_in, res);
         std::swap(conv_out, conv_in);
-        winograd_convolve3(output_channels, conv_in,
-                           m_weights->m_conv_weights[i + 1], V, M, conv_out);
-        batchnorm<NUM_INTERSECTIONS>(output_channels, conv_out,
-                                     m_weights->m_batchnorm_means[i + 1].data(),
-                                     m_weights->m_batchnorm_stddevs[i + 1].data());
-        if(m_weights->m_squeeze_1[i + 1].size() > 0) {
-            auto w = m_weights->m_squeeze_1[i+1].data();
-            auto avg = channel_average<NUM_INTERSECTIONS>(output_channels, conv_out);
-            std::vector<float> mid;
-            mid.resize(output_channels/8);
-            for(auto y=0; y<output_channels/8; y++) {
-                float f = 0.0f;
-                for(auto x=0; x<output_channels; x++) {
-                    f += avg[x] * w[y * output_channels + x];
+
+        // without SE the whole tail of the block (BN, residual, relu) happens
+        // in the output transform.  with SE only BN and the pooling can, as the
+        // channel scale needs every channel pooled first.
+        const auto use_se = m_weights->m_squeeze_1[i + 1].size() > 0;
+        WinogradKernels::Epilogue ep2;
+        ep2.means = m_weights->m_batchnorm_means[i + 1].data();
+        ep2.stddevs = m_weights->m_batchnorm_stddevs[i + 1].data();
+        if (use_se) {
+            ep2.pool = se_avg.data();
+        } else {
+            ep2.residual = res.data();
+            ep2.relu = true;
+        }
+        convolve3(i + 1, output_channels, conv_in, V, M, conv_out, n_batch, ep2, layout, layout);
+        if (use_se) {
+            const auto se_channels = output_channels / 8;
+            const auto w1 = m_weights->m_squeeze_1[i+1].data();
+            const auto w2 = m_weights->m_squeeze_2[i+1].data();
+            Profiler::Timer t(Profiler::Kind::LAYER, "cpu", m_profile_net, "se", static_cast<int>((i - 1) / 2),
+                              4.0 * 3 * plane_size * batch_size
+                                  + 4.0 * 2 * se_channels * output_channels,
+                              4.0 * se_channels * output_channels * batch_size);
+            pool().parallel_for(batch_size, [&](size_t begin, size_t end) {
+                for (auto n = begin; n < end; n++) {
+                    m_kernels.se(output_channels, &se_avg[n * output_channels], w1, w2,
+                                 &se_mid[n * se_channels], &se_end[n * output_channels]);
                 }
-                mid[y] = f;
+            });
+            if (layout == Layout::BLOCKED) {
+                parallel_planes(batch_size, output_channels / width, [&](size_t n, size_t c, size_t c_end) {
+                    for (; c < c_end; c++) {
+                        const auto offset = n * plane_size + c * width * NUM_INTERSECTIONS;
+                        const auto scale = &se_end[n * output_channels + c * width];
+                        if (width == 16) {
+                            se_tail_blocked<16>(&conv_out[offset], &res[offset], scale);
+                        } else {
+                            se_tail_blocked<8>(&conv_out[offset], &res[offset], scale);
+                        }
+                    }
+                });
+            } else {
+                parallel_planes(batch_size, output_channels, [&](size_t n, size_t c, size_t c_end) {
+                    const auto offset = n * plane_size + c * NUM_INTERSECTIONS;
+                    const auto out = &conv_out[offset];
+                    channel_scale<NUM_INTERSECTIONS>(c_end - c, out, &se_end[n * output_channels + c]);
+                    eltwise_add<NUM_INTERSECTIONS>(c_end - c, out, &res[offset]);
+                    relu<NUM_INTERSECTIONS>(c_end - c, out);
+                });
             }
-            relu<1>(output_channels/8, mid);
-            auto w2 = m_weights->m_squeeze_2[i+1].data();
-            std::vector<float> end;
-            end.resize(output_channels);
-            for(auto y=0; y<output_channels; y++) {
-                float f = 0.0f;
-                for(auto x=0; x<output_channels/8; x++) {
-                    f += mid[x] * w2[y * (output_channels/8) + x];
-                }
-                end[y] = f;
+        }
+    }
+    // the heads read NCHW planes
+    if (layout == Layout::BLOCKED) {
+        Profiler::Timer t(Profiler::Kind::LAYER, "cpu", m_profile_net, "unblock", -1,
+                          4.0 * 2 * plane_size * batch_size);
+        parallel_planes(batch_size, output_channels / width, [&](size_t n, size_t c, size_t c_end) {
+            for (; c < c_end; c++) {
+                const auto offset = n * plane_size + c * width * NUM_INTERSECTIONS;
+                unblock(width, &conv_out[offset], &conv_in[offset]);
             }
-            sigmoid<1>(output_channels, end);
+        });
+        std::swap(conv_out, conv_in);
+    }
 
-            channel_scale<NUM_INTERSECTIONS>(output_channels, conv_out, end.data());
+    auto & policy_data = ws.policy_data;
+    auto & value_data = ws.value_data;
+    policy_data.resize(16*NUM_INTERSECTIONS*batch_size);
+    value_data.resize(1*NUM_INTERSECTIONS*batch_size);
+    // 16 policy planes plus one value plane per position
+    constexpr auto head_channels = 16 + 1;
+    Profiler::Timer t_heads(Profiler::Kind::LAYER, "cpu", m_profile_net, "heads_conv", -1,
+                            4.0 * (plane_size + head_channels * NUM_INTERSECTIONS) * batch_size,
+                            2.0 * output_channels * head_channels * NUM_INTERSECTIONS * batch_size);
+    parallel_planes(batch_size, head_channels, [&](size_t n, size_t c, size_t c_end) {
+        const auto in = &conv_out[n * plane_size];
+        if (c < 16) {
+            const auto pc_end = std::min(c_end, size_t{16});
+            const auto pol = &policy_data[n * 16 * NUM_INTERSECTIONS + c * NUM_INTERSECTIONS];
+            m_kernels.convolve1(pc_end - c, output_channels, in,
+                                m_conv_pol_w.data() + c * output_channels,
+                                m_conv_pol_b.data() + c, pol);
+            batchnorm<NUM_INTERSECTIONS>(pc_end - c, pol,
+                m_weights->m_bn_pol_w1.data() + c, m_weights->m_bn_pol_w2.data() + c);
+            relu<NUM_INTERSECTIONS>(pc_end - c, pol);
         }
-        eltwise_add<NUM_INTERSECTIONS>(output_channels, conv_out, res.data());
-        relu<NUM_INTERSECTIONS>(output_channels, conv_out);
-    }
-    std::vector<float> policy_data(16*NUM_INTERSECTIONS);
-    std::vector<float> value_data(1*NUM_INTERSECTIONS);
-    convolve<1>(16, conv_out, m_conv_pol_w, m_conv_pol_b, policy_data);
-    convolve<1>(1, conv_out, m_conv_val_w, m_conv_val_b, value_data);
-
-    batchnorm<NUM_INTERSECTIONS>(16, policy_data,
-        m_weights->m_bn_pol_w1.data(), m_weights->m_bn_pol_w2.data());
-    relu<NUM_INTERSECTIONS>(16, policy_data);
-    output_pol =
-        innerproduct<16 * NUM_INTERSECTIONS, POTENTIAL_MOVES, false>(
-            policy_data, m_weights->m_ip_pol_w, m_weights->m_ip_pol_b);
+        if (c_end == head_channels) {
+            const auto val = &value_data[n * NUM_INTERSECTIONS];
+            m_kernels.convolve1(1, output_channels, in,
+                                m_conv_val_w.data(), m_conv_val_b.data(), val);
+            batchnorm<NUM_INTERSECTIONS>(1, val,
+                m_weights->m_bn_val_w1.data(), m_weights->m_bn_val_w2.data());
+            relu<NUM_INTERSECTIONS>(1, val);
+        }
+    });
+    t_heads.stop();
+
+    // only the rows of legal moves are read, so the cost is known afterwards
+    Profiler::Timer t_pol(Profiler::Kind::LAYER, "cpu", m_profile_net, "policy_fc");
+    legal_policy_innerproduct(input, policy_data, m_weights->m_ip_pol_w, m_weights->m_ip_pol_b,
+                              output_pol, ws.policy_rows, batch_size, pool());
+    const auto policy_in = 16.0 * NUM_INTERSECTIONS;
+    t_pol.set_cost(4.0 * ws.policy_rows.size() * policy_in + 4.0 * policy_in * batch_size,
+                   2.0 * ws.policy_rows.size() * policy_in * batch_size);
+    t_pol.stop();
 
     // Now get the value
-    batchnorm<NUM_INTERSECTIONS>(1, value_data,
-        m_weights->m_bn_val_w1.data(), m_weights->m_bn_val_w2.data());
-    relu<NUM_INTERSECTIONS>(1, value_data);
-    output_val =
-        innerproduct<1 * NUM_INTERSECTIONS, Network::OUTPUTS_VALUE, true>(
-            value_data, m_weights->m_ip_val_w, m_weights->m_ip_val_b);
-
+    Profiler::Timer t_val(Profiler::Kind::LAYER, "cpu", m_profile_net, "value_fc", -1,
+                          4.0 * NUM_INTERSECTIONS * Network::OUTPUTS_VALUE,
+                          2.0 * NUM_INTERSECTIONS * Network::OUTPUTS_VALUE * batch_size);
+    auto & value_hidden = ws.value_hidden;
+    innerproduct<1 * NUM_INTERSECTIONS, Network::OUTPUTS_VALUE, true>(
+        value_data, m_weights->m_ip_val_w, m_weights->m_ip_val_b, value_hidden, batch_size, pool());
+    output_val.resize(batch_size);
+    for (auto n = size_t{0}; n < batch_size; n++) {
+        output_val[n] = m_weights->value_output(&value_hidden[n * Network::OUTPUTS_VALUE]);
+    }
 }
 
 void CPUPipe::push_weights(unsigned int /*filter_size*/,
@@ -549,11 +974,93 @@ void CPUPipe::push_weights(unsigned int /*filter_size*/,
                            std::shared_ptr<const ForwardPipeWeights> weights) {
 
     m_weights = weights;
+    if (m_tiling != weights->m_winograd_tiling) {
+        myprintf("CPU winograd tiling : %s\n", WinogradKernels::name(weights->m_winograd_tiling));
+    }
+    m_tiling = weights->m_winograd_tiling;
+    m_weight_storage = weights->m_conv_weights_bf16 ? WinogradKernels::Storage::BF16
+                                                    : WinogradKernels::Storage::FP16;
+
+    if (m_kernels.channels != static_cast<int>(outputs)) {
+        m_kernels = select_channel_kernels(outputs);
+        if (m_kernels.channels == 0) {
+            myprintf("No CPU kernels specialized for %u channels, using the generic ones.\n", outputs);
+        }
+    }
+
+    m_layout = WinogradKernels::Layout::NCHW;
+    if (gmgm::globals::cpu_layout == "blocked") {
+        const auto width = WinogradKernels::block_width(m_isa);
+        if (width != 0 && outputs % width == 0) {
+            m_layout = WinogradKernels::Layout::BLOCKED;
+        } else {
+            myprintf("Blocked activations need avx2 or avx512 and a multiple of %d channels, using nchw.\n",
+                     std::max(width, 8));
+        }
+    }
 
     // Output head convolutions
     m_conv_pol_w = weights->m_conv_pol_w;
     m_conv_pol_b.resize(m_conv_pol_w.size() / outputs, 0.0f);
     m_conv_val_w = weights->m_conv_val_w;
     m_conv_val_b.resize(m_conv_val_w.size() / outputs, 0.0f);
+
+    prepare_int8();
+}
+
+void CPUPipe::use_int8(bool enable) {
+    m_use_int8 = enable;
+    if (m_weights != nullptr) {
+        prepare_int8();
+    }
+}
+
+void CPUPipe::prepare_int8() {
+    m_int8_layers.clear();
+    if (!m_use_int8) {
+        return;
+    }
+    if (m_weights->m_conv_weights_raw.empty() || m_weights->m_int8_act_max.empty()) {
+        myprintf("int8 requested but the net is not calibrated, running fp32.\n");
+        return;
+    }
+
+    const auto outputs = m_input_channels;
+    for (auto l = size_t{0}; l < m_weights->m_conv_weights_raw.size(); l++) {
+        const auto & f = m_weights->m_conv_weights_raw[l];
+        Int8Layer layer;
+        layer.channels = f.size() / (9 * outputs);
+        const auto kdim = layer.channels * 9;
+        layer.kpad = (kdim + Int8Kernels::ROW_ALIGN - 1)
+                     / Int8Kernels::ROW_ALIGN * Int8Kernels::ROW_ALIGN;
+
+        // activations are quantized to [0, 127] over [0, act_max]
+        auto act_max = m_weights->m_int8_act_max[l];
+        if (act_max <= 0.0f) {
+            act_max = 1.0f;
+        }
+        const auto act_scale = act_max / 127.0f;
+        layer.act_quant = 1.0f / act_scale;
+
+        std::vector<int8_t> weights(outputs * layer.kpad, 0);
+        layer.scales.resize(outputs);
+        for (auto k = 0; k < outputs; k++) {
+            const auto wk = &f[k * kdim];
+            auto w_max = 0.0f;
+            for (auto i = 0; i < kdim; i++) {
+                w_max = std::max(w_max, std::abs(wk[i]));
+            }
+            const auto w_scale = (w_max > 0.0f) ? w_max / 127.0f : 1.0f;
+            for (auto i = 0; i < kdim; i++) {
+                weights[k * layer.kpad + i] =
+                    static_cast<int8_t>(std::lround(wk[i] / w_scale));
+            }
+            layer.scales[k] = w_scale * act_scale;
+        }
+        layer.weights.resize(weights.size());
+        Int8Kernels::pack(weights.data(), outputs, layer.kpad, layer.weights.data());
+        m_int8_layers.emplace_back(std::move(layer));
+    }
+    myprintf("CPU int8 convolutions : %s\n", Int8Kernels::name(m_int8_isa));
 }
 
@@ -23,10 +23,15 @@
 #ifndef CPUPIPE_H_INCLUDED
 #define CPUPIPE_H_INCLUDED
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <cassert>
 
 #include "ForwardPipe.h"
+#include "ThreadPool.h"
+#include "WinogradKernels.h"
+#include "Int8Kernels.h"
 
 class CPUPipe : public ForwardPipe {
 public:
@@ -35,30 +40,134 @@ public:
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val);
 
+    // batched forward : input is batch_size positions concatenated, and
+    // output_pol / output_val are resized to batch_size results concatenated.
+    // output_val gets one value per position, before tanh.  output_pol is
+    // only computed for legal moves, see legal_policy_innerproduct()
+    void forward(const std::vector<float>& input,
+                 std::vector<float>& output_pol,
+                 std::vector<float>& output_val,
+                 const size_t batch_size);
+    // same, the input being batch_size positions of PackedInput::WORDS
+    // words each.  they get expanded to floats in the workspace
+    void forward_packed(const std::vector<std::uint64_t>& packed,
+                        std::vector<float>& output_pol,
+                        std::vector<float>& output_val,
+                        const size_t batch_size);
+
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights);
+
+    // run the 3x3 convolutions in int8.  only takes effect if the pushed
+    // weights carry raw filters and calibrated activations, fp32 otherwise
+    void use_int8(bool enable);
+
+    // which net the profiler files this pipe's samples under, see
+    // Profiler::net_name().  "main" by default
+    void set_profile_net(const char * net) { m_profile_net = net; }
+
+    // threads a single forward is split across, the calling one included.
+    // initialize() sets it to cpu_threads
+    void set_threads(unsigned int threads) { m_threads = std::max(1u, threads); }
+
+    // while set, every forward raises act_max[i] to the largest input
+    // activation seen by 3x3 convolution i.  used for int8 calibration
+    void record_activations(std::vector<float>* act_max) { m_act_max = act_max; }
+
+    // tower kernels compiled for a fixed channel count, see TowerKernels
+    // in CPUPipe.cpp.  channels is 0 for the generic set
+    struct ChannelKernels {
+        int channels;
+        void (*se)(int channels, const float* avg, const float* w1,
+                   const float* w2, float* mid, float* scale);
+        void (*convolve1)(size_t outputs, int channels,
+                          const float* input, const float* weights,
+                          const float* biases, float* output);
+    };
 private:
+    struct Int8Layer {
+        int channels;
+        // channels * 9 rounded up to Int8Kernels::ROW_ALIGN
+        int kpad;
+        // [outputs][kpad] packed by Int8Kernels::pack(), quantized with
+        // a scale per output channel
+        std::vector<int8_t> weights;
+        // per output channel : weight scale * activation scale
+        std::vector<float> scales;
+        // multiply an activation by this to get its quantized value
+        float act_quant;
+    };
+
+    void prepare_int8();
+    void int8_convolve3(const Int8Layer& layer,
+                        const int outputs,
+                        const std::vector<float>& input,
+                        std::vector<float>& output,
+                        const int batch_size,
+                        const WinogradKernels::Epilogue& ep);
+
+    // 3x3 convolution number 'layer' of the tower, in int8 or through winograd.
+    // the layouts are NCHW for int8
+    void convolve3(const size_t layer,
+                   const int outputs,
+                   const std::vector<float>& input,
+                   std::vector<float>& V,
+                   std::vector<float>& M,
+                   std::vector<float>& output,
+                   const int batch_size,
+                   const WinogradKernels::Epilogue& ep,
+                   const WinogradKernels::Layout in_layout,
+                   const WinogradKernels::Layout out_layout);
+
     void winograd_transform_in(const std::vector<float>& in,
                                std::vector<float>& V,
-                               const int C);
+                               const int C,
+                               const int batch_size,
+                               const int ch_begin,
+                               const int ch_end);
 
-    void winograd_sgemm(const std::vector<float>& U,
+    void winograd_sgemm(const float* U,
                         const std::vector<float>& V,
                         std::vector<float>& M,
-                        const int C, const int K);
+                        const int C, const int K,
+                        const int batch_size,
+                        const int tile_begin,
+                        const int tile_end);
+
+    // same, with U in m_weight_storage
+    void winograd_sgemm16(const std::vector<uint16_t>& U,
+                          const std::vector<float>& V,
+                          std::vector<float>& M,
+                          const int C, const int K,
+                          const int batch_size,
+                          const int tile_begin,
+                          const int tile_end);
 
     void winograd_transform_out(const std::vector<float>& M,
                                 std::vector<float>& Y,
-                                const int K);
-
-    void winograd_convolve3(const int outputs,
+                                const int K,
+                                const int batch_size,
+                                const int k_begin,
+                                const int k_end,
+                                const WinogradKernels::Epilogue& ep);
+
+    void winograd_convolve3(const size_t layer,
+                            const int outputs,
                             const std::vector<float>& input,
-                            const std::vector<float>& U,
                             std::vector<float>& V,
                             std::vector<float>& M,
-                            std::vector<float>& output);
+                            std::vector<float>& output,
+                            const int batch_size,
+                            const WinogradKernels::Epilogue& ep,
+                            const WinogradKernels::Layout in_layout,
+                            const WinogradKernels::Layout out_layout);
+
+    // runs f(n, c_begin, c_end) over every channel of every batch entry,
+    // split across pool()
+    template<class F>
+    void parallel_planes(const size_t batch_size, const size_t channels, F&& f);
 
 
     int m_input_channels;
@@ -70,5 +179,56 @@ private:
     std::vector<float> m_conv_val_w;
     std::vector<float> m_conv_pol_b;
     std::vector<float> m_conv_val_b;
+
+    // scratch buffers for one forward pass, one set per calling thread
+    struct Workspace {
+        std::vector<float> input;
+        std::vector<float> V;
+        std::vector<float> M;
+        std::vector<float> conv_out;
+        std::vector<float> conv_in;
+        std::vector<float> res;
+        std::vector<float> se_avg;
+        std::vector<float> se_mid;
+        std::vector<float> se_end;
+        std::vector<float> policy_data;
+        std::vector<float> value_data;
+        std::vector<float> value_hidden;
+        std::vector<int> policy_rows;
+        std::vector<uint8_t> im2row;
+        std::vector<int32_t> int8_acc;
+    };
+    static thread_local Workspace t_workspace;
+
+    // SIMD flavour of the winograd transforms, picked at initialize()
+    WinogradKernels::Isa m_isa = WinogradKernels::Isa::SCALAR;
+
+    // activation layout of the residual tower, see cpu_layout.  the input
+    // and the heads stay NCHW
+    WinogradKernels::Layout m_layout = WinogradKernels::Layout::NCHW;
+
+    // picked at push_weights() for the width of the net
+    ChannelKernels m_kernels{-1, nullptr, nullptr};
+
+    // winograd tiling the pushed weights were transformed for
+    WinogradKernels::Tiling m_tiling = WinogradKernels::Tiling::F4X4;
+
+    // format of m_weights->m_conv_weights_16, if the net came with those
+    WinogradKernels::Storage m_weight_storage = WinogradKernels::Storage::FP16;
+
+    bool m_use_int8 = false;
+    Int8Kernels::Isa m_int8_isa = Int8Kernels::Isa::SCALAR;
+    std::vector<Int8Layer> m_int8_layers;
+    std::vector<float>* m_act_max = nullptr;
+
+    // intra-op threads, used to split a single forward across cores.  every
+    // thread calling into the pipe gets its own m_threads - 1 helpers, so
+    // concurrent batches (one per CPUScheduler worker) never queue behind
+    // each other.  pool() creates them on first use
+    unsigned int m_threads = 1;
+
+    const char * m_profile_net = "main";
+    static thread_local std::unique_ptr<gmgm::ThreadPool> t_pool;
+    gmgm::ThreadPool& pool();
 };
 #endif
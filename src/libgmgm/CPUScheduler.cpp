@@ -0,0 +1,190 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cassert>
+
+#include "CPUScheduler.h"
+#include "Network.h"
+#include "globals.h"
+#include "Profiler.h"
+
+using gmgm::globals::myprintf;
+
+CPUScheduler::CPUScheduler() {
+    auto num_cores = num_batch_workers();
+
+    // keep enough evals in flight so that every worker gets a full batch
+    gmgm::globals::num_scheduler_threads = gmgm::globals::batch_size * num_cores * 2;
+}
+
+unsigned int CPUScheduler::num_batch_workers() {
+    // each worker splits its forward pass across cpu_threads cores
+    auto num_cores = std::max(1u, std::thread::hardware_concurrency());
+    return std::max(1u, num_cores / std::max(1u, gmgm::globals::cpu_threads));
+}
+
+CPUScheduler::~CPUScheduler() {
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_running = false;
+    }
+    m_cv.notify_all();
+    for (auto & x : m_worker_threads) {
+        x.join();
+    }
+}
+
+void CPUScheduler::initialize(const int) {
+    auto num_worker_threads = num_batch_workers();
+    myprintf("CPU scheduler threads : %u x %u\n", num_worker_threads,
+             std::max(1u, gmgm::globals::cpu_threads));
+    for (auto i = unsigned{0}; i < num_worker_threads; i++) {
+        m_worker_threads.emplace_back(&CPUScheduler::batch_worker, this);
+    }
+}
+
+void CPUScheduler::push_weights(unsigned int filter_size,
+                                unsigned int channels,
+                                unsigned int outputs,
+                                std::shared_ptr<const ForwardPipeWeights> weights) {
+    push_net_weights(0, filter_size, channels, outputs, weights);
+}
+
+void CPUScheduler::push_net_weights(int net,
+                                    unsigned int filter_size,
+                                    unsigned int channels,
+                                    unsigned int outputs,
+                                    std::shared_ptr<const ForwardPipeWeights> weights) {
+    // all the preparation (int8 packing) happens before taking
+    // the lock, so the workers never wait on it
+    auto pipe = std::make_shared<CPUPipe>();
+    pipe->initialize(outputs);
+    pipe->use_int8(gmgm::globals::cpu_precision == "int8");
+    pipe->set_profile_net(Profiler::net_name(net));
+    pipe->push_weights(filter_size, channels, outputs, weights);
+
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_pipes[net] = std::move(pipe);
+    }
+    m_cv.notify_all();
+}
+
+void CPUScheduler::forward(const std::vector<float>& input,
+                           std::vector<float>& output_pol,
+                           std::vector<float>& output_val) {
+    forward_net(0, input, output_pol, output_val);
+}
+
+void CPUScheduler::forward_net(int net,
+                               const std::vector<float>& input,
+                               std::vector<float>& output_pol,
+                               std::vector<float>& output_val) {
+    assert(net >= 0 && net < NUM_NETS);
+    run(std::make_shared<ForwardQueueEntry>(net, input, output_pol, output_val));
+}
+
+void CPUScheduler::forward_fill(int net,
+                                const InputFiller& fill,
+                                std::vector<float>& output_pol,
+                                std::vector<float>& output_val) {
+    assert(net >= 0 && net < NUM_NETS);
+    run(std::make_shared<ForwardQueueEntry>(net, fill, output_pol, output_val));
+}
+
+// queues the eval and waits until a worker is done with it
+void CPUScheduler::run(std::shared_ptr<ForwardQueueEntry> entry) {
+    {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_forward_queue.push_back(entry);
+    }
+    m_cv.notify_one();
+
+    std::unique_lock<std::mutex> lk(entry->mutex);
+    entry->cv.wait(lk, [&entry] () { return entry->done; });
+}
+
+void CPUScheduler::batch_worker() {
+    std::vector<std::uint64_t> batch_input;
+    std::vector<float> batch_output_pol;
+    std::vector<float> batch_output_val;
+
+    while (true) {
+        std::list<std::shared_ptr<ForwardQueueEntry>> inputs;
+        std::shared_ptr<CPUPipe> pipe;
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_cv.wait(lk, [this] () {
+                return !m_running || (!m_forward_queue.empty()
+                                      && m_pipes[m_forward_queue.front()->net] != nullptr);
+            });
+            if (!m_running) {
+                return;
+            }
+            // the oldest eval picks the net, so neither net can starve the other
+            const auto net = m_forward_queue.front()->net;
+            pipe = m_pipes[net];
+
+            const auto max_count = static_cast<size_t>(std::max(1u, gmgm::globals::batch_size));
+            for (auto it = begin(m_forward_queue);
+                 it != end(m_forward_queue) && inputs.size() < max_count; ) {
+                auto next = std::next(it);
+                if ((*it)->net == net) {
+                    inputs.splice(end(inputs), m_forward_queue, it);
+                }
+                it = next;
+            }
+        }
+
+        // stack everything we picked up into one batch so that the
+        // winograd GEMMs run over all positions at once.  fill entries
+        // write their features straight into their slot.  the batch stays
+        // packed until the pipe expands it
+        const auto count = inputs.size();
+        constexpr auto in_size = PackedInput::WORDS;
+        constexpr auto out_pol_size = Network::OUTPUTS_POLICY;
+        constexpr auto out_val_size = 1;
+        batch_input.resize(in_size * count);
+        auto index = size_t{0};
+        for (auto & x : inputs) {
+            const auto slot = batch_input.data() + in_size * index;
+            if (x->fill != nullptr) {
+                (*x->fill)(slot);
+            } else {
+                PackedInput::pack(x->in->data(), slot);
+            }
+            index++;
+        }
+
+        pipe->forward_packed(batch_input, batch_output_pol, batch_output_val, count);
+
+        index = 0;
+        for (auto & x : inputs) {
+            x->out_p.assign(begin(batch_output_pol) + out_pol_size * index,
+                            begin(batch_output_pol) + out_pol_size * (index + 1));
+            x->out_v.assign(begin(batch_output_val) + out_val_size * index,
+                            begin(batch_output_val) + out_val_size * (index + 1));
+            {
+                std::unique_lock<std::mutex> lk(x->mutex);
+                x->done = true;
+            }
+            x->cv.notify_all();
+            index++;
+        }
+    }
+}
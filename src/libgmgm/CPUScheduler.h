@@ -0,0 +1,111 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CPUSCHEDULER_H_INCLUDED
+#define CPUSCHEDULER_H_INCLUDED
+
+#include <array>
+#include <list>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ForwardPipe.h"
+#include "CPUPipe.h"
+
+// batching evaluator for CPU-only hosts.  one worker per core picks up
+// whatever is queued (up to batch_size positions) and runs it on a CPUPipe.
+// there is no point in waiting for a full batch here, as in the OpenCL
+// scheduler : evals pile up on their own while the workers are busy.
+// with cpu_threads > 1 there are proportionally fewer workers, and each
+// splits its forward passes with cpu_threads - 1 CPUPipe helper threads of
+// its own, so workers and helpers together cover every core.
+// push_weights() builds a whole new CPUPipe and swaps it in between batches,
+// so a new net can be loaded while the search keeps running.
+// a second net for the cascade gets its own CPUPipe.  workers pick up the
+// oldest eval and batch it with the queued evals of the same net.
+class CPUScheduler : public ForwardPipe {
+    class ForwardQueueEntry {
+    public:
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done = false;
+        int net;
+        // one of the two is set : the input, or what writes it
+        const std::vector<float>* in = nullptr;
+        const InputFiller* fill = nullptr;
+        std::vector<float>& out_p;
+        std::vector<float>& out_v;
+        ForwardQueueEntry(int net_index,
+                          const std::vector<float>& input,
+                          std::vector<float>& output_pol,
+                          std::vector<float>& output_val)
+        : net(net_index), in(&input), out_p(output_pol), out_v(output_val)
+          {}
+        ForwardQueueEntry(int net_index,
+                          const InputFiller& filler,
+                          std::vector<float>& output_pol,
+                          std::vector<float>& output_val)
+        : net(net_index), fill(&filler), out_p(output_pol), out_v(output_val)
+          {}
+    };
+public:
+    virtual ~CPUScheduler();
+    CPUScheduler();
+
+    virtual void initialize(const int channels);
+    virtual void forward(const std::vector<float>& input,
+                         std::vector<float>& output_pol,
+                         std::vector<float>& output_val);
+    virtual void push_weights(unsigned int filter_size,
+                              unsigned int channels,
+                              unsigned int outputs,
+                              std::shared_ptr<const ForwardPipeWeights> weights);
+    virtual bool supports_second_net() { return true; }
+    virtual void push_net_weights(int net,
+                                  unsigned int filter_size,
+                                  unsigned int channels,
+                                  unsigned int outputs,
+                                  std::shared_ptr<const ForwardPipeWeights> weights);
+    virtual void forward_net(int net,
+                             const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val);
+    virtual void forward_fill(int net,
+                              const InputFiller& fill,
+                              std::vector<float>& output_pol,
+                              std::vector<float>& output_val);
+private:
+    bool m_running = true;
+    // lock protected, one per net.  workers take a reference at batch
+    // pickup, so an old pipe lives until its last batch is done
+    std::array<std::shared_ptr<CPUPipe>, NUM_NETS> m_pipes;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    std::list<std::shared_ptr<ForwardQueueEntry>> m_forward_queue;
+    std::list<std::thread> m_worker_threads;
+
+    void run(std::shared_ptr<ForwardQueueEntry> entry);
+    void batch_worker();
+    static unsigned int num_batch_workers();
+};
+
+#endif
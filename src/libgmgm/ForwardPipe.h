@@ -24,9 +24,17 @@
 #ifndef FORWARDPIPE_H_INCLUDED
 #define FORWARDPIPE_H_INCLUDED
 
+#include <cassert>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
+#include "PackedInput.h"
+#include "WinogradKernels.h"
+
 class ForwardPipe {
 public:
     class ForwardPipeWeights {
@@ -55,8 +63,58 @@ public:
         std::vector<float> m_bn_val_w2;
         std::vector<float> m_ip_val_w;
         std::vector<float> m_ip_val_b;
+        std::vector<float> m_ip2_val_w;
+        std::vector<float> m_ip2_val_b;
+
+        // last value head layer : relu, then the single output fully
+        // connected layer.  the pipes apply this themselves so that an eval
+        // never mixes two nets across a weight swap.  returns the winrate
+        // before tanh
+        float value_output(const float* hidden) const {
+            auto sum = m_ip2_val_b[0];
+            for (auto i = size_t{0}; i < m_ip2_val_w.size(); i++) {
+                sum += m_ip2_val_w[i] * (hidden[i] > 0.0f ? hidden[i] : 0.0f);
+            }
+            return sum;
+        }
+
+        // binary nets : the transformed 3x3 weights (data, size) stay in the
+        // mapped file, shared by every process that maps it, and
+        // m_conv_weights is left empty.  m_mapping keeps the file mapped
+        std::vector<std::pair<const float*, size_t>> m_conv_weights_mapped;
+        std::shared_ptr<const void> m_mapping;
+
+        size_t conv_layers() const {
+            return m_batchnorm_means.size();
+        }
+        // transformed 3x3 weights of a layer, from wherever they are
+        std::pair<const float*, size_t> conv_weights(size_t layer) const {
+            if (!m_conv_weights_mapped.empty()) {
+                return m_conv_weights_mapped[layer];
+            }
+            return {m_conv_weights[layer].data(), m_conv_weights[layer].size()};
+        }
+
+        // cpu backend with 16 bit weight storage : m_conv_weights rounded
+        // to fp16 (or bf16 if m_conv_weights_bf16), m_conv_weights being
+        // left empty
+        std::vector<std::vector<uint16_t>> m_conv_weights_16;
+        bool m_conv_weights_bf16{false};
+
+        // how the 3x3 weights were transformed.  anything but F4X4 is
+        // cpu backend only
+        WinogradKernels::Tiling m_winograd_tiling{WinogradKernels::Tiling::F4X4};
+
+        // int8 cpu tower only : 3x3 filters before the winograd transform, and
+        // the calibrated max input activation of each of those convolutions
+        std::vector<std::vector<float>> m_conv_weights_raw;
+        std::vector<float> m_int8_act_max;
     };
 
+    // called with the raw outputs of a speculative eval
+    using SpeculativeCallback = std::function<void(std::vector<float>& output_pol,
+                                                   std::vector<float>& output_val)>;
+
     virtual ~ForwardPipe() = default;
 
     virtual void initialize(const int channels) = 0;
@@ -64,10 +122,64 @@ public:
     virtual void forward(const std::vector<float>& input,
                          std::vector<float>& output_pol,
                          std::vector<float>& output_val) = 0;
+    // output_val is a single value (the winrate before tanh) per position.
+    // inputs are 0 or 1, as the schedulers pack them (see PackedInput).
+    // schedulers may get push_weights() again while evals are running : evals
+    // already picked up finish on the old weights, later ones use the new
+    // weights.  the channel count stays the same
     virtual void push_weights(unsigned int filter_size,
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights) = 0;
+
+    // two net cascade : schedulers may hold a second net (net 1, usually a
+    // larger one) next to the main net (net 0).  both share the queue and
+    // the workers, but a batch never mixes the two.  speculative evals are
+    // main net only.  the second net has its own channel count
+    static constexpr auto NUM_NETS = 2;
+    virtual bool supports_second_net() { return false; }
+    virtual void push_net_weights(int net,
+                                  unsigned int filter_size,
+                                  unsigned int channels,
+                                  unsigned int outputs,
+                                  std::shared_ptr<const ForwardPipeWeights> weights) {
+        if (net != 0) {
+            throw std::runtime_error("This backend can't hold a second net");
+        }
+        push_weights(filter_size, channels, outputs, weights);
+    }
+    virtual void forward_net(int net,
+                             const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val) {
+        assert(net == 0);
+        (void)net;
+        forward(input, output_pol, output_val);
+    }
+
+    // same as forward_net(), except that the input is written by fill
+    // straight to where the pipe wants it (for the schedulers, the slot of
+    // the batch buffer) instead of being copied there.  fill is called once,
+    // possibly from a worker thread while forward_fill() waits, and writes
+    // PackedInput::WORDS words
+    using InputFiller = std::function<void(std::uint64_t* packed)>;
+    virtual void forward_fill(int net,
+                              const InputFiller& fill,
+                              std::vector<float>& output_pol,
+                              std::vector<float>& output_val) {
+        thread_local std::vector<std::uint64_t> packed(PackedInput::WORDS);
+        thread_local std::vector<float> input(PackedInput::BITS);
+        fill(packed.data());
+        PackedInput::unpack(WinogradKernels::Isa::SCALAR, packed.data(), input.data(), 1);
+        forward_net(net, input, output_pol, output_val);
+    }
+
+    // speculative evals are never waited on.  pipes that batch evals use them to fill
+    // batch slots that would otherwise go idle, and call the callback from their own
+    // thread once done.  forward_speculative() returns false if the eval was not queued.
+    // the input is packed, see PackedInput
+    virtual bool can_forward_speculative() { return false; }
+    virtual bool forward_speculative(std::vector<std::uint64_t>&&, SpeculativeCallback) { return false; }
 };
 
 #endif
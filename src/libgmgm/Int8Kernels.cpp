@@ -0,0 +1,230 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INT8_X86 1
+#endif
+
+#include <cstring>
+
+#include "Int8Kernels.h"
+
+namespace Int8Kernels {
+
+void pack(const int8_t* w, int K, int kpad, int8_t* packed) {
+    for (auto g = 0; g < kpad / 4; g++) {
+        for (auto k = 0; k < K; k++) {
+            for (auto r = 0; r < 4; r++) {
+                packed[(g * K + k) * 4 + r] = w[k * kpad + g * 4 + r];
+            }
+        }
+    }
+}
+
+static void gemm_scalar(const int8_t* w, const uint8_t* a, int32_t* out,
+                        int kpad, int K, int p_begin, int p_end) {
+    for (auto p = p_begin; p < p_end; p++) {
+        const auto ap = a + p * kpad;
+        const auto op = out + p * K;
+        for (auto k = 0; k < K; k++) {
+            op[k] = 0;
+        }
+        for (auto g = 0; g < kpad / 4; g++) {
+            const auto wg = w + g * K * 4;
+            for (auto k = 0; k < K; k++) {
+                auto acc = 0;
+                for (auto r = 0; r < 4; r++) {
+                    acc += static_cast<int32_t>(wg[k * 4 + r]) * static_cast<int32_t>(ap[g * 4 + r]);
+                }
+                op[k] += acc;
+            }
+        }
+    }
+}
+
+#ifdef INT8_X86
+
+// the vector versions keep NP pixels x NK vectors of output channels in
+// registers.  each step broadcasts 4 activation bytes of a pixel and
+// multiplies them against 4 weight bytes of every output channel in the vector.
+
+template <int NP, int NK>
+__attribute__((target("avx2")))
+static inline void block_avx2(const int8_t* w, const uint8_t* a, int32_t* out,
+                              int kpad, int K, int p, int k) {
+    __m256i acc[NP][NK];
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            acc[i][j] = _mm256_setzero_si256();
+        }
+    }
+    const auto ones = _mm256_set1_epi16(1);
+    for (auto g = 0; g < kpad / 4; g++) {
+        __m256i vw[NK];
+        for (auto j = 0; j < NK; j++) {
+            vw[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + (g * K + k + 8 * j) * 4));
+        }
+        for (auto i = 0; i < NP; i++) {
+            int32_t av;
+            std::memcpy(&av, a + (p + i) * kpad + g * 4, 4);
+            const auto va = _mm256_set1_epi32(av);
+            for (auto j = 0; j < NK; j++) {
+                // u8 x s8 -> pairwise s16 sums, which fit as activations are <= 127
+                const auto pairs = _mm256_maddubs_epi16(va, vw[j]);
+                acc[i][j] = _mm256_add_epi32(acc[i][j], _mm256_madd_epi16(pairs, ones));
+            }
+        }
+    }
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + (p + i) * K + k + 8 * j), acc[i][j]);
+        }
+    }
+}
+
+template <int NK>
+__attribute__((target("avx2")))
+static inline void pixels_avx2(const int8_t* w, const uint8_t* a, int32_t* out,
+                               int kpad, int K, int p_begin, int p_end, int k) {
+    auto p = p_begin;
+    for (; p + 4 <= p_end; p += 4) {
+        block_avx2<4, NK>(w, a, out, kpad, K, p, k);
+    }
+    for (; p < p_end; p++) {
+        block_avx2<1, NK>(w, a, out, kpad, K, p, k);
+    }
+}
+
+__attribute__((target("avx2")))
+static void gemm_avx2(const int8_t* w, const uint8_t* a, int32_t* out,
+                      int kpad, int K, int p_begin, int p_end) {
+    auto k = 0;
+    for (; k + 32 <= K; k += 32) {
+        pixels_avx2<4>(w, a, out, kpad, K, p_begin, p_end, k);
+    }
+    for (; k < K; k += 8) {
+        pixels_avx2<1>(w, a, out, kpad, K, p_begin, p_end, k);
+    }
+}
+
+template <int NP, int NK>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static inline void block_vnni(const int8_t* w, const uint8_t* a, int32_t* out,
+                              int kpad, int K, int p, int k) {
+    __m512i acc[NP][NK];
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            acc[i][j] = _mm512_setzero_si512();
+        }
+    }
+    for (auto g = 0; g < kpad / 4; g++) {
+        __m512i vw[NK];
+        for (auto j = 0; j < NK; j++) {
+            vw[j] = _mm512_loadu_si512(w + (g * K + k + 16 * j) * 4);
+        }
+        for (auto i = 0; i < NP; i++) {
+            int32_t av;
+            std::memcpy(&av, a + (p + i) * kpad + g * 4, 4);
+            const auto va = _mm512_set1_epi32(av);
+            for (auto j = 0; j < NK; j++) {
+                acc[i][j] = _mm512_dpbusd_epi32(acc[i][j], va, vw[j]);
+            }
+        }
+    }
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            _mm512_storeu_si512(out + (p + i) * K + k + 16 * j, acc[i][j]);
+        }
+    }
+}
+
+template <int NK>
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static inline void pixels_vnni(const int8_t* w, const uint8_t* a, int32_t* out,
+                               int kpad, int K, int p_begin, int p_end, int k) {
+    auto p = p_begin;
+    for (; p + 4 <= p_end; p += 4) {
+        block_vnni<4, NK>(w, a, out, kpad, K, p, k);
+    }
+    for (; p < p_end; p++) {
+        block_vnni<1, NK>(w, a, out, kpad, K, p, k);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void gemm_vnni(const int8_t* w, const uint8_t* a, int32_t* out,
+                      int kpad, int K, int p_begin, int p_end) {
+    auto k = 0;
+    for (; k + 64 <= K; k += 64) {
+        pixels_vnni<4>(w, a, out, kpad, K, p_begin, p_end, k);
+    }
+    for (; k < K; k += 16) {
+        pixels_vnni<1>(w, a, out, kpad, K, p_begin, p_end, k);
+    }
+}
+
+#endif
+
+Isa select(const std::string & requested) {
+#ifdef INT8_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw")
+        && (requested == "auto" || requested == "avx512")) {
+        return Isa::AVX512_VNNI;
+    }
+    if (__builtin_cpu_supports("avx2") && requested != "scalar") {
+        return Isa::AVX2;
+    }
+#else
+    (void)requested;
+#endif
+    return Isa::SCALAR;
+}
+
+const char * name(Isa isa) {
+    switch (isa) {
+        case Isa::AVX512_VNNI: return "avx512-vnni";
+        case Isa::AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+void gemm(Isa isa, const int8_t* w, const uint8_t* a, int32_t* out,
+          int kpad, int K, int p_begin, int p_end) {
+    switch (isa) {
+#ifdef INT8_X86
+        case Isa::AVX512_VNNI:
+            if (K % 16 == 0) {
+                gemm_vnni(w, a, out, kpad, K, p_begin, p_end);
+                return;
+            }
+            // fall through
+        case Isa::AVX2:
+            if (K % 8 == 0) {
+                gemm_avx2(w, a, out, kpad, K, p_begin, p_end);
+                return;
+            }
+            break;
+#endif
+        default:
+            break;
+    }
+    gemm_scalar(w, a, out, kpad, K, p_begin, p_end);
+}
+
+}
@@ -0,0 +1,55 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INT8KERNELS_H_INCLUDED
+#define INT8KERNELS_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+// integer dot product kernels for the int8 cpu tower.
+//
+// activations are unsigned and quantized to [0, 127] - they always come out
+// of a relu (or are the 0/1 input planes), and staying within 7 bits means the
+// AVX2 u8 x s8 -> s16 pair sums can never saturate, so every instruction set
+// gives bit-identical results.  weights are signed, in [-127, 127].
+namespace Int8Kernels {
+    enum class Isa {
+        SCALAR,
+        AVX2,
+        AVX512_VNNI
+    };
+
+    // activation rows passed to gemm() must be padded (with zeros) to a multiple of this
+    constexpr auto ROW_ALIGN = 4;
+
+    // same choices as WinogradKernels::select, so cpu_simd covers both
+    Isa select(const std::string & requested);
+    const char * name(Isa isa);
+
+    // reorders w ([K][kpad]) into the layout gemm() wants : for every group
+    // of 4 input bytes, those 4 bytes of every output channel back to back.
+    // packed must hold K * kpad bytes
+    void pack(const int8_t* w, int K, int kpad, int8_t* packed);
+
+    // out[p * K + k] = sum_i w[k][i] * a[p * kpad + i]
+    // for p in [p_begin, p_end) and every output channel k, w being packed
+    void gemm(Isa isa, const int8_t* w, const uint8_t* a, int32_t* out,
+              int kpad, int K, int p_begin, int p_end);
+}
+
+#endif
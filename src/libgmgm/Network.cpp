@@ -21,16 +21,35 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <boost/utility.hpp>
 #include <boost/format.hpp>
-#include <boost/spirit/home/x3.hpp>
 #include <Eigen/Dense>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "globals.h"
 
@@ -39,9 +58,10 @@
 
 #include "Network.h"
 #include "CPUPipe.h"
+#include "CPUScheduler.h"
 #include "Board.h"
+#include "ThreadPool.h"
 
-namespace x3 = boost::spirit::x3;
 using gmgm::globals::myprintf;
 
 #ifndef USE_BLAS
@@ -67,7 +87,12 @@ void process_bn_var(container& weights) {
 
 std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
                                                  const int outputs,
-                                                 const int channels) {
+                                                 const int channels,
+                                                 WinogradKernels::Tiling tiling) {
+    if (tiling != WinogradKernels::Tiling::F4X4) {
+        return WinogradKernels::transform_f(tiling, f, outputs, channels);
+    }
+
     // F(4x4, 3x3) Winograd filter transformation
     // transpose(G.dot(f).dot(G.transpose()))
     // U matrix is transposed for better memory layout in SGEMM
@@ -131,31 +156,140 @@ std::vector<float> Network::winograd_transform_f(const std::vector<float>& f,
     return U;
 }
 
-std::pair<int, int> Network::load_v1_network(std::istream& wtfile) {
+// line (after the version line) of a text net, as plain floats.  anything
+// but whitespace separated decimal numbers is left to strtod, the common
+// case is parsed here as that is several times faster
+static bool parse_floats(const std::string& line, std::vector<float>& out) {
+    static constexpr std::array<double, 23> POW10 = {{
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    }};
+    auto is_space = [](char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    };
+    auto is_digit = [](char c) {
+        return c >= '0' && c <= '9';
+    };
+
+    out.clear();
+    out.reserve(std::count(begin(line), end(line), ' ') + 1);
+    auto p = line.c_str();
+    const auto end = p + line.size();
+    while (true) {
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        if (p == end) {
+            return true;
+        }
+        const auto start = p;
+        const auto negative = (*p == '-');
+        if (*p == '-' || *p == '+') {
+            p++;
+        }
+        // value is mantissa * 10^exponent, keeping the first 19 significant digits
+        auto mantissa = std::uint64_t{0};
+        auto digits = 0;
+        auto exponent = 0;
+        auto any_digit = false;
+        for (; p < end && is_digit(*p); p++) {
+            any_digit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += (mantissa != 0);
+            } else {
+                exponent++;
+            }
+        }
+        if (p < end && *p == '.') {
+            for (p++; p < end && is_digit(*p); p++) {
+                any_digit = true;
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits += (mantissa != 0);
+                    exponent--;
+                }
+            }
+        }
+        if (any_digit && p < end && (*p == 'e' || *p == 'E')) {
+            p++;
+            const auto exp_negative = (p < end && *p == '-');
+            if (p < end && (*p == '-' || *p == '+')) {
+                p++;
+            }
+            auto e = 0;
+            auto exp_digit = false;
+            for (; p < end && is_digit(*p); p++) {
+                exp_digit = true;
+                e = std::min(e * 10 + (*p - '0'), 10000);
+            }
+            any_digit = exp_digit;
+            exponent += exp_negative ? -e : e;
+        }
+
+        auto value = 0.0;
+        if (any_digit && (p == end || is_space(*p))
+            && exponent >= -22 && exponent <= 22) {
+            value = static_cast<double>(mantissa);
+            value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+            value = negative ? -value : value;
+        } else {
+            char* parse_end;
+            value = std::strtod(start, &parse_end);
+            if (parse_end == start || (parse_end != end && !is_space(*parse_end))) {
+                return false;
+            }
+            p = parse_end;
+        }
+        out.push_back(static_cast<float>(value));
+    }
+}
+
+void Network::load_ending_weights(std::vector<float>& weights, const size_t index) {
+    switch (index) {
+        case  0: m_fwd_weights->m_conv_pol_w = std::move(weights); break;
+        case  1: m_fwd_weights->m_conv_pol_b = std::move(weights); break;
+        case  2: m_fwd_weights->m_bn_pol_w1 = std::move(weights); break;
+        case  3: m_fwd_weights->m_bn_pol_w2 = std::move(weights); break;
+        case  4: /*if (weights.size() != OUTPUTS_POLICY
+                                       * POTENTIAL_MOVES) {
+                     myprintf("The weights file is not for %dx%d boards.\n",
+                              gmgm::BOARD_H, gmgm::BOARD_W);
+                     return {0, 0};
+                 }*/
+                 m_fwd_weights->m_ip_pol_w = std::move(weights); break;
+        case  5: m_fwd_weights->m_ip_pol_b = std::move(weights); break;
+        case  6: m_fwd_weights->m_conv_val_w = std::move(weights); break;
+        case  7: m_fwd_weights->m_conv_val_b = std::move(weights); break;
+        case  8: m_fwd_weights->m_bn_val_w1 = std::move(weights); break;
+        case  9: m_fwd_weights->m_bn_val_w2 = std::move(weights); break;
+        case 10: m_fwd_weights->m_ip_val_w = std::move(weights); break;
+        case 11: m_fwd_weights->m_ip_val_b = std::move(weights); break;
+        case 12: m_fwd_weights->m_ip2_val_w = std::move(weights); break;
+        case 13: m_fwd_weights->m_ip2_val_b = std::move(weights); break;
+        default:
+                break;
+    }
+}
+
+std::pair<int, int> Network::load_v1_network(std::deque<std::vector<float>>& lines) {
     // Count size of the network
     myprintf("Detecting residual layers...");
     // We are version 1 or 2
     myprintf("v%d...", 1);
 
-    // First line was the version number
-    auto linecount = size_t{1};
-    auto channels = 0;
-    auto line = std::string{};
-    while (std::getline(wtfile, line)) {
-        auto iss = std::stringstream{line};
-        // Third line of parameters are the convolution layer biases,
-        // so this tells us the amount of channels in the residual layers.
-        // We are assuming all layers have the same amount of filters.
-        if (linecount == 2) {
-            auto count = std::distance(std::istream_iterator<std::string>(iss),
-                                       std::istream_iterator<std::string>());
-            myprintf("%lu channels...", count);
-            channels = count;
-        }
-        linecount++;
-    }
     // 1 format id, 1 input layer (4 x weights), 14 ending weights,
     // the rest are residuals, every residual has 8 x weight lines
+    const auto linecount = lines.size() + 1;
+    if (linecount < 1 + 4 + 14) {
+        throw std::runtime_error("Inconsistent number of weights in the file.");
+    }
+    // Second weight line is the input convolution biases,
+    // so this tells us the amount of channels in the residual layers.
+    // We are assuming all layers have the same amount of filters.
+    const auto channels = static_cast<int>(lines[1].size());
+    myprintf("%d channels...", channels);
+
     auto residual_blocks = linecount - (1 + 4 + 14);
 
     if (residual_blocks % 8 != 0) {
@@ -165,74 +299,29 @@ std::pair<int, int> Network::load_v1_network(std::istream& wtfile) {
     residual_blocks /= 8;
     myprintf("%lu blocks.\n", residual_blocks);
 
-    // Re-read file and process
-    wtfile.clear();
-    wtfile.seekg(0, std::ios::beg);
-
-    // Get the file format id out of the way
-    std::getline(wtfile, line);
-
     const auto plain_conv_layers = 1 + (residual_blocks * 2);
     const auto plain_conv_wts = plain_conv_layers * 4;
-    linecount = 0;
-    while (std::getline(wtfile, line)) {
-        std::vector<float> weights;
-        auto it_line = line.cbegin();
-        const auto ok = phrase_parse(it_line, line.cend(),
-                                     *x3::float_, x3::space, weights);
-        if (!ok || it_line != line.cend()) {
-            myprintf("\nFailed to parse weight file. Error on line %lu.\n",
-                    linecount + 2); //+1 from version line, +1 from 0-indexing
-            throw std::runtime_error("Invalid weight file format");
-            return {0, 0};
-        }
-        if (linecount < plain_conv_wts) {
-            if (linecount % 4 == 0) {
-                m_fwd_weights->m_conv_weights.emplace_back(weights);
-            } else if (linecount % 4 == 1) {
+    for (auto linenum = size_t{0}; linenum < lines.size(); linenum++) {
+        auto & weights = lines[linenum];
+        if (linenum < plain_conv_wts) {
+            if (linenum % 4 == 0) {
+                m_fwd_weights->m_conv_weights.emplace_back(std::move(weights));
+            } else if (linenum % 4 == 1) {
                 // Redundant in our model, but they encode the
                 // number of outputs so we have to read them in.
-                m_fwd_weights->m_conv_biases.emplace_back(weights);
-            } else if (linecount % 4 == 2) {
-                m_fwd_weights->m_batchnorm_means.emplace_back(weights);
-            } else if (linecount % 4 == 3) {
+                m_fwd_weights->m_conv_biases.emplace_back(std::move(weights));
+            } else if (linenum % 4 == 2) {
+                m_fwd_weights->m_batchnorm_means.emplace_back(std::move(weights));
+            } else if (linenum % 4 == 3) {
                 process_bn_var(weights);
-                m_fwd_weights->m_batchnorm_stddevs.emplace_back(weights);
+                m_fwd_weights->m_batchnorm_stddevs.emplace_back(std::move(weights));
 
                 m_fwd_weights->m_squeeze_1.push_back({});
                 m_fwd_weights->m_squeeze_2.push_back({});
             }
         } else {
-            switch (linecount - plain_conv_wts) {
-                case  0: m_fwd_weights->m_conv_pol_w = std::move(weights); break;
-                case  1: m_fwd_weights->m_conv_pol_b = std::move(weights); break;
-                case  2: m_fwd_weights->m_bn_pol_w1 = std::move(weights); break;
-                case  3: m_fwd_weights->m_bn_pol_w2 = std::move(weights); break;
-                case  4: /*if (weights.size() != OUTPUTS_POLICY
-                                               * POTENTIAL_MOVES) {
-                             myprintf("The weights file is not for %dx%d boards.\n",
-                                      gmgm::BOARD_H, gmgm::BOARD_W);
-                             return {0, 0};
-                         }*/
-                         m_fwd_weights->m_ip_pol_w = std::move(weights); break;
-                case  5: m_fwd_weights->m_ip_pol_b = std::move(weights); break; 
-                case  6: m_fwd_weights->m_conv_val_w = std::move(weights); break;
-                case  7: m_fwd_weights->m_conv_val_b = std::move(weights); break;
-                case  8: m_fwd_weights->m_bn_val_w1 = std::move(weights); break;
-                case  9: m_fwd_weights->m_bn_val_w2 = std::move(weights); break;
-                case 10: m_fwd_weights->m_ip_val_w = std::move(weights); break;
-                case 11: m_fwd_weights->m_ip_val_b = std::move(weights); break;
-                case 12: assert(m_ip2_val_w.size() == weights.size());
-                         std::copy(cbegin(weights), cend(weights),
-                                   begin(m_ip2_val_w)); break;
-                case 13: assert(m_ip2_val_b.size() == weights.size());
-                         std::copy(cbegin(weights), cend(weights),
-                                   begin(m_ip2_val_b)); break;
-                default:
-                        break;
-            }
+            load_ending_weights(weights, linenum - plain_conv_wts);
         }
-        linecount++;
     }
     process_bn_var(m_fwd_weights->m_bn_pol_w2);
     process_bn_var(m_fwd_weights->m_bn_val_w2);
@@ -242,30 +331,23 @@ std::pair<int, int> Network::load_v1_network(std::istream& wtfile) {
 
 
 // SENET
-std::pair<int, int> Network::load_v5_network(std::istream& wtfile) {
+std::pair<int, int> Network::load_v5_network(std::deque<std::vector<float>>& lines) {
     // Count size of the network
     myprintf("Detecting residual layers...");
     myprintf("v%d...", 5);
 
-    // First line was the version number
-    auto linecount = size_t{1};
-    auto channels = 0;
-    auto line = std::string{};
-    while (std::getline(wtfile, line)) {
-        auto iss = std::stringstream{line};
-        // Third line of parameters are the convolution layer biases,
-        // so this tells us the amount of channels in the residual layers.
-        // We are assuming all layers have the same amount of filters.
-        if (linecount == 2) {
-            auto count = std::distance(std::istream_iterator<std::string>(iss),
-                                       std::istream_iterator<std::string>());
-            myprintf("%lu channels...", count);
-            channels = count;
-        }
-        linecount++;
-    }
     // 1 format id, 1 input layer (4 x weights), 14 ending weights,
     // the rest are residuals, every residual has 8 x weight lines + 2 SE layers
+    const auto linecount = lines.size() + 1;
+    if (linecount < 1 + 4 + 14) {
+        throw std::runtime_error("Inconsistent number of weights in the file.");
+    }
+    // Second weight line is the input convolution biases,
+    // so this tells us the amount of channels in the residual layers.
+    // We are assuming all layers have the same amount of filters.
+    const auto channels = static_cast<int>(lines[1].size());
+    myprintf("%d channels...", channels);
+
     auto residual_blocks = linecount - (1 + 4 + 14);
 
     if (residual_blocks % 10 != 0) {
@@ -275,42 +357,27 @@ std::pair<int, int> Network::load_v5_network(std::istream& wtfile) {
     residual_blocks /= 10;
     myprintf("%lu blocks.\n", residual_blocks);
 
-    // Re-read file and process
-    wtfile.clear();
-    wtfile.seekg(0, std::ios::beg);
-
-    // Get the file format id out of the way
-    std::getline(wtfile, line);
-
     const auto plain_conv_layers = 1 + (residual_blocks * 2);
     const auto plain_conv_wts = plain_conv_layers * 4 + residual_blocks * 2;
 
-    linecount = 0;
     auto residual_index = 0;
-    while (std::getline(wtfile, line)) {
-        std::vector<float> weights;
-        auto it_line = line.cbegin();
-        const auto ok = phrase_parse(it_line, line.cend(),
-                                     *x3::float_, x3::space, weights);
-        if (!ok || it_line != line.cend()) {
-            throw std::runtime_error("Invalid weight file format");
-            return {0, 0};
-        }
-        if (linecount < plain_conv_wts) {
+    for (auto linenum = size_t{0}; linenum < lines.size(); linenum++) {
+        auto & weights = lines[linenum];
+        if (linenum < plain_conv_wts) {
             if (residual_index % 6 == 0) {
-                m_fwd_weights->m_conv_weights.emplace_back(weights);
+                m_fwd_weights->m_conv_weights.emplace_back(std::move(weights));
                 residual_index++;
             } else if (residual_index % 6 == 1) {
                 // Redundant in our model, but they encode the
                 // number of outputs so we have to read them in.
-                m_fwd_weights->m_conv_biases.emplace_back(weights);
+                m_fwd_weights->m_conv_biases.emplace_back(std::move(weights));
                 residual_index++;
             } else if (residual_index % 6 == 2) {
-                m_fwd_weights->m_batchnorm_means.emplace_back(weights);
+                m_fwd_weights->m_batchnorm_means.emplace_back(std::move(weights));
                 residual_index++;
             } else if (residual_index % 6 == 3) {
                 process_bn_var(weights);
-                m_fwd_weights->m_batchnorm_stddevs.emplace_back(weights);
+                m_fwd_weights->m_batchnorm_stddevs.emplace_back(std::move(weights));
                 residual_index++;
                 auto residual_num = residual_index / 6;
                 if(residual_num == 0 || residual_num % 2 == 1) {
@@ -319,43 +386,15 @@ std::pair<int, int> Network::load_v5_network(std::istream& wtfile) {
                     residual_index += 2;
                 }
             } else if(residual_index % 6 == 4) {
-                m_fwd_weights->m_squeeze_1.emplace_back(weights);
+                m_fwd_weights->m_squeeze_1.emplace_back(std::move(weights));
                 residual_index++;
             } else if(residual_index % 6 == 5) {
-                m_fwd_weights->m_squeeze_2.emplace_back(weights);
+                m_fwd_weights->m_squeeze_2.emplace_back(std::move(weights));
                 residual_index++;
             }
         } else {
-            switch (linecount - plain_conv_wts) {
-                case  0: m_fwd_weights->m_conv_pol_w = std::move(weights); break;
-                case  1: m_fwd_weights->m_conv_pol_b = std::move(weights); break;
-                case  2: m_fwd_weights->m_bn_pol_w1 = std::move(weights); break;
-                case  3: m_fwd_weights->m_bn_pol_w2 = std::move(weights); break;
-                case  4: /*if (weights.size() != OUTPUTS_POLICY
-                                               * POTENTIAL_MOVES) {
-                             myprintf("The weights file is not for %dx%d boards.\n",
-                                      gmgm::BOARD_H, gmgm::BOARD_W);
-                             return {0, 0};
-                         }*/
-                         m_fwd_weights->m_ip_pol_w = std::move(weights); break;
-                case  5: m_fwd_weights->m_ip_pol_b = std::move(weights); break; 
-                case  6: m_fwd_weights->m_conv_val_w = std::move(weights); break;
-                case  7: m_fwd_weights->m_conv_val_b = std::move(weights); break;
-                case  8: m_fwd_weights->m_bn_val_w1 = std::move(weights); break;
-                case  9: m_fwd_weights->m_bn_val_w2 = std::move(weights); break;
-                case 10: m_fwd_weights->m_ip_val_w = std::move(weights); break;
-                case 11: m_fwd_weights->m_ip_val_b = std::move(weights); break;
-                case 12: assert(m_ip2_val_w.size() == weights.size());
-                         std::copy(cbegin(weights), cend(weights),
-                                   begin(m_ip2_val_w)); break;
-                case 13: assert(m_ip2_val_b.size() == weights.size());
-                         std::copy(cbegin(weights), cend(weights),
-                                   begin(m_ip2_val_b)); break;
-                default:
-                        break;
-            }
+            load_ending_weights(weights, linenum - plain_conv_wts);
         }
-        linecount++;
     }
     process_bn_var(m_fwd_weights->m_bn_pol_w2);
     process_bn_var(m_fwd_weights->m_bn_val_w2);
@@ -375,79 +414,446 @@ std::pair<int, int> Network::load_network_file(const std::string& filename) {
         throw std::runtime_error("Could not open weights file");
         return {0, 0};
     }
-    // Stream the gz file in to a memory buffer stream.
-    auto buffer = std::stringstream{};
-    constexpr auto chunkBufferSize = 64 * 1024;
+
+    // every weight line goes to the pool as soon as it is decompressed, so
+    // parsing runs alongside the rest of the gunzip.  lines is a deque as the
+    // parsers write into its elements while it grows
+    gmgm::ThreadPool pool;
+    pool.initialize(std::max(1u, std::thread::hardware_concurrency()));
+    std::deque<std::vector<float>> lines;
+    std::vector<std::future<void>> parsed;
+    std::atomic<size_t> bad_line{std::numeric_limits<size_t>::max()};
+
+    auto format_version = -1;
+    auto take_line = [&](std::string && line) {
+        if (format_version == -1) {
+            // First line is the file format version id
+            auto iss = std::stringstream{line};
+            iss >> format_version;
+            if (iss.fail() || (format_version != 1 && format_version != 5)) {
+                format_version = 0;
+            }
+            return;
+        }
+        const auto linenum = lines.size();
+        lines.emplace_back();
+        auto & out = lines.back();
+        auto task = [line = std::move(line), &out, &bad_line, linenum]() {
+            if (!parse_floats(line, out)) {
+                auto prev = bad_line.load();
+                while (linenum < prev && !bad_line.compare_exchange_weak(prev, linenum)) {}
+            }
+        };
+        parsed.emplace_back(pool.add_task(std::move(task)));
+    };
+
+    constexpr auto chunkBufferSize = 256 * 1024;
     std::vector<char> chunkBuffer(chunkBufferSize);
-    while (true) {
+    auto pending = std::string{};
+    auto read_error = false;
+    // stop early on a bad version line, it's not a net
+    while (format_version != 0) {
         auto bytesRead = gzread(gzhandle, chunkBuffer.data(), chunkBufferSize);
         if (bytesRead == 0) break;
         if (bytesRead < 0) {
-            gzclose(gzhandle);
-            throw std::runtime_error("Failed to decompress or read file");
-            return {0, 0};
+            read_error = true;
+            break;
         }
         assert(bytesRead <= chunkBufferSize);
-        buffer.write(chunkBuffer.data(), bytesRead);
+        const auto chunk_end = chunkBuffer.data() + bytesRead;
+        for (auto p = chunkBuffer.data(); ; ) {
+            const auto eol = std::find(p, chunk_end, '\n');
+            pending.append(p, eol);
+            if (eol == chunk_end) {
+                break;
+            }
+            take_line(std::move(pending));
+            pending = std::string{};
+            p = eol + 1;
+        }
     }
     gzclose(gzhandle);
+    if (!pending.empty() && format_version != 0) {
+        take_line(std::move(pending));
+    }
+    for (auto & x : parsed) {
+        x.get();
+    }
 
-    // Read format version
-    auto line = std::string{};
-    auto format_version = -1;
-    if (std::getline(buffer, line)) {
-        auto iss = std::stringstream{line};
-        // First line is the file format version id
-        iss >> format_version;
-        if (iss.fail() || (format_version != 1 && format_version != 5)) {
-            throw std::runtime_error("Weights file is the wrong version");
-            return {0, 0};
-        } else if (format_version == 1) {
-            return load_v1_network(buffer);
-        } else if (format_version == 5) {
-            return load_v5_network(buffer);
+    if (read_error) {
+        throw std::runtime_error("Failed to decompress or read file");
+        return {0, 0};
+    }
+    if (format_version != 1 && format_version != 5) {
+        throw std::runtime_error("Weights file is the wrong version");
+        return {0, 0};
+    }
+    if (bad_line != std::numeric_limits<size_t>::max()) {
+        myprintf("\nFailed to parse weight file. Error on line %lu.\n",
+                 bad_line + 2); //+1 from version line, +1 from 0-indexing
+        throw std::runtime_error("Invalid weight file format");
+        return {0, 0};
+    }
+    if (format_version == 1) {
+        return load_v1_network(lines);
+    }
+    return load_v5_network(lines);
+}
+
+// binary net format : a header, a table of tensors, then the tensors
+// themselves, each aligned to BINARY_ALIGN.  everything is in the byte order
+// of the machine that wrote it, which the loader checks.  the weights are
+// stored after winograd transform and bias folding, so loading is just a map
+namespace {
+    constexpr char BINARY_MAGIC[8] = {'g', 'm', 'g', 'm', 'b', 'i', 'n', '\0'};
+    constexpr uint32_t BINARY_VERSION = 1;
+    constexpr uint32_t BINARY_BYTE_ORDER = 0x01020304;
+    constexpr size_t BINARY_ALIGN = 64;
+
+    struct BinaryHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t channels;
+        uint32_t residual_blocks;
+        uint32_t tensors;
+        uint32_t reserved;
+    };
+
+    struct BinaryTensor {
+        uint32_t field;
+        uint32_t index;
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    // tensor ids.  append only, never renumber
+    enum BinaryField : uint32_t {
+        CONV_WEIGHTS, CONV_BIASES, BN_MEANS, BN_STDDEVS, SQUEEZE_1, SQUEEZE_2,
+        CONV_POL_W, CONV_POL_B, BN_POL_W1, BN_POL_W2, IP_POL_W, IP_POL_B,
+        CONV_VAL_W, CONV_VAL_B, BN_VAL_W1, BN_VAL_W2, IP_VAL_W, IP_VAL_B,
+        IP2_VAL_W, IP2_VAL_B
+    };
+
+    using Weights = ForwardPipe::ForwardPipeWeights;
+    using LayerList = std::vector<std::vector<float>> Weights::*;
+    using Tensor = std::vector<float> Weights::*;
+
+    const std::array<std::pair<BinaryField, LayerList>, 5> BINARY_LAYER_LISTS = {{
+        {CONV_BIASES, &Weights::m_conv_biases},
+        {BN_MEANS, &Weights::m_batchnorm_means},
+        {BN_STDDEVS, &Weights::m_batchnorm_stddevs},
+        {SQUEEZE_1, &Weights::m_squeeze_1},
+        {SQUEEZE_2, &Weights::m_squeeze_2}
+    }};
+
+    const std::array<std::pair<BinaryField, Tensor>, 14> BINARY_TENSORS = {{
+        {CONV_POL_W, &Weights::m_conv_pol_w},
+        {CONV_POL_B, &Weights::m_conv_pol_b},
+        {BN_POL_W1, &Weights::m_bn_pol_w1},
+        {BN_POL_W2, &Weights::m_bn_pol_w2},
+        {IP_POL_W, &Weights::m_ip_pol_w},
+        {IP_POL_B, &Weights::m_ip_pol_b},
+        {CONV_VAL_W, &Weights::m_conv_val_w},
+        {CONV_VAL_B, &Weights::m_conv_val_b},
+        {BN_VAL_W1, &Weights::m_bn_val_w1},
+        {BN_VAL_W2, &Weights::m_bn_val_w2},
+        {IP_VAL_W, &Weights::m_ip_val_w},
+        {IP_VAL_B, &Weights::m_ip_val_b},
+        {IP2_VAL_W, &Weights::m_ip2_val_w},
+        {IP2_VAL_B, &Weights::m_ip2_val_b}
+    }};
+
+    size_t align_up(size_t x) {
+        return (x + BINARY_ALIGN - 1) / BINARY_ALIGN * BINARY_ALIGN;
+    }
+
+    // count == rows * cols, without the product overflowing on a corrupt header
+    bool has_size(size_t count, size_t rows, size_t cols) {
+        return cols != 0 && count % cols == 0 && count / cols == rows;
+    }
+
+    // read-only mapping of a whole file, released when the last shared_ptr goes
+    std::shared_ptr<const void> map_file(const std::string& filename, size_t& size) {
+#ifdef _WIN32
+        // no mmap here, so just read it.  loses the page sharing but not the fast load
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        if (!file) {
+            throw std::runtime_error("Could not open weights file");
+        }
+        size = file.tellg();
+        auto buffer = std::shared_ptr<char>(new char[size], std::default_delete<char[]>());
+        file.seekg(0);
+        file.read(buffer.get(), size);
+        return buffer;
+#else
+        const auto fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open weights file");
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Could not open weights file");
+        }
+        size = st.st_size;
+        const auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        // the mapping holds its own reference to the file
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Could not map weights file");
         }
+        return std::shared_ptr<const void>(addr, [size](const void* p) {
+            munmap(const_cast<void*>(p), size);
+        });
+#endif
     }
-    return {0, 0};
 }
 
-std::unique_ptr<ForwardPipe>&& Network::init_net(int channels,
-    std::unique_ptr<ForwardPipe>&& pipe) {
+bool Network::is_binary_network(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof(BINARY_MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    return file && std::equal(std::begin(magic), std::end(magic), std::begin(BINARY_MAGIC));
+}
 
-    pipe->initialize(channels);
-    pipe->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, m_fwd_weights);
+std::pair<int, int> Network::load_binary_network(const std::string& filename) {
+    size_t size;
+    auto mapping = map_file(filename, size);
+    const auto base = static_cast<const char*>(mapping.get());
 
-    return std::move(pipe);
+    BinaryHeader header;
+    if (size < sizeof(header)) {
+        throw std::runtime_error("Binary weights file is truncated");
+    }
+    std::memcpy(&header, base, sizeof(header));
+    if (header.byte_order != BINARY_BYTE_ORDER) {
+        throw std::runtime_error("Binary weights file was written on a machine with another byte order");
+    }
+    if (header.version != BINARY_VERSION) {
+        throw std::runtime_error("Binary weights file is the wrong version");
+    }
+    if (size < sizeof(header) + header.tensors * sizeof(BinaryTensor)) {
+        throw std::runtime_error("Binary weights file is truncated");
+    }
+    if (header.channels == 0) {
+        throw std::runtime_error("Binary weights file is corrupt");
+    }
+
+    // every size below follows from the header, so that a corrupt file is
+    // rejected here instead of sending the pipes past the end of a tensor
+    const auto channels = size_t{header.channels};
+    const auto layers = size_t{1} + size_t{header.residual_blocks} * 2;
+    auto & w = *m_fwd_weights;
+    for (auto t = size_t{0}; t < header.tensors; t++) {
+        BinaryTensor entry;
+        std::memcpy(&entry, base + sizeof(header) + t * sizeof(entry), sizeof(entry));
+        if (entry.offset % BINARY_ALIGN != 0
+            || entry.offset > size || entry.count > (size - entry.offset) / sizeof(float)) {
+            throw std::runtime_error("Binary weights file is corrupt");
+        }
+        const auto data = reinterpret_cast<const float*>(base + entry.offset);
+        const auto index = size_t{entry.index};
+        const auto single = entry.field >= CONV_POL_W;
+        if (entry.field > IP2_VAL_B || index >= (single ? 1 : layers)) {
+            throw std::runtime_error("Binary weights file is corrupt");
+        }
+
+        auto copy_to = [&](std::vector<float>& v) {
+            v.assign(data, data + entry.count);
+        };
+        if (entry.field == CONV_WEIGHTS) {
+            // these are the bulk of the net, and stay in the mapping
+            if (w.m_conv_weights_mapped.size() <= index) {
+                w.m_conv_weights_mapped.resize(index + 1);
+            }
+            w.m_conv_weights_mapped[index] = {data, entry.count};
+        }
+        for (const auto & list : BINARY_LAYER_LISTS) {
+            if (entry.field == list.first) {
+                auto & layers = w.*list.second;
+                if (layers.size() <= index) {
+                    layers.resize(index + 1);
+                }
+                copy_to(layers[index]);
+            }
+        }
+        for (const auto & tensor : BINARY_TENSORS) {
+            if (entry.field == tensor.first) {
+                copy_to(w.*tensor.second);
+            }
+        }
+    }
+
+    if (w.m_conv_weights_mapped.size() != layers || w.m_conv_biases.size() != layers
+        || w.m_batchnorm_means.size() != layers
+        || w.m_batchnorm_stddevs.size() != layers || w.m_squeeze_1.size() != layers
+        || w.m_squeeze_2.size() != layers || w.m_ip_val_w.empty()) {
+        throw std::runtime_error("Binary weights file is incomplete");
+    }
+
+    auto corrupt = false;
+    for (auto l = size_t{0}; l < layers; l++) {
+        const auto inputs = (l == 0 ? size_t{INPUT_CHANNELS} : channels);
+        corrupt |= !has_size(w.m_conv_weights_mapped[l].second, channels, WINOGRAD_TILE * inputs);
+        corrupt |= w.m_conv_biases[l].size() != channels;
+        corrupt |= w.m_batchnorm_means[l].size() != channels;
+        corrupt |= w.m_batchnorm_stddevs[l].size() != channels;
+        // only the second convolution of a block may have squeeze layers
+        const auto se_size = (l != 0 && l % 2 == 0) ? channels / 8 * channels : 0;
+        corrupt |= w.m_squeeze_1[l].size() != w.m_squeeze_2[l].size();
+        corrupt |= !w.m_squeeze_1[l].empty() && w.m_squeeze_1[l].size() != se_size;
+    }
+    // the head widths are free, but have to agree across each head
+    const auto pol_outputs = w.m_conv_pol_w.size() / channels;
+    const auto val_outputs = w.m_conv_val_w.size() / channels;
+    corrupt |= pol_outputs == 0 || !has_size(w.m_conv_pol_w.size(), pol_outputs, channels);
+    corrupt |= w.m_conv_pol_b.size() != pol_outputs || w.m_bn_pol_w1.size() != pol_outputs
+               || w.m_bn_pol_w2.size() != pol_outputs;
+    corrupt |= !has_size(w.m_ip_pol_w.size(), OUTPUTS_POLICY, pol_outputs * NUM_INTERSECTIONS);
+    corrupt |= w.m_ip_pol_b.size() != OUTPUTS_POLICY;
+    corrupt |= val_outputs == 0 || !has_size(w.m_conv_val_w.size(), val_outputs, channels);
+    corrupt |= w.m_conv_val_b.size() != val_outputs || w.m_bn_val_w1.size() != val_outputs
+               || w.m_bn_val_w2.size() != val_outputs;
+    corrupt |= !has_size(w.m_ip_val_w.size(), OUTPUTS_VALUE, val_outputs * NUM_INTERSECTIONS);
+    corrupt |= w.m_ip_val_b.size() != OUTPUTS_VALUE;
+    if (corrupt) {
+        throw std::runtime_error("Binary weights file is corrupt");
+    }
+    w.m_mapping = std::move(mapping);
+
+    myprintf("Mapped binary net : %d channels, %d blocks.\n",
+             header.channels, header.residual_blocks);
+    return {header.channels, header.residual_blocks};
 }
 
-void Network::initialize(const std::string & weightsfile) {
-    myprintf("BLAS Core: built-in Eigen %d.%d.%d library.\n",
-             EIGEN_WORLD_VERSION, EIGEN_MAJOR_VERSION, EIGEN_MINOR_VERSION);
+void Network::save_binary_network(const std::string& filename,
+                                  size_t channels, size_t residual_blocks) {
+    struct Item {
+        BinaryTensor entry;
+        const float* data;
+    };
+    std::vector<Item> items;
+    auto add = [&](BinaryField field, size_t index, const float* data, size_t count) {
+        items.push_back({{field, static_cast<uint32_t>(index), 0, count}, data});
+    };
+
+    const auto & w = *m_fwd_weights;
+    for (auto l = size_t{0}; l < w.conv_layers(); l++) {
+        const auto layer = w.conv_weights(l);
+        add(CONV_WEIGHTS, l, layer.first, layer.second);
+    }
+    for (const auto & list : BINARY_LAYER_LISTS) {
+        const auto & layers = w.*list.second;
+        for (auto l = size_t{0}; l < layers.size(); l++) {
+            add(list.first, l, layers[l].data(), layers[l].size());
+        }
+    }
+    for (const auto & tensor : BINARY_TENSORS) {
+        add(tensor.first, 0, (w.*tensor.second).data(), (w.*tensor.second).size());
+    }
 
+    BinaryHeader header;
+    std::copy(std::begin(BINARY_MAGIC), std::end(BINARY_MAGIC), header.magic);
+    header.version = BINARY_VERSION;
+    header.byte_order = BINARY_BYTE_ORDER;
+    header.channels = channels;
+    header.residual_blocks = residual_blocks;
+    header.tensors = items.size();
+    header.reserved = 0;
+
+    auto offset = align_up(sizeof(header) + items.size() * sizeof(BinaryTensor));
+    for (auto & item : items) {
+        item.entry.offset = offset;
+        offset = align_up(offset + item.entry.count * sizeof(float));
+    }
+
+    // engines may have the target mapped (see map_file), so never rewrite it in
+    // place : write a temporary next to it and rename it over the old one.
+    // Running processes keep the old inode until they unmap it.
+#ifdef _WIN32
+    const auto tmpname = filename + ".tmp";
+#else
+    const auto tmpname = filename + ".tmp." + std::to_string(getpid());
+#endif
+    std::ofstream file(tmpname, std::ios::binary | std::ios::trunc);
+    auto pad_to = [&](size_t pos) {
+        const auto cur = static_cast<size_t>(file.tellp());
+        const std::vector<char> zeros(pos - cur, 0);
+        file.write(zeros.data(), zeros.size());
+    };
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const auto & item : items) {
+        file.write(reinterpret_cast<const char*>(&item.entry), sizeof(item.entry));
+    }
+    for (const auto & item : items) {
+        pad_to(item.entry.offset);
+        file.write(reinterpret_cast<const char*>(item.data), item.entry.count * sizeof(float));
+    }
+    pad_to(offset);
+    file.close();
+    if (!file) {
+        std::remove(tmpname.c_str());
+        throw std::runtime_error("Could not write " + filename);
+    }
+
+#ifdef _WIN32
+    // rename() does not replace an existing file here, and nothing maps it anyway
+    std::remove(filename.c_str());
+#else
+    const auto fd = open(tmpname.c_str(), O_RDONLY);
+    const auto synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!synced) {
+        std::remove(tmpname.c_str());
+        throw std::runtime_error("Could not write " + filename);
+    }
+#endif
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        std::remove(tmpname.c_str());
+        throw std::runtime_error("Could not replace " + filename);
+    }
+}
+
+void Network::convert_network(const std::string & weightsfile, const std::string & outfile) {
     m_fwd_weights = std::make_shared<ForwardPipeWeights>();
 
-    // Load network from file
     size_t channels, residual_blocks;
     std::tie(channels, residual_blocks) = load_network_file(weightsfile);
     if (channels == 0) {
         throw std::runtime_error("Could not load net");
     }
+    prepare_weights(channels, residual_blocks);
+    save_binary_network(outfile, channels, residual_blocks);
+    m_fwd_weights.reset();
+}
 
-    auto weight_index = size_t{0};
-    // Input convolution
-    // Winograd transform convolution weights
-    m_fwd_weights->m_conv_weights[weight_index] =
-        winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
-                             channels, INPUT_CHANNELS);
-    weight_index++;
+std::unique_ptr<ForwardPipe>&& Network::init_net(int channels,
+    std::unique_ptr<ForwardPipe>&& pipe) {
 
-    // Residual block convolutions
-    for (auto i = size_t{0}; i < residual_blocks * 2; i++) {
-        m_fwd_weights->m_conv_weights[weight_index] =
-            winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
-                                 channels, channels);
-        weight_index++;
-    }
+    pipe->initialize(channels);
+    pipe->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, m_fwd_weights);
+
+    return std::move(pipe);
+}
+
+void Network::prepare_weights(size_t channels, size_t residual_blocks,
+                              WinogradKernels::Tiling tiling) {
+    // Winograd transform convolution weights, one layer per task :
+    // the input convolution, then the residual block convolutions
+    gmgm::ThreadPool pool;
+    pool.initialize(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    pool.parallel_for(1 + residual_blocks * 2, [&](size_t begin, size_t end) {
+        for (auto weight_index = begin; weight_index < end; weight_index++) {
+            const auto input_channels = weight_index == 0 ? size_t{INPUT_CHANNELS} : channels;
+            m_fwd_weights->m_conv_weights[weight_index] =
+                winograd_transform_f(m_fwd_weights->m_conv_weights[weight_index],
+                                     channels, input_channels, tiling);
+        }
+    });
+    m_fwd_weights->m_winograd_tiling = tiling;
 
     // Biases are not calculated and are typically zero but some networks might
     // still have non-zero biases.
@@ -471,48 +877,437 @@ void Network::initialize(const std::string & weightsfile) {
         m_fwd_weights->m_bn_pol_w1[i] -= m_fwd_weights->m_conv_pol_b[i];
         m_fwd_weights->m_conv_pol_b[i] = 0.0f;
     }
+}
 
-    if (false) {
-        myprintf("Initializing CPU-only evaluation.\n");
-        m_forward = init_net(channels, std::make_unique<CPUPipe>());
+size_t Network::load_weights(const std::string & weightsfile, bool & use_int8) {
+    // OpenCL (and the cpu self-check next to it) only knows F4X4
+    auto tiling = WinogradKernels::Tiling::F4X4;
+    if (gmgm::globals::backend == "cpu") {
+        tiling = WinogradKernels::select_tiling(gmgm::globals::cpu_winograd);
+    }
+    return load_weights(weightsfile, use_int8, tiling);
+}
+
+size_t Network::load_weights(const std::string & weightsfile, bool & use_int8,
+                             WinogradKernels::Tiling tiling) {
+    m_fwd_weights = std::make_shared<ForwardPipeWeights>();
+
+    // Load network from file
+    size_t channels, residual_blocks;
+    const auto binary = is_binary_network(weightsfile);
+    if (binary) {
+        std::tie(channels, residual_blocks) = load_binary_network(weightsfile);
     } else {
-        myprintf("Initializing GPU evaluation.\n");
-        m_forward_cpu = init_net(channels, std::make_unique<CPUPipe>());
-        m_forward = init_net(channels, std::make_unique<OpenCLScheduler<half_float::half>>());
-        // m_forward = init_net(channels, std::make_unique<OpenCLScheduler<float>>());
+        std::tie(channels, residual_blocks) = load_network_file(weightsfile);
+    }
+    if (channels == 0) {
+        throw std::runtime_error("Could not load net");
+    }
+    if (m_fwd_weights->m_ip2_val_w.size() != OUTPUTS_VALUE
+        || m_fwd_weights->m_ip2_val_b.size() != 1) {
+        throw std::runtime_error("Value head of the net has the wrong size");
+    }
+
+    // the int8 cpu tower works on plain 3x3 filters, so keep those around.
+    // binary nets only carry the transformed ones
+    if (use_int8 && binary) {
+        myprintf("Binary nets have no raw filters for int8, load the text net instead.\n");
+        use_int8 = false;
+    }
+    if (use_int8) {
+        m_fwd_weights->m_conv_weights_raw = m_fwd_weights->m_conv_weights;
+    }
+
+    // binary nets are stored transformed for F4X4
+    if (binary && tiling != WinogradKernels::Tiling::F4X4) {
+        myprintf("Binary nets are stored for f4x4 tiles, load the text net for %s.\n",
+                 WinogradKernels::name(tiling));
+    }
+    if (!binary) {
+        prepare_weights(channels, residual_blocks, tiling);
+    }
+
+    if (use_int8) {
+        calibrate_int8(DEFAULT_CALIBRATION_POSITIONS);
+    }
+    return channels;
+}
+
+void Network::unmap_conv_weights() {
+    // the OpenCL side uploads from m_conv_weights
+    for (const auto & mapped : m_fwd_weights->m_conv_weights_mapped) {
+        m_fwd_weights->m_conv_weights.emplace_back(mapped.first, mapped.first + mapped.second);
+    }
+}
+
+void Network::initialize(const std::string & weightsfile) {
+    myprintf("BLAS Core: built-in Eigen %d.%d.%d library.\n",
+             EIGEN_WORLD_VERSION, EIGEN_MAJOR_VERSION, EIGEN_MINOR_VERSION);
+
+    auto use_int8 = (gmgm::globals::cpu_precision == "int8");
+    const auto channels = load_weights(weightsfile, use_int8);
+
+    auto use_cpu = (gmgm::globals::backend == "cpu");
+    if (!use_cpu) {
+        try {
+            myprintf("Initializing GPU evaluation.\n");
+            unmap_conv_weights();
+            m_forward_cpu = make_selfcheck_pipe(channels, m_fwd_weights);
+            if (gmgm::globals::opencl_precision == "fp32") {
+                m_forward = init_net(channels, std::make_unique<OpenCLScheduler<float>>());
+            } else {
+                m_forward = init_net(channels, std::make_unique<OpenCLScheduler<half_float::half>>());
+            }
+        } catch (const std::exception & e) {
+            // OpenCL throws its own cl::Error, so catch everything here
+            if (gmgm::globals::backend != "auto") {
+                throw std::runtime_error(std::string("OpenCL initialization failed : ") + e.what());
+            }
+            myprintf("OpenCL initialization failed (%s), falling back to CPU.\n", e.what());
+            m_forward_cpu.reset();
+            use_cpu = true;
+        }
+    }
+    // the int8 tower keeps using the fp32 weights for recalibration
+    if (use_cpu && !use_int8 && gmgm::globals::cpu_weights != "fp32") {
+        narrow_conv_weights(gmgm::globals::cpu_weights == "bf16");
+    }
+    if (use_cpu) {
+        myprintf("Initializing CPU-only evaluation.\n");
+        m_forward = init_net(channels, std::make_unique<CPUScheduler>());
+    }
+
+    m_cpu_backend = use_cpu;
+    m_channels = channels;
+    m_head_widths = head_widths();
+    m_weights_file = weightsfile;
+    if (m_forward_cpu != nullptr) {
+        start_selfcheck();
     }
 
     // Need to estimate size before clearing up the pipe.
     get_estimated_size();
-    m_fwd_weights.reset();
+    // ...unless we may need to recalibrate
+    if (!use_int8) {
+        m_fwd_weights.reset();
+    }
 }
 
-template<unsigned int inputs,
-         unsigned int outputs,
-         bool ReLU,
-         size_t W>
-std::vector<float> innerproduct(const std::vector<float>& input,
-                                const std::array<float, W>& weights,
-                                const std::array<float, outputs>& biases) {
-    std::vector<float> output(outputs);
-
-    EigenVectorMap<float> y(output.data(), outputs);
-    y.noalias() =
-        ConstEigenMatrixMap<float>(weights.data(),
-                                   inputs,
-                                   outputs).transpose()
-        * ConstEigenVectorMap<float>(input.data(), inputs);
-    const auto lambda_ReLU = [](const auto val) { return (val > 0.0f) ?
-                                                          val : 0.0f; };
-    for (unsigned int o = 0; o < outputs; o++) {
-        auto val = biases[o] + output[o];
-        if (ReLU) {
-            val = lambda_ReLU(val);
+void Network::swap_weights(const std::string & weightsfile) {
+    std::unique_lock<std::mutex> lk(m_swap_mutex);
+
+    // loaded on the side, so that calibration or a failed load never
+    // touches the weights the search is running on
+    Network next;
+    auto use_int8 = m_cpu_backend && (gmgm::globals::cpu_precision == "int8");
+    const auto channels = next.load_weights(weightsfile, use_int8);
+    if (static_cast<int>(channels) != m_channels) {
+        throw std::runtime_error("The new net has " + std::to_string(channels)
+                                 + " channels instead of " + std::to_string(m_channels)
+                                 + ", use loadnet instead");
+    }
+    // the OpenCL workers keep the head buffers they allocated for the old net
+    if (!m_cpu_backend && next.head_widths() != m_head_widths) {
+        throw std::runtime_error("The new net has other policy or value head widths, use loadnet instead");
+    }
+    if (!m_cpu_backend) {
+        next.unmap_conv_weights();
+    } else if (!use_int8 && gmgm::globals::cpu_weights != "fp32") {
+        next.narrow_conv_weights(gmgm::globals::cpu_weights == "bf16");
+    }
+    const auto weights = next.m_fwd_weights;
+
+    // the schedulers switch between batches.  bump the id only once both
+    // pipes are switched, so results cached under the new id never come
+    // from the old net
+    m_swap_in_progress = true;
+    if (m_forward_cpu != nullptr) {
+        std::atomic_store(&m_forward_cpu, make_selfcheck_pipe(channels, weights));
+    }
+    m_forward->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, weights);
+    const auto id = ++current_net_id;
+    m_swap_in_progress = false;
+
+    if (use_int8) {
+        m_fwd_weights = weights;
+    }
+    {
+        std::unique_lock<std::mutex> lk_file(m_weights_file_mutex);
+        m_weights_file = weightsfile;
+    }
+    myprintf("Swapped in %s as net %u.\n", weightsfile.c_str(), id);
+}
+
+void Network::load_large_net(const std::string & weightsfile) {
+    std::unique_lock<std::mutex> lk(m_swap_mutex);
+
+    if (!m_forward->supports_second_net()) {
+        throw std::runtime_error("The backend can't hold a second net");
+    }
+    Network next;
+    auto use_int8 = m_cpu_backend && (gmgm::globals::cpu_precision == "int8");
+    const auto channels = static_cast<int>(next.load_weights(weightsfile, use_int8));
+    // the OpenCL workers keep the buffers of the first large net they ran
+    const auto large_channels = m_large_channels.load();
+    if (!m_cpu_backend && large_channels != 0 && channels != large_channels) {
+        throw std::runtime_error("The new large net has " + std::to_string(channels)
+                                 + " channels instead of " + std::to_string(large_channels)
+                                 + ", use loadnet instead");
+    }
+    if (!m_cpu_backend && large_channels != 0 && next.head_widths() != m_large_head_widths) {
+        throw std::runtime_error("The new large net has other policy or value head widths, use loadnet instead");
+    }
+    if (!m_cpu_backend) {
+        next.unmap_conv_weights();
+    } else if (!use_int8 && gmgm::globals::cpu_weights != "fp32") {
+        next.narrow_conv_weights(gmgm::globals::cpu_weights == "bf16");
+    }
+    m_forward->push_net_weights(1, WINOGRAD_ALPHA, INPUT_CHANNELS, channels, next.m_fwd_weights);
+
+    // a replaced large net may still have results in the cache
+    m_large_head_widths = next.head_widths();
+    m_large_channels = channels;
+    const auto id = ++current_net_id;
+    myprintf("Loaded %s as the large net (%d channels), net %u.\n",
+             weightsfile.c_str(), channels, id);
+}
+
+Network::HeadWidths Network::head_widths() const {
+    // the same way OpenCL_Network::push_convolve() gets them
+    const auto & w = *m_fwd_weights;
+    return {w.m_ip_pol_w.size() / OUTPUTS_POLICY / NUM_INTERSECTIONS,
+            w.m_ip_val_w.size() / OUTPUTS_VALUE / NUM_INTERSECTIONS};
+}
+
+void Network::swap_weights_async(const std::string & weightsfile) {
+    if (m_swap_thread.joinable()) {
+        m_swap_thread.join();
+    }
+    m_swap_thread = std::thread([this, weightsfile]() {
+        try {
+            swap_weights(weightsfile);
+        } catch (const std::exception & e) {
+            myprintf("Could not swap in %s : %s\n", weightsfile.c_str(), e.what());
+        }
+    });
+}
+
+void Network::narrow_conv_weights(bool bf16) {
+    const auto storage = bf16 ? WinogradKernels::Storage::BF16 : WinogradKernels::Storage::FP16;
+    auto & w = *m_fwd_weights;
+    w.m_conv_weights_bf16 = bf16;
+    w.m_conv_weights_16.clear();
+    for (auto l = size_t{0}; l < w.conv_layers(); l++) {
+        const auto layer = w.conv_weights(l);
+        std::vector<uint16_t> narrow(layer.second);
+        for (auto i = size_t{0}; i < layer.second; i++) {
+            narrow[i] = WinogradKernels::narrow(storage, layer.first[i]);
+        }
+        w.m_conv_weights_16.emplace_back(std::move(narrow));
+        // release the fp32 copy right away, so that the peak stays low
+        if (!w.m_conv_weights.empty()) {
+            std::vector<float>().swap(w.m_conv_weights[l]);
         }
-        output[o] = val;
     }
+    w.m_conv_weights.clear();
+    w.m_conv_weights_mapped.clear();
+    myprintf("Storing transformed weights as %s.\n", bf16 ? "bf16" : "fp16");
+}
 
-    return output;
+// policy and value agreement of net outputs with a reference
+class AccuracyStats {
+public:
+    void add(const gmgm::PositionEval::RawResult & ref, const gmgm::PositionEval::RawResult & out) {
+        for (auto j = size_t{0}; j < ref.first.size(); j++) {
+            if (ref.first[j] > 0.0f) {
+                m_kl_sum += ref.first[j] * std::log(ref.first[j] / std::max(out.first[j], 1e-10f));
+            }
+        }
+        const auto ref_top = std::max_element(begin(ref.first), end(ref.first)) - begin(ref.first);
+        const auto out_top = std::max_element(begin(out.first), end(out.first)) - begin(out.first);
+        if (ref_top == out_top) {
+            m_top1_agree++;
+        }
+        const auto value_err = std::abs(static_cast<double>(ref.second) - out.second);
+        m_value_err_sum += value_err;
+        m_value_err_max = std::max(m_value_err_max, value_err);
+        m_count++;
+    }
+    std::string summary() const {
+        const auto n = static_cast<double>(std::max(m_count, 1));
+        return boost::str(boost::format("policy KL %.5f, top-1 agreement %.1f%%, value error mean %.4f max %.4f")
+                          % (m_kl_sum / n) % (100.0 * m_top1_agree / n)
+                          % (m_value_err_sum / n) % m_value_err_max);
+    }
+private:
+    double m_kl_sum{0.0};
+    int m_top1_agree{0};
+    double m_value_err_sum{0.0};
+    double m_value_err_max{0.0};
+    int m_count{0};
+};
+
+void Network::compare_backends(const std::string & weightsfile, size_t positions) {
+    // the scheduler constructors size num_scheduler_threads for themselves
+    const auto saved_scheduler_threads = gmgm::globals::num_scheduler_threads;
+
+    // F4X4 and fp32 storage, which every backend can run
+    Network loader;
+    auto use_int8 = false;
+    const auto channels = static_cast<int>(
+        loader.load_weights(weightsfile, use_int8, WinogradKernels::Tiling::F4X4));
+    loader.unmap_conv_weights();
+    const auto weights = std::shared_ptr<const ForwardPipeWeights>(loader.m_fwd_weights);
+    auto narrowed = [&loader, &weights](bool bf16) {
+        loader.m_fwd_weights = std::make_shared<ForwardPipeWeights>(*weights);
+        loader.narrow_conv_weights(bf16);
+        return std::shared_ptr<const ForwardPipeWeights>(loader.m_fwd_weights);
+    };
+
+    class Backend {
+    public:
+        std::string name;
+        std::function<std::unique_ptr<ForwardPipe>()> make;
+        std::shared_ptr<const ForwardPipeWeights> weights;
+    };
+    // the first one is the reference
+    const std::vector<Backend> backends = {
+        {"cpu fp32", [] { return std::make_unique<CPUScheduler>(); }, weights},
+        {"cpu fp16", [] { return std::make_unique<CPUScheduler>(); }, narrowed(false)},
+        {"cpu bf16", [] { return std::make_unique<CPUScheduler>(); }, narrowed(true)},
+        {"opencl fp32", [] { return std::make_unique<OpenCLScheduler<float>>(); }, weights},
+        {"opencl fp16", [] { return std::make_unique<OpenCLScheduler<half_float::half>>(); }, weights},
+    };
+
+    const auto inputs = calibration_inputs(positions);
+    std::vector<gmgm::PositionEval::RawResult> ref_out;
+    myprintf("Comparing backends on %d positions against %s :\n",
+             static_cast<int>(inputs.size()), backends[0].name.c_str());
+    for (const auto & backend : backends) {
+        std::vector<gmgm::PositionEval::RawResult> out(inputs.size());
+        auto seconds = 0.0;
+        try {
+            auto pipe = backend.make();
+            pipe->initialize(channels);
+            pipe->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, backend.weights);
+
+            // as many evals in flight as a search would have, so the
+            // schedulers form the same batches
+            const auto threads = std::max(1u, gmgm::globals::num_scheduler_threads);
+            std::atomic<size_t> next{0};
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for (auto t = 0u; t < threads; t++) {
+                workers.emplace_back([&]() {
+                    std::vector<float> policy_data(OUTPUTS_POLICY);
+                    std::vector<float> value_data(1);
+                    for (auto i = next++; i < inputs.size(); i = next++) {
+                        pipe->forward(inputs[i], policy_data, value_data);
+                        out[i] = *process_output(inputs[i], policy_data, value_data);
+                    }
+                });
+            }
+            for (auto & x : workers) {
+                x.join();
+            }
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } catch (const std::exception & e) {
+            // OpenCL throws its own cl::Error, so catch everything here
+            myprintf("%-12s : not available (%s)\n", backend.name.c_str(), e.what());
+            if (ref_out.empty()) {
+                break;
+            }
+            continue;
+        }
+
+        if (ref_out.empty()) {
+            ref_out = std::move(out);
+            myprintf("%-12s : reference, %.1f evals/s\n", backend.name.c_str(),
+                     inputs.size() / seconds);
+            continue;
+        }
+        AccuracyStats stats;
+        for (auto i = size_t{0}; i < inputs.size(); i++) {
+            stats.add(ref_out[i], out[i]);
+        }
+        myprintf("%-12s : %s, %.1f evals/s\n", backend.name.c_str(),
+                 stats.summary().c_str(), inputs.size() / seconds);
+    }
+
+    gmgm::globals::num_scheduler_threads = saved_scheduler_threads;
+}
+
+std::vector<std::vector<float>> Network::calibration_inputs(size_t positions) {
+    // random games, so that calibration sees openings, middle games and endgames.
+    // fixed seed so that the same net always gets the same scales
+    std::mt19937 rng(5489);
+    const std::array<std::string, 4> setups = {"smsm", "smms", "mssm", "msms"};
+    auto new_board = [&]() {
+        return gmgm::Board(setups[rng() % setups.size()], setups[rng() % setups.size()]);
+    };
+
+    std::vector<std::vector<float>> ret;
+    ret.reserve(positions);
+    auto b = new_board();
+    while (ret.size() < positions) {
+        const auto & lm = b.get_legal_moves();
+        if (lm.empty() || b.winner() != gmgm::Side::NONE || b.get_movenum() > 150) {
+            b = new_board();
+            continue;
+        }
+        ret.emplace_back(gather_input(b, lm));
+        b.move(lm[rng() % lm.size()]);
+    }
+    return ret;
+}
+
+bool Network::calibrate_int8(size_t positions) {
+    std::unique_lock<std::mutex> lk(m_swap_mutex);
+    if (m_fwd_weights == nullptr || m_fwd_weights->m_conv_weights_raw.empty()) {
+        return false;
+    }
+    const auto channels = static_cast<int>(m_fwd_weights->m_batchnorm_means[0].size());
+    auto weights = std::make_shared<ForwardPipeWeights>(*m_fwd_weights);
+    const auto inputs = calibration_inputs(positions);
+
+    // fp32 pass : collect activation ranges and the reference outputs
+    std::vector<float> act_max(weights->conv_layers(), 0.0f);
+    std::vector<gmgm::PositionEval::RawResult> ref_out;
+    ref_out.reserve(inputs.size());
+    {
+        CPUPipe fp32;
+        fp32.initialize(channels);
+        fp32.push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, weights);
+        fp32.record_activations(&act_max);
+        for (const auto & in : inputs) {
+            std::vector<float> policy_data, value_data;
+            fp32.forward(in, policy_data, value_data);
+            ref_out.emplace_back(*process_output(in, policy_data, value_data));
+        }
+    }
+    weights->m_int8_act_max = act_max;
+
+    // int8 pass : accuracy against fp32
+    AccuracyStats stats;
+    {
+        CPUPipe int8;
+        int8.initialize(channels);
+        int8.use_int8(true);
+        int8.push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, weights);
+        for (auto i = size_t{0}; i < inputs.size(); i++) {
+            std::vector<float> policy_data, value_data;
+            int8.forward(inputs[i], policy_data, value_data);
+            stats.add(ref_out[i], *process_output(inputs[i], policy_data, value_data));
+        }
+    }
+    myprintf("int8 calibration, %d positions : %s\n",
+             static_cast<int>(inputs.size()), stats.summary().c_str());
+
+    m_fwd_weights = weights;
+    if (m_forward != nullptr && m_cpu_backend) {
+        m_forward->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, weights);
+    }
+    return true;
 }
 
 template <size_t spatial_size>
@@ -543,6 +1338,83 @@ void batchnorm(const size_t channels,
     }
 }
 
+std::shared_ptr<ForwardPipe> Network::make_selfcheck_pipe(int channels,
+    std::shared_ptr<const ForwardPipeWeights> weights) {
+    // helper threads would run at normal priority, next to the search
+    auto pipe = std::make_shared<CPUPipe>();
+    pipe->initialize(channels);
+    pipe->set_threads(1);
+    pipe->set_profile_net("selfcheck");
+    pipe->push_weights(WINOGRAD_ALPHA, INPUT_CHANNELS, channels, weights);
+    return pipe;
+}
+
+void Network::start_selfcheck() {
+    m_selfcheck_running = true;
+    m_selfcheck_thread = std::thread(&Network::selfcheck_worker, this);
+#ifdef __linux__
+    // only run when the cores would otherwise be idle
+    sched_param param{};
+    pthread_setschedparam(m_selfcheck_thread.native_handle(), SCHED_IDLE, &param);
+#endif
+}
+
+void Network::stop_selfcheck() {
+    {
+        std::unique_lock<std::mutex> lk(m_selfcheck_mutex);
+        m_selfcheck_running = false;
+    }
+    m_selfcheck_cv.notify_all();
+    if (m_selfcheck_thread.joinable()) {
+        m_selfcheck_thread.join();
+    }
+}
+
+void Network::queue_selfcheck(const std::vector<float>& input,
+                              const gmgm::PositionEval::RawResult& output,
+                              std::uint32_t net_id) {
+    {
+        std::unique_lock<std::mutex> lk(m_selfcheck_mutex);
+        if (m_selfcheck_queue.size() >= MAX_SELFCHECK_QUEUE) {
+            return;
+        }
+        m_selfcheck_queue.push_back(SelfCheckEntry{input, output, net_id});
+    }
+    m_selfcheck_cv.notify_one();
+}
+
+void Network::selfcheck_worker() {
+    while (true) {
+        SelfCheckEntry entry;
+        {
+            std::unique_lock<std::mutex> lk(m_selfcheck_mutex);
+            m_selfcheck_cv.wait(lk, [this] () {
+                return !m_selfcheck_running || !m_selfcheck_queue.empty();
+            });
+            if (!m_selfcheck_running) {
+                return;
+            }
+            entry = std::move(m_selfcheck_queue.front());
+            m_selfcheck_queue.pop_front();
+        }
+
+        // a swap since the sample was taken, or during the cpu pass, may
+        // have put the two on different nets
+        if (m_swap_in_progress || entry.net_id != current_net_id) {
+            continue;
+        }
+        const auto rawout_cpu = __evaluate_raw(entry.input, true);
+        if (m_swap_in_progress || entry.net_id != current_net_id) {
+            continue;
+        }
+        try {
+            compare_net_outputs(entry.output, *rawout_cpu);
+        } catch (const std::runtime_error &) {
+            m_selfcheck_failed = true;
+        }
+    }
+}
+
 void Network::compare_net_outputs(const gmgm::PositionEval::RawResult& data,
                                   const gmgm::PositionEval::RawResult& ref) {
     // Calculates L2-norm between data and ref.
@@ -579,94 +1451,176 @@ void Network::compare_net_outputs(const gmgm::PositionEval::RawResult& data,
     }
 }
 
-std::vector<float> softmax(const std::vector<float>& input,
-                           const float temperature = 1.0f) {
-    auto output = std::vector<float>{};
-    output.reserve(input.size());
-
-    const auto alpha = *std::max_element(cbegin(input), cend(input));
+// softmax over the legal moves only, which are usually less than 100 of the
+// 1440 outputs.  the rest get 0
+std::vector<float> legal_softmax(const std::vector<float>& input,
+                                 const float* legal,
+                                 const float temperature = 1.0f) {
+    auto output = std::vector<float>(input.size(), 0.0f);
+
+    auto alpha = std::numeric_limits<float>::lowest();
+    for (auto i = size_t{0}; i < input.size(); i++) {
+        if (legal[i] > 0.5f) {
+            alpha = std::max(alpha, input[i]);
+        }
+    }
     auto denom = 0.0f;
-
-    for (const auto in_val : input) {
-        auto val = std::exp((in_val - alpha) / temperature);
-        denom += val;
-        output.push_back(val);
+    for (auto i = size_t{0}; i < input.size(); i++) {
+        if (legal[i] > 0.5f) {
+            output[i] = std::exp((input[i] - alpha) / temperature);
+            denom += output[i];
+        }
     }
 
-    for (auto& out : output) {
-        out /= denom;
+    if (denom > 0.0f) {
+        for (auto& out : output) {
+            out /= denom;
+        }
     }
 
     return output;
 }
 
+std::vector<float> Network::gather_input(const gmgm::Board & state, const std::vector<gmgm::Move> & lm) {
+    std::vector<float> input_data(INPUT_CHANNELS * NUM_INTERSECTIONS);
+    extract_input_features(state, lm, input_data.data());
+    return input_data;
+}
+
+int Network::policy_index(const gmgm::Move & m) {
+    // m.piece is whatever was on yx_from when the move was generated
+    return (m.piece % 16) * NUM_INTERSECTIONS + (m.yx_to/10) * gmgm::BOARD_W + m.yx_to%10;
+}
+
+std::shared_ptr<gmgm::EvalResult> Network::raw_to_result(const gmgm::PositionEval::RawResult & rawout,
+                                                         const std::vector<gmgm::Move> & lm) {
+    auto ret = std::make_shared<gmgm::EvalResult>();
+    ret->value = rawout.second;
+    ret->policy.reserve(lm.size());
+    for(const auto & m : lm) {
+        ret->policy.emplace_back(m, rawout.first[policy_index(m)]);
+    }
+    return ret;
+}
+
+std::shared_ptr<gmgm::EvalResult> Network::evaluate_in_place(int net,
+                                                             const gmgm::Board & state,
+                                                             const std::vector<gmgm::Move> & lm) {
+    std::vector<float> policy_data(OUTPUTS_POLICY);
+    std::vector<float> value_data(1);
+    // two references, small enough for std::function to hold without allocating
+    m_forward->forward_fill(net,
+        [&state, &lm](std::uint64_t * packed) {
+            extract_input_features(state, lm, packed);
+        },
+        policy_data, value_data);
+    return output_to_result(policy_data, value_data, lm);
+}
+
+std::shared_ptr<gmgm::EvalResult> Network::output_to_result(const std::vector<float> & policy_data,
+                                                            const std::vector<float> & value_data,
+                                                            const std::vector<gmgm::Move> & lm) {
+    // same as legal_softmax() over the legal move planes.  two pieces of a
+    // kind reaching the same point share an output, which the planes count once
+    auto ret = std::make_shared<gmgm::EvalResult>();
+    ret->value = std::tanh(value_data[0]);
+    ret->policy.reserve(lm.size());
+    auto alpha = std::numeric_limits<float>::lowest();
+    for(const auto & m : lm) {
+        alpha = std::max(alpha, policy_data[policy_index(m)]);
+    }
+    std::bitset<OUTPUTS_POLICY> seen;
+    auto denom = 0.0f;
+    for(const auto & m : lm) {
+        const auto i = policy_index(m);
+        const auto p = std::exp(policy_data[i] - alpha);
+        ret->policy.emplace_back(m, p);
+        if(!seen[i]) {
+            seen.set(i);
+            denom += p;
+        }
+    }
+    if(denom > 0.0f) {
+        for(auto & x : ret->policy) {
+            x.second /= denom;
+        }
+    }
+    return ret;
+}
+
 std::shared_ptr<gmgm::EvalResult> Network::evaluate_raw(gmgm::Board & state) {
-    const auto d = extract_input_features(state);
-    std::vector<float> input_data (66 * gmgm::BOARD_W * gmgm::BOARD_H, 0.0f);
-    for(size_t i=0; i<input_data.size(); i++) {
-        auto boardsize = (gmgm::BOARD_W * gmgm::BOARD_H);
-        input_data[i] = d.features[i/boardsize][i%boardsize];
+    // the legal moves are used for both the input features and the policy mapping,
+    // so generate them once and use the same list for both
+    const auto & lm = state.get_legal_moves();
+
+    // a failed background self-check surfaces here, on a search thread
+    if (m_selfcheck_failed.exchange(false)) {
+        throw std::runtime_error("OpenCL self-check mismatch.");
+    }
+
+    const auto net_id = current_net_id.load();
+    bool run_selfcheck = (std::atomic_load(&m_forward_cpu) != nullptr && !m_swap_in_progress
+                          && m_randsource() % 10000 == 0);
+    if (!run_selfcheck) {
+        return evaluate_in_place(0, state, lm);
     }
 
-    bool run_selfcheck = (m_forward_cpu != nullptr && m_randsource() % 10000 == 0);
+    // the validator needs the input, so these go the long way
+    const auto input_data = gather_input(state, lm);
     auto rawout = evaluate_raw(input_data);
-    if (run_selfcheck) {
-        auto rawout_cpu = __evaluate_raw(input_data, true);
-        compare_net_outputs(*rawout, *rawout_cpu);
-    }
-
-    auto raw_to_result = [&state](auto & rawout) {
-        auto ret = std::make_shared<gmgm::EvalResult>();
-        auto lm = state.get_legal_moves();
-        ret->value = rawout->second;
-        ret->policy.reserve(lm.size());
-        for(auto m : lm) {
-            auto p = state.get_piece_on(m.yx_from);
-            p = p % 16;
-            ret->policy.emplace_back(m, rawout->first[
-                    p * gmgm::BOARD_W * gmgm::BOARD_H
-                    + (m.yx_to/10) * gmgm::BOARD_W + m.yx_to%10
-                ]
-            );
-        }
-        return ret;
-    };
+    queue_selfcheck(input_data, *rawout, net_id);
+
+    return raw_to_result(*rawout, lm);
+}
+
+std::shared_ptr<gmgm::EvalResult> Network::evaluate_raw_large(gmgm::Board & state) {
+    return evaluate_in_place(1, state, state.get_legal_moves());
+}
 
-    return raw_to_result(rawout);
+bool Network::can_evaluate_speculative() {
+    return m_forward->can_forward_speculative();
+}
+
+bool Network::evaluate_speculative(gmgm::Board & state,
+                                   std::function<void(std::shared_ptr<gmgm::EvalResult>)> done) {
+    // the board will be long gone by the time the result comes back, so keep our own move list
+    auto lm = state.get_legal_moves();
+    auto packed = std::vector<std::uint64_t>(PackedInput::WORDS);
+    extract_input_features(state, lm, packed.data());
+
+    return m_forward->forward_speculative(std::move(packed),
+        [this, lm, done](std::vector<float>& output_pol,
+                         std::vector<float>& output_val) {
+            done(output_to_result(output_pol, output_val, lm));
+        }
+    );
 }
 
 std::shared_ptr<gmgm::PositionEval::RawResult> Network::__evaluate_raw(const std::vector<float> & input_data, bool selfcheck) {
     std::vector<float> policy_data(OUTPUTS_POLICY);
-    std::vector<float> value_data(OUTPUTS_VALUE);
+    std::vector<float> value_data(1);
 
     if (selfcheck) {
-        assert(m_forward_cpu != nullptr);
-        m_forward_cpu->forward(input_data, policy_data, value_data);
+        const auto forward_cpu = std::atomic_load(&m_forward_cpu);
+        assert(forward_cpu != nullptr);
+        forward_cpu->forward(input_data, policy_data, value_data);
     } else {
         m_forward->forward(input_data, policy_data, value_data);
     }
 
-    // plane 32~48 from input is 'legal moves'.
-    // if illegal move (zero), subtract 1000 from policy_data before applying softmax
-    // so that we can filter out any noise from invalid moves
-    auto p = cbegin(input_data) + 32 * NUM_INTERSECTIONS;
-    for(auto i=0u; i<policy_data.size(); i++) {
-        if(*p++ < 0.5) {
-            policy_data[i] -= 1000.0f;
-        }
-    }
-
-    const auto outputs = softmax(policy_data, 1.0f);
-
-    // relu
-    for(auto i=0u; i<value_data.size(); i++) {
-        value_data[i] = value_data[i] > 0 ? value_data[i] : 0;
-    }
+    return process_output(input_data, policy_data, value_data);
+}
 
-    const auto winrate_out =
-        innerproduct<OUTPUTS_VALUE, 1, false>(value_data, m_ip2_val_w, m_ip2_val_b);
+std::shared_ptr<gmgm::PositionEval::RawResult> Network::process_output(const std::vector<float> & input_data,
+                                                                       std::vector<float> & policy_data,
+                                                                       std::vector<float> & value_data) {
+    // plane 32~48 from input is 'legal moves'.  the cpu backend only
+    // computes those policy outputs, and nothing else gets any probability
+    const auto outputs = legal_softmax(policy_data,
+                                       input_data.data() + INPUT_LEGAL_PLANE * NUM_INTERSECTIONS);
 
-    const auto winrate = std::tanh(winrate_out[0]);
+    // the pipes already did the rest of the value head
+    const auto winrate = std::tanh(value_data[0]);
 
     auto ret = std::make_shared<gmgm::PositionEval::RawResult>();
     ret->first = std::move(outputs);
@@ -684,15 +1638,19 @@ size_t Network::get_estimated_size() {
     }
     auto result = size_t{0};
 
-    const auto lambda_vector_size =  [](const std::vector<std::vector<float>> &v) {
+    const auto lambda_vector_size =  [](const auto &v) {
         auto result = size_t{0};
         for (auto it = begin(v); it != end(v); ++it) {
-            result += it->size() * sizeof(float);
+            result += it->size() * sizeof((*it)[0]);
         }
         return result;
     };
 
     result += lambda_vector_size(m_fwd_weights->m_conv_weights);
+    result += lambda_vector_size(m_fwd_weights->m_conv_weights_16);
+    for (const auto & mapped : m_fwd_weights->m_conv_weights_mapped) {
+        result += mapped.second * sizeof(float);
+    }
     result += lambda_vector_size(m_fwd_weights->m_conv_biases);
     result += lambda_vector_size(m_fwd_weights->m_batchnorm_means);
     result += lambda_vector_size(m_fwd_weights->m_batchnorm_stddevs);
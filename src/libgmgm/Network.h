@@ -25,8 +25,13 @@
 
 #include <deque>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <fstream>
@@ -51,33 +56,136 @@ class Network : public gmgm::PositionEval {
     using ForwardPipeWeights = ForwardPipe::ForwardPipeWeights;
 private:
     std::shared_ptr<gmgm::PositionEval::RawResult> __evaluate_raw(const std::vector<float> & v, bool selfcheck = false);
+    std::shared_ptr<gmgm::PositionEval::RawResult> process_output(const std::vector<float> & input_data,
+                                                                  std::vector<float> & policy_data,
+                                                                  std::vector<float> & value_data);
+    std::vector<float> gather_input(const gmgm::Board & state, const std::vector<gmgm::Move> & lm);
+    std::shared_ptr<gmgm::EvalResult> raw_to_result(const gmgm::PositionEval::RawResult & rawout,
+                                                    const std::vector<gmgm::Move> & lm);
+    // evaluates on the given net with the input features written straight
+    // into the scheduler's batch buffer
+    std::shared_ptr<gmgm::EvalResult> evaluate_in_place(int net,
+                                                        const gmgm::Board & state,
+                                                        const std::vector<gmgm::Move> & lm);
+    // process_output() and raw_to_result() for evals without an input at
+    // hand : the policy softmax goes over lm instead of the legal move planes
+    std::shared_ptr<gmgm::EvalResult> output_to_result(const std::vector<float> & policy_data,
+                                                       const std::vector<float> & value_data,
+                                                       const std::vector<gmgm::Move> & lm);
+    static int policy_index(const gmgm::Move & m);
+protected:
+    virtual bool can_evaluate_speculative();
+    virtual bool evaluate_speculative(gmgm::Board & b, std::function<void(std::shared_ptr<gmgm::EvalResult>)> done);
+    virtual bool has_large_net() {
+        return m_large_channels.load() != 0;
+    }
+    virtual std::shared_ptr<gmgm::EvalResult> evaluate_raw_large(gmgm::Board & b);
 public:
     using PolicyVertexPair = std::pair<float,int>;
 
     virtual std::shared_ptr<gmgm::EvalResult> evaluate_raw(gmgm::Board & b);
     virtual std::shared_ptr<gmgm::PositionEval::RawResult> evaluate_raw(const std::vector<float> & v);
 
-    static constexpr auto INPUT_CHANNELS = 66;
+    static constexpr auto INPUT_CHANNELS = INPUT_PLANES;
+    // input planes 32~47 are the legal moves, laid out like the policy outputs
+    static constexpr auto INPUT_LEGAL_PLANE = 32;
     static constexpr auto OUTPUTS_POLICY = 16*NUM_INTERSECTIONS;
     static constexpr auto OUTPUTS_VALUE = 256;
     std::atomic<int> error_passed_threshold{0};
 
+    // weightsfile is either a text net (v1 or v5, possibly gzipped) or a
+    // binary net from convert_network()
     void initialize(const std::string & weightsfile);
 
+    // replaces the weights of an initialized net while evals keep running :
+    // evals already in a batch finish on the old net, and cache entries of the
+    // old net stop matching once the swap is done.  the new net must have
+    // the same channel count.  throws if it can't be loaded
+    void swap_weights(const std::string & weightsfile);
+    // same, on a background thread.  errors are reported, not thrown
+    void swap_weights_async(const std::string & weightsfile);
+    // the file of the main net the evals run on.  changes only once a swap
+    // went through
+    std::string weights_file() {
+        std::unique_lock<std::mutex> lk(m_weights_file_mutex);
+        return m_weights_file;
+    }
+
+    // loads weightsfile as the large net of the cascade, next to the main
+    // net on the same scheduler, replacing any large net loaded before.  the
+    // channel count may differ from the main net, but with OpenCL has to
+    // stay the same once a large net was loaded.  throws if it can't be loaded
+    void load_large_net(const std::string & weightsfile);
+
+    // writes the text net weightsfile to outfile as a binary net : winograd
+    // transformed and bias folded already, so that initialize() only has to
+    // map it, and processes loading the same file share its pages
+    void convert_network(const std::string & weightsfile, const std::string & outfile);
+
+    // picks the int8 activation scales by running positions through the fp32
+    // net, and reports int8 accuracy against fp32.  returns false if the net
+    // was not loaded with cpu_precision int8
+    static constexpr auto DEFAULT_CALIBRATION_POSITIONS = 256;
+    bool calibrate_int8(size_t positions);
+
+    // runs positions through every backend that can be built on this host
+    // (cpu with fp32, fp16 and bf16 weights, OpenCL fp32 and fp16) and
+    // reports each one's policy KL, top-1 agreement and value error against
+    // cpu fp32, and its throughput.  OpenCL needs a device, which may be a
+    // cpu runtime
+    void compare_backends(const std::string & weightsfile, size_t positions);
+
 
     static std::vector<float> gather_features(const gmgm::Board & state);
 
     size_t get_estimated_size();
+    bool uses_cpu_backend() const {
+        return m_cpu_backend;
+    }
     size_t get_estimated_cache_size();
 
-    virtual ~Network() {}
+    virtual ~Network() {
+        if (m_swap_thread.joinable()) {
+            m_swap_thread.join();
+        }
+        stop_selfcheck();
+        // stop the scheduler first, since speculative evals call back into us
+        m_forward.reset();
+    }
 private:
-    std::pair<int, int> load_v1_network(std::istream& wtfile);
-    std::pair<int, int> load_v5_network(std::istream& wtfile);
+    // loads weightsfile into m_fwd_weights, ready for the pipes.  clears
+    // use_int8 if the net can't run as int8, and returns the channel count
+    size_t load_weights(const std::string & weightsfile, bool & use_int8);
+    // same, with the given winograd tiling instead of the one of the backend
+    size_t load_weights(const std::string & weightsfile, bool & use_int8,
+                        WinogradKernels::Tiling tiling);
+    // copies mapped binary net weights into m_conv_weights, for OpenCL
+    void unmap_conv_weights();
+    // lines are the parsed weight lines, after the version line
+    std::pair<int, int> load_v1_network(std::deque<std::vector<float>>& lines);
+    std::pair<int, int> load_v5_network(std::deque<std::vector<float>>& lines);
+    // the 14 head lines that end both formats
+    void load_ending_weights(std::vector<float>& weights, const size_t index);
     std::pair<int, int> load_network_file(const std::string& filename);
+    static bool is_binary_network(const std::string& filename);
+    std::pair<int, int> load_binary_network(const std::string& filename);
+    void save_binary_network(const std::string& filename,
+                             size_t channels, size_t residual_blocks);
+    // winograd transform and bias folding of freshly loaded text weights
+    void prepare_weights(size_t channels, size_t residual_blocks,
+                         WinogradKernels::Tiling tiling = WinogradKernels::Tiling::F4X4);
+    std::vector<std::vector<float>> calibration_inputs(size_t positions);
+    // replaces the transformed 3x3 weights by 16 bit copies, for the cpu backend
+    void narrow_conv_weights(bool bf16);
+    // planes of the policy and value head convolutions of m_fwd_weights.
+    // OpenCL workers size their buffers by them when they first run a net
+    using HeadWidths = std::pair<size_t, size_t>;
+    HeadWidths head_widths() const;
 
     static std::vector<float> winograd_transform_f(const std::vector<float>& f,
-                                                   const int outputs, const int channels);
+                                                   const int outputs, const int channels,
+                                                   WinogradKernels::Tiling tiling
+                                                       = WinogradKernels::Tiling::F4X4);
     static std::vector<float> zeropad_U(const std::vector<float>& U,
                                         const int outputs, const int channels,
                                         const int outputs_pad, const int channels_pad);
@@ -100,16 +208,57 @@ private:
                                             std::unique_ptr<ForwardPipe>&& pipe);
     std::unique_ptr<ForwardPipe> m_forward;
     void compare_net_outputs(const gmgm::PositionEval::RawResult& data, const gmgm::PositionEval::RawResult& ref);
-    std::unique_ptr<ForwardPipe> m_forward_cpu;
+
+    // OpenCL self-check : sampled evals are queued along with their OpenCL
+    // output, and rerun on m_forward_cpu by a low priority thread so that
+    // the search threads never wait on the cpu pass.  a mismatch past the
+    // threshold is thrown on the next evaluate_raw() instead
+    class SelfCheckEntry {
+    public:
+        std::vector<float> input;
+        gmgm::PositionEval::RawResult output;
+        std::uint32_t net_id;
+    };
+    // samples beyond this are dropped rather than queued
+    static constexpr auto MAX_SELFCHECK_QUEUE = 16;
+    // a single threaded CPUPipe for m_forward_cpu, so that the whole cpu
+    // pass stays on the low priority thread
+    std::shared_ptr<ForwardPipe> make_selfcheck_pipe(int channels,
+        std::shared_ptr<const ForwardPipeWeights> weights);
+    void start_selfcheck();
+    void stop_selfcheck();
+    void queue_selfcheck(const std::vector<float>& input,
+                         const gmgm::PositionEval::RawResult& output,
+                         std::uint32_t net_id);
+    void selfcheck_worker();
+    std::mutex m_selfcheck_mutex;
+    std::condition_variable m_selfcheck_cv;
+    std::deque<SelfCheckEntry> m_selfcheck_queue; // lock protected
+    bool m_selfcheck_running{false}; // lock protected
+    std::thread m_selfcheck_thread;
+    std::atomic<bool> m_selfcheck_failed{false};
+    // atomic_load / atomic_store only, as swap_weights() replaces it
+    std::shared_ptr<ForwardPipe> m_forward_cpu;
     std::mt19937 m_randsource{1111};
 
     size_t estimated_size{0};
+    bool m_cpu_backend{false};
+    int m_channels{0};
+    // of the large net, 0 if there is none
+    std::atomic<int> m_large_channels{0};
+    // of the main and the large net, see head_widths()
+    HeadWidths m_head_widths{0, 0};
+    HeadWidths m_large_head_widths{0, 0};
+
+    // serializes swaps and calibration, which both replace m_fwd_weights
+    std::mutex m_swap_mutex;
+    std::thread m_swap_thread;
+    std::mutex m_weights_file_mutex;
+    std::string m_weights_file; // lock protected
+    // the two pipes may be on different nets while this is set
+    std::atomic<bool> m_swap_in_progress{false};
 
     // Residual tower
     std::shared_ptr<ForwardPipeWeights> m_fwd_weights;
-
-    // Value head remainder that isn't in m_fwd_weights
-    std::array<float, OUTPUTS_VALUE> m_ip2_val_w;
-    std::array<float, 1> m_ip2_val_b;
 };
 #endif
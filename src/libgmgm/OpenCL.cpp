@@ -39,6 +39,8 @@
 #include "globals.h"
 #include "OpenCL.h"
 #include "Network.h"
+#include "PackedInput.h"
+#include "Profiler.h"
 #include "Tuner.h"
 
 using gmgm::globals::myprintf;
@@ -126,8 +128,12 @@ void OpenCL<net_t>::ensure_context_initialized(OpenCLContext &opencl_context) {
             cl::Kernel(m_program, "out_transform");
         opencl_context.m_fused_bn_res_scale_kernel =
             cl::Kernel(m_program, "fused_bn_res_scale");
+        opencl_context.m_unpack_input_kernel =
+            cl::Kernel(m_program, "unpack_input");
+        // profiling only timestamps the commands and a queue can't turn
+        // it on later, so it is always enabled
         opencl_context.m_commandqueue =
-            cl::CommandQueue(m_context, m_device);
+            cl::CommandQueue(m_context, m_device, CL_QUEUE_PROFILING_ENABLE);
         opencl_context.m_is_initialized = true;
     }
 }
@@ -188,7 +194,7 @@ void OpenCL_Network<net_t>::push_convolve(unsigned int filter_size,
 
 
 template <typename net_t>
-void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
+void OpenCL_Network<net_t>::forward(const std::vector<std::uint64_t>& input,
                              std::vector<float>& output_pol,
                              std::vector<float>& output_val,
                              OpenCLContext & opencl_context,
@@ -224,6 +230,10 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
 
         auto v_zeros = std::vector<net_t>(alloc_vm_size);
 
+        opencl_context.m_packedBuffer = cl::Buffer(
+            m_opencl.m_context,
+            CL_MEM_READ_ONLY,
+            getOpenCL().m_batch_size * PackedInput::WORDS * sizeof(std::uint64_t));
         opencl_context.m_inBuffer = cl::Buffer(
             m_opencl.m_context,
             CL_MEM_READ_WRITE, alloc_inSize);
@@ -266,23 +276,52 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
     cl::Buffer & MBuffer = opencl_context.m_MBuffer;
     cl::CommandQueue & queue = opencl_context.m_commandqueue;
 
-    std::vector<net_t> net_t_input(input.size());
-    std::copy(begin(input), end(input), begin(net_t_input));
-
-    const auto inSize = sizeof(net_t) * input.size();
-    queue.enqueueWriteBuffer(inBuffer, CL_FALSE, 0, inSize, net_t_input.data());
+    // 744 bytes per position go over the bus instead of 66 planes of net_t
+    const auto packedSize = sizeof(std::uint64_t) * input.size();
+    opencl_context.m_profiled.clear();
+    profile_layer(opencl_context, "upload");
+    queue.enqueueWriteBuffer(opencl_context.m_packedBuffer, CL_FALSE, 0, packedSize, input.data(),
+                             nullptr, profile(opencl_context, "upload", packedSize));
+    try {
+        cl::Kernel & unpack_kernel = opencl_context.m_unpack_input_kernel;
+        unpack_kernel.setArg(0, opencl_context.m_packedBuffer);
+        unpack_kernel.setArg(1, inBuffer);
+        unpack_kernel.setArg(2, static_cast<int>(PackedInput::WORDS));
+
+        queue.enqueueNDRangeKernel(unpack_kernel, cl::NullRange,
+                                   cl::NDRange(PackedInput::BITS, batch_size),
+                                   cl::NullRange, nullptr,
+                                   profile(opencl_context, "unpack_input",
+                                           (1.0 * packedSize + 1.0 * sizeof(net_t)
+                                                * PackedInput::BITS * batch_size)));
+    } catch (const cl::Error &e) {
+        std::cerr << "Error in unpack_input: " << e.what() << ": "
+            << e.err() << std::endl;
+        throw;
+    }
 
     // Fused in_out transformation kernel is slower with big batch_sizes than
     // calling out and in transformations separately.
     // This condition could be tunable in future.
     auto use_inout = false;
 
+    // layers count the flops of a direct convolution, like the cpu pipe does
+    const auto conv3_flops = [](double channels, double outputs, double n) {
+        return 2.0 * 9 * channels * outputs * NUM_INTERSECTIONS * n;
+    };
+    const auto head_flops = [](const Layer & layer, double n) {
+        return 2.0 * (layer.channels + layer.outputs) * layer.mids * NUM_INTERSECTIONS * n;
+    };
+
     auto skip_in_trans = false;
+    auto block = 0;
     for (auto iter = cbegin(m_layers); iter != cend(m_layers); iter++) {
         const auto& layer = *iter;
         const auto niter = std::next(iter);
 
         if (layer.is_input_convolution) {
+            profile_layer(opencl_context, "input_conv", -1,
+                          conv3_flops(layer.channels, layer.outputs, batch_size));
             assert(niter != cend(m_layers));
             auto conv_weights = begin(layer.weights);
             auto bn_weights = begin(layer.weights) + 1;
@@ -313,6 +352,8 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
             auto bn1_weights   = begin(layer.weights) + 1;
             auto conv2_weights = begin(layer.weights) + 3;
             auto bn2_weights   = begin(layer.weights) + 4;
+            profile_layer(opencl_context, "res_conv1", block,
+                          conv3_flops(layer.channels, layer.outputs, batch_size));
             convolve3(opencl_context,
                       layer.channels,
                       layer.outputs,
@@ -338,6 +379,8 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
                 sq1 = &(layer.weights[6]);
                 sq2 = &(layer.weights[7]);
             }
+            profile_layer(opencl_context, "res_conv2", block,
+                          conv3_flops(layer.channels, layer.outputs, batch_size));
             convolve3(opencl_context,
                       layer.channels,
                       layer.outputs,
@@ -354,6 +397,7 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
                       sq1, sq2
             );
             skip_in_trans = skip_next_in_trans;
+            block++;
         } else {
             assert(layer.is_final_conv);
 
@@ -362,9 +406,13 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
             if (niter == cend(m_layers)) {
                 out_buffer = opencl_context.m_pinnedOutBuffer_val;
                 mid_buffer = opencl_context.m_midBuffer_val;
+                profile_layer(opencl_context, "value_head", -1,
+                              head_flops(layer, batch_size));
             } else {
                 out_buffer = opencl_context.m_pinnedOutBuffer_pol;
                 mid_buffer = opencl_context.m_midBuffer_pol;
+                profile_layer(opencl_context, "policy_head", -1,
+                              head_flops(layer, batch_size));
             }
 
             convolve1(opencl_context, layer.channels,
@@ -408,6 +456,9 @@ void OpenCL_Network<net_t>::forward(const std::vector<float>& input,
         next_sleeptime = std::min(next_sleeptime, 1000000);
         sleeptime = next_sleeptime;
     }
+    if (!opencl_context.m_profiled.empty()) {
+        collect_profile(opencl_context);
+    }
 
     auto polptr = static_cast<float*>(pinnedOutBufferHost_pol);
     auto valptr = static_cast<float*>(pinnedOutBufferHost_val);
@@ -483,6 +534,10 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
 
     cl::CommandQueue & queue = opencl_context.m_commandqueue;
 
+    constexpr auto s = double{sizeof(net_t)};
+    const auto planes_size = s * NUM_INTERSECTIONS * batch_size;
+    const auto VM_size = s * WINOGRAD_TILE * n_ceil;
+
     if (!skip_in_transform) {
         try {
             in_transform_kernel.setArg(0, bufferIn);
@@ -493,7 +548,9 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
             in_transform_kernel.setArg(5, batch_size);
 
             queue.enqueueNDRangeKernel(in_transform_kernel, cl::NullRange,
-                                       cl::NDRange(wgs, channels));
+                                       cl::NDRange(wgs, channels), cl::NullRange, nullptr,
+                                       profile(opencl_context, "in_transform",
+                                               planes_size * channels + VM_size * k_ceil));
         } catch (const cl::Error &e) {
             std::cerr << "Error in convolve3/in: " << e.what() << ": "
                 << e.err() << std::endl;
@@ -523,7 +580,12 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
                           cl::size_type(WINOGRAD_TILE)};
         }
         queue.enqueueNDRangeKernel(sgemm_kernel, cl::NullRange,
-                                   size_sgemm, local_sgemm);
+                                   size_sgemm, local_sgemm, nullptr,
+                                   profile(opencl_context, "sgemm",
+                                           s * WINOGRAD_TILE * m_ceil * k_ceil
+                                               + VM_size * (k_ceil + m_ceil),
+                                           2.0 * WINOGRAD_TILE * outputs * channels
+                                               * tiles * batch_size));
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3/sgemm: " << e.what() << ": "
             << e.err() << std::endl;
@@ -564,7 +626,11 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
             queue.enqueueNDRangeKernel(out_transform_bn_in_kernel,
                                        cl::NullRange,
                                        cl::NDRange(outputs, wgs_single, batch_size),
-                                       cl::NDRange(dim_size, wgs_single, 1));
+                                       cl::NDRange(dim_size, wgs_single, 1), nullptr,
+                                       profile(opencl_context, "out_transform_bn_in",
+                                               VM_size * (m_ceil + k_ceil2)
+                                                   + planes_size * outputs
+                                                     * (store_inout + (bufferResidual != nullptr))));
 
         } else if(sq1 == nullptr || sq2 == nullptr) {
             // no squeeze layer
@@ -591,7 +657,10 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
 
             queue.enqueueNDRangeKernel(out_transform_bn_kernel, cl::NullRange,
                                        global_out,
-                                       local_out);
+                                       local_out, nullptr,
+                                       profile(opencl_context, "out_transform_bn",
+                                               VM_size * m_ceil + planes_size * outputs
+                                                   * (1 + (bufferResidual != nullptr))));
         } else {
             out_transform_kernel.setArg(0, bufferM);
             out_transform_kernel.setArg(1, bufferTemp);
@@ -611,7 +680,9 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
 
             queue.enqueueNDRangeKernel(out_transform_kernel, cl::NullRange,
                                        global_out,
-                                       local_out);
+                                       local_out, nullptr,
+                                       profile(opencl_context, "out_transform",
+                                               VM_size * m_ceil + planes_size * outputs));
 
             fused_bn_res_scale_kernel.setArg(0, bufferTemp);
             fused_bn_res_scale_kernel.setArg(1, bufferOut);
@@ -627,7 +698,10 @@ void OpenCL_Network<net_t>::convolve3(OpenCLContext & opencl_context,
             global_out = {static_cast<size_t>(channels * batch_size), 1};
             queue.enqueueNDRangeKernel(fused_bn_res_scale_kernel, cl::NullRange,
                                        global_out,
-                                       local_out);
+                                       local_out, nullptr,
+                                       profile(opencl_context, "fused_bn_res_scale",
+                                               3.0 * planes_size * channels,
+                                               4.0 * channels * channels / 8 * batch_size));
         }
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve3/out: " << e.what() << ": "
@@ -675,6 +749,9 @@ void OpenCL_Network<net_t>::convolve1(OpenCLContext & opencl_context,
 
     cl::CommandQueue & queue = opencl_context.m_commandqueue;
 
+    constexpr auto s = double{sizeof(net_t)};
+    const auto merge_size = 4.0 * (channels >> channelShift) * mids * boardsize * batch_size;
+
     try {
         m_convolve_kernel->setArg(0, bufferInput);
         m_convolve_kernel->setArg(1, bufferMerge);
@@ -685,7 +762,10 @@ void OpenCL_Network<net_t>::convolve1(OpenCLContext & opencl_context,
         queue.enqueueNDRangeKernel(
             *m_convolve_kernel, cl::NullRange,
             cl::NDRange(channels, mids, batch_size * rowTiles),
-            cl::NDRange(channelGroup, outputGroup, rowGroup));
+            cl::NDRange(channelGroup, outputGroup, rowGroup), nullptr,
+            profile(opencl_context, "convolve1",
+                    s * channels * (boardsize * batch_size + mids) + merge_size,
+                    2.0 * channels * mids * boardsize * batch_size));
     } catch (const cl::Error &e) {
         std::cerr << "Error in convolve1: " << e.what() << ": "
                   << e.err() << std::endl;
@@ -705,7 +785,8 @@ void OpenCL_Network<net_t>::convolve1(OpenCLContext & opencl_context,
         queue.enqueueNDRangeKernel(
             merge_kernel, cl::NullRange,
             cl::NDRange(mids, boardsize, batch_size),
-            cl::NDRange(std::min(8, mids), gmgm::BOARD_H, 1));
+            cl::NDRange(std::min(8, mids), gmgm::BOARD_H, 1), nullptr,
+            profile(opencl_context, "merge", merge_size + s * mids * boardsize * batch_size));
     } catch (const cl::Error &e) {
         std::cerr << "Error in merge: " << e.what() << ": "
                   << e.err() << std::endl;
@@ -723,7 +804,10 @@ void OpenCL_Network<net_t>::convolve1(OpenCLContext & opencl_context,
         queue.enqueueNDRangeKernel(
             fc_kernel, cl::NullRange,
             cl::NDRange(outputs, batch_size, mids),
-            cl::NDRange(1, 1, mids)
+            cl::NDRange(1, 1, mids), nullptr,
+            profile(opencl_context, "fully_connected",
+                    s * mids * boardsize * (outputs + batch_size) + 4.0 * outputs * batch_size,
+                    2.0 * mids * boardsize * outputs * batch_size)
         );
     } catch (const cl::Error &e) {
         std::cerr << "Error in fc: " << e.what() << ": "
@@ -732,6 +816,63 @@ void OpenCL_Network<net_t>::convolve1(OpenCLContext & opencl_context,
     }
 }
 
+template <typename net_t>
+cl::Event * OpenCL_Network<net_t>::profile(OpenCLContext & opencl_context,
+                                           const char * name,
+                                           double bytes, double flops) {
+    if (opencl_context.m_profile_layer == nullptr) {
+        return nullptr;
+    }
+    opencl_context.m_profiled.emplace_back();
+    auto & k = opencl_context.m_profiled.back();
+    k.name = name;
+    k.layer = opencl_context.m_profile_layer;
+    k.index = opencl_context.m_profile_index;
+    k.layer_flops = opencl_context.m_profile_flops;
+    k.bytes = bytes;
+    k.flops = flops;
+    return &k.event;
+}
+
+template <typename net_t>
+void OpenCL_Network<net_t>::profile_layer(OpenCLContext & opencl_context,
+                                          const char * layer, int index, double flops) {
+    // sampled per layer so that toggling mid-pass only loses part of a pass
+    opencl_context.m_profile_layer = Profiler::enabled() ? layer : nullptr;
+    opencl_context.m_profile_index = index;
+    opencl_context.m_profile_flops = flops;
+}
+
+template <typename net_t>
+void OpenCL_Network<net_t>::collect_profile(OpenCLContext & opencl_context) {
+    // layers are the sums of their kernels, in device time.  the events are
+    // complete, so reading their timestamps doesn't wait
+    auto & kernels = opencl_context.m_profiled;
+    auto layer_begin = begin(kernels);
+    auto layer_seconds = 0.0;
+    auto layer_bytes = 0.0;
+    for (auto it = begin(kernels); it != end(kernels); ++it) {
+        const auto start = it->event.template getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        const auto finish = it->event.template getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        const auto seconds = (finish - start) * 1e-9;
+        Profiler::add(Profiler::Kind::KERNEL, "opencl", m_profile_net, it->name, -1,
+                      seconds, it->bytes, it->flops);
+        layer_seconds += seconds;
+        layer_bytes += it->bytes;
+
+        const auto next = std::next(it);
+        if (next == end(kernels) || next->layer != layer_begin->layer
+            || next->index != layer_begin->index) {
+            Profiler::add(Profiler::Kind::LAYER, "opencl", m_profile_net, layer_begin->layer,
+                          layer_begin->index, layer_seconds, layer_bytes,
+                          layer_begin->layer_flops);
+            layer_begin = next;
+            layer_seconds = layer_bytes = 0.0;
+        }
+    }
+    kernels.clear();
+}
+
 template<class T>
 static std::string opencl_dev_type_to_string(T type) {
     if (type == CL_DEVICE_TYPE_CPU) {
@@ -52,6 +52,20 @@ private:
     std::vector<cl::Buffer> weights;
 };
 
+// a kernel enqueued while profiling, read back once the queue is finished
+class ProfiledKernel {
+    template <typename> friend class OpenCL_Network;
+private:
+    cl::Event event;
+    const char * name;
+    const char * layer;
+    int index;
+    double bytes;
+    double flops;
+    // of the whole layer
+    double layer_flops;
+};
+
 class OpenCLContext {
     template <typename> friend class OpenCL;
     template <typename> friend class OpenCL_Network;
@@ -67,6 +81,8 @@ private:
     cl::Kernel m_out_transform_bn_in_kernel;
     cl::Kernel m_out_transform_kernel;
     cl::Kernel m_fused_bn_res_scale_kernel;
+    cl::Kernel m_unpack_input_kernel;
+    cl::Buffer m_packedBuffer;
     cl::Buffer m_inBuffer;
     cl::Buffer m_tempBuffer;
     cl::Buffer m_inBuffer2;
@@ -77,6 +93,12 @@ private:
     cl::Buffer m_pinnedOutBuffer_pol;
     cl::Buffer m_pinnedOutBuffer_val;
     bool m_buffers_allocated{false};
+
+    // the layer being enqueued and its kernels so far, while profiling
+    const char * m_profile_layer{nullptr};
+    int m_profile_index{-1};
+    double m_profile_flops{0.0};
+    std::vector<ProfiledKernel> m_profiled;
 };
 
 template <typename net_t>
@@ -86,6 +108,11 @@ public:
     OpenCL<net_t> & getOpenCL() {
         return m_opencl;
     }
+    // which net the profiler files this network's samples under, see
+    // Profiler::net_name().  "main" by default
+    void set_profile_net(const char * net) {
+        m_profile_net = net;
+    }
 
     void push_input_convolution(unsigned int filter_size,
                        unsigned int channels,
@@ -147,7 +174,9 @@ public:
         return m_layers.size();
     }
 
-    void forward(const std::vector<float>& input,
+    // input is batch_size positions of PackedInput::WORDS words each.  it
+    // is uploaded packed and expanded on the device
+    void forward(const std::vector<std::uint64_t>& input,
             std::vector<float>& output_pol,
             std::vector<float>& output_val,
             OpenCLContext & opencl_context,
@@ -185,9 +214,18 @@ private:
                   weight_slice_t weights,
                   int batch_size);
 
+    // the event to enqueue a kernel with, or nullptr when not profiling
+    cl::Event * profile(OpenCLContext & opencl_context, const char * name,
+                        double bytes, double flops = 0.0);
+    void profile_layer(OpenCLContext & opencl_context, const char * layer,
+                       int index = -1, double flops = 0.0);
+    // adds the kernel and layer times of a finished forward pass
+    void collect_profile(OpenCLContext & opencl_context);
+
     std::atomic<int> sleeptime{1};
 
     OpenCL<net_t> & m_opencl;
+    const char * m_profile_net = "main";
 
     // this mutex is not required for correctness, but this exists simply
     // because queue.finish() is a busy wait and having a lot of threads
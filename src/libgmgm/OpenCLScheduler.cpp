@@ -20,12 +20,14 @@
 */
 
 
+#include <cassert>
 #include <cstdio>
 
 #include "half/half.hpp"
 #include "Network.h"
 #include "OpenCLScheduler.h"
 #include "globals.h"
+#include "Profiler.h"
 
 using gmgm::globals::myprintf;
 
@@ -93,10 +95,8 @@ OpenCLScheduler<net_t>::OpenCLScheduler() {
     for(int gpu = 0; ; gpu++) {
         try {
             auto opencl = std::make_unique<OpenCL<net_t>>(gpu, silent);
-            auto net = std::make_unique<OpenCL_Network<net_t>>(*opencl);
             m_opencl.push_back(std::move(opencl));
-            m_networks.push_back(std::move(net));
-    
+
             // Starting next GPU, let's not dump full list of GPUs.
             silent = true;
         } catch( std::runtime_error & ) {
@@ -159,6 +159,7 @@ bool OpenCLScheduler<net_t>::needs_autodetect() {
 
 template <typename net_t>
 void OpenCLScheduler<net_t>::push_input_convolution(
+    const NetworkList& networks,
     unsigned int filter_size,
     unsigned int channels,
     unsigned int outputs,
@@ -166,7 +167,7 @@ void OpenCLScheduler<net_t>::push_input_convolution(
     const std::vector<float>& means,
     const std::vector<float>& variances) {
 
-    for (const auto& opencl_net : m_networks) {
+    for (const auto& opencl_net : networks) {
         const auto tuners = opencl_net->getOpenCL().get_sgemm_tuners();
 
         const auto mwg = tuners[0];
@@ -187,7 +188,8 @@ void OpenCLScheduler<net_t>::push_input_convolution(
 }
 
 template <typename net_t>
-void OpenCLScheduler<net_t>::push_residual(unsigned int filter_size,
+void OpenCLScheduler<net_t>::push_residual(const NetworkList& networks,
+                                           unsigned int filter_size,
                                            unsigned int channels,
                                            unsigned int outputs,
                                            const std::vector<float>& weights_1,
@@ -199,7 +201,7 @@ void OpenCLScheduler<net_t>::push_residual(unsigned int filter_size,
                                            const std::vector<float>& se_1,
                                            const std::vector<float>& se_2
                                            ) {
-    for (const auto& opencl_net : m_networks) {
+    for (const auto& opencl_net : networks) {
         const auto tuners = opencl_net->getOpenCL().get_sgemm_tuners();
 
         const auto mwg = tuners[0];
@@ -225,7 +227,8 @@ void OpenCLScheduler<net_t>::push_residual(unsigned int filter_size,
 }
 
 template <typename net_t>
-void OpenCLScheduler<net_t>::push_convolve(unsigned int filter_size,
+void OpenCLScheduler<net_t>::push_convolve(const NetworkList& networks,
+                                           unsigned int filter_size,
                                            unsigned int channels,
                                            unsigned int outputs,
                                            const std::vector<float>& conv_weights,
@@ -233,7 +236,7 @@ void OpenCLScheduler<net_t>::push_convolve(unsigned int filter_size,
                                            const std::vector<float>& bn_pol_stddevs,
                                            const std::vector<float>& fc_weights,
                                            const std::vector<float>& fc_biases) {
-    for (const auto & opencl_net : m_networks) {
+    for (const auto & opencl_net : networks) {
         opencl_net->push_convolve(filter_size, channels, outputs,
                                   from_float(conv_weights),
                                   from_float(bn_pol_means),
@@ -250,11 +253,30 @@ void OpenCLScheduler<net_t>::push_weights(
     unsigned int channels,
     unsigned int outputs,
     std::shared_ptr<const ForwardPipeWeights> weights) {
+    push_net_weights(0, filter_size, channels, outputs, weights);
+}
+
+template <typename net_t>
+void OpenCLScheduler<net_t>::push_net_weights(
+    int net,
+    unsigned int filter_size,
+    unsigned int channels,
+    unsigned int outputs,
+    std::shared_ptr<const ForwardPipeWeights> weights) {
+
+    // uploading happens while the workers keep running on the old set
+    auto nets = std::make_shared<NetworkSet>();
+    for (auto & opencl : m_opencl) {
+        nets->networks.push_back(std::make_unique<OpenCL_Network<net_t>>(*opencl));
+        nets->networks.back()->set_profile_net(Profiler::net_name(net));
+    }
+    nets->weights = weights;
+    const auto & networks = nets->networks;
 
     auto weight_index = size_t{0};
 
     // Winograd filter transformation changes filter size to 4x4
-    push_input_convolution(filter_size, channels, outputs,
+    push_input_convolution(networks, filter_size, channels, outputs,
                            weights->m_conv_weights[weight_index],
                            weights->m_batchnorm_means[weight_index],
                            weights->m_batchnorm_stddevs[weight_index]);
@@ -263,7 +285,7 @@ void OpenCLScheduler<net_t>::push_weights(
     // residual blocks : except the first entry,
     // the second ~ last entry is all on residual topwer
     for (auto i = size_t{0}; i < weights->m_conv_weights.size()/2; i++) {
-        push_residual(filter_size, outputs, outputs,
+        push_residual(networks, filter_size, outputs, outputs,
                       weights->m_conv_weights[weight_index],
                       weights->m_batchnorm_means[weight_index],
                       weights->m_batchnorm_stddevs[weight_index],
@@ -282,47 +304,97 @@ void OpenCLScheduler<net_t>::push_weights(
     }
 
     // Output head convolutions
-    push_convolve(1, outputs, Network::OUTPUTS_POLICY,
+    push_convolve(networks, 1, outputs, Network::OUTPUTS_POLICY,
         weights->m_conv_pol_w,
         weights->m_bn_pol_w1,
         weights->m_bn_pol_w2,
         weights->m_ip_pol_w,
         weights->m_ip_pol_b
     );
-    push_convolve(1, outputs, Network::OUTPUTS_VALUE,
+    push_convolve(networks, 1, outputs, Network::OUTPUTS_VALUE,
         weights->m_conv_val_w,
         weights->m_bn_val_w1,
         weights->m_bn_val_w2,
         weights->m_ip_val_w,
         weights->m_ip_val_b
     );
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_networks[net] = std::move(nets);
 }
 
 template <typename net_t>
 void OpenCLScheduler<net_t>::forward(const std::vector<float>& input,
                                      std::vector<float>& output_pol,
                                      std::vector<float>& output_val) {
-    auto entry = std::make_shared<ForwardQueueEntry>(input, output_pol, output_val);
+    forward_net(0, input, output_pol, output_val);
+}
+
+template <typename net_t>
+void OpenCLScheduler<net_t>::forward_net(int net,
+                                         const std::vector<float>& input,
+                                         std::vector<float>& output_pol,
+                                         std::vector<float>& output_val) {
+    assert(net >= 0 && net < NUM_NETS);
+    run(std::make_shared<ForwardQueueEntry>(net, input, output_pol, output_val));
+}
+
+template <typename net_t>
+void OpenCLScheduler<net_t>::forward_fill(int net,
+                                          const InputFiller& fill,
+                                          std::vector<float>& output_pol,
+                                          std::vector<float>& output_val) {
+    assert(net >= 0 && net < NUM_NETS);
+    run(std::make_shared<ForwardQueueEntry>(net, fill, output_pol, output_val));
+}
+
+// queues the eval and waits until a worker is done with it
+template <typename net_t>
+void OpenCLScheduler<net_t>::run(std::shared_ptr<ForwardQueueEntry> entry) {
     std::unique_lock<std::mutex> lk(entry->mutex);
     {
         std::unique_lock<std::mutex> lk(m_mutex);
         m_forward_queue.push_back(entry);
+        m_queued[entry->net]++;
     }
     m_cv.notify_one();
     entry->cv.wait(lk);
 }
 
+template <typename net_t>
+bool OpenCLScheduler<net_t>::can_forward_speculative() {
+    // keep about a batch worth of speculative evals around.  if the queue stays full,
+    // the batches are full, too, and there is no point preparing more of them.
+    return m_speculative_queue_size.load() < static_cast<size_t>(gmgm::globals::batch_size);
+}
+
+template <typename net_t>
+bool OpenCLScheduler<net_t>::forward_speculative(std::vector<std::uint64_t>&& input,
+                                                 SpeculativeCallback callback) {
+    if (!can_forward_speculative()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_speculative_queue.push_back(std::make_unique<SpeculativeEntry>(std::move(input), callback));
+    m_speculative_queue_size++;
+    return true;
+}
+
 #ifndef NDEBUG
 struct batch_stats_t batch_stats;
 #endif
 
 template <typename net_t>
 void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
-    constexpr auto in_size = Network::INPUT_CHANNELS * gmgm::BOARD_W * gmgm::BOARD_H;
+    constexpr auto in_size = PackedInput::WORDS;
     constexpr auto out_pol_size = Network::OUTPUTS_POLICY;
     constexpr auto out_val_size = Network::OUTPUTS_VALUE;
 
-    OpenCLContext context;
+    // the contexts hold buffers sized for the channel count of their net,
+    // which is why a weight swap has to keep that the same
+    std::array<OpenCLContext, NUM_NETS> contexts;
+    std::shared_ptr<NetworkSet> nets;
+    auto net = 0;
 
     // batch scheduling heuristic.
     // Returns the batch picked up from the queue (m_forward_queue)
@@ -342,25 +414,40 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
     // while that single eval was being processed, it means that we made
     // the wrong decision.  Wait 2ms longer next time.
 
-    auto pickup_task = [this] () {
+    //
+    // batches are never mixed between the two nets of the cascade, so the
+    // above goes by the evals queued for each net.
+
+    auto pickup_task = [this, &nets, &net] () {
         std::list<std::shared_ptr<ForwardQueueEntry>> inputs;
         size_t count = 0;
 
+        const auto batch_size = static_cast<size_t>(gmgm::globals::batch_size);
+        // a net that has a full batch queued, or -1
+        auto full_net = [this, batch_size] () {
+            for (auto i = 0; i < NUM_NETS; i++) {
+                if (m_queued[i] >= batch_size) {
+                    return i;
+                }
+            }
+            return -1;
+        };
+
         std::unique_lock<std::mutex> lk(m_mutex);
         while (true) {
             if (!m_running) return inputs;
 
-            count = m_forward_queue.size();
-            if (count >= static_cast<size_t>(gmgm::globals::batch_size)) {
-                count = gmgm::globals::batch_size;
+            net = full_net();
+            if (net >= 0) {
+                count = batch_size;
                 break;
             }
 
             bool timeout = !m_cv.wait_for(
                 lk,
                 std::chrono::milliseconds(m_waittime),
-                [this] () {
-                    return !m_running || m_forward_queue.size() >= static_cast<size_t>(gmgm::globals::batch_size);
+                [this, &full_net] () {
+                    return !m_running || full_net() >= 0;
                 }
             );
 
@@ -372,23 +459,46 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
                     if (m_waittime > 1) {
                         m_waittime--;
                     }
+                    net = m_forward_queue.front()->net;
                     count = 1;
                     break;
                 }
             }
         }
-        // Move 'count' evals from shared queue to local list.
-        auto end = begin(m_forward_queue);
-        std::advance(end, count);
-        std::move(begin(m_forward_queue), end, std::back_inserter(inputs));
-        m_forward_queue.erase(begin(m_forward_queue), end);
+        // Move 'count' evals of that net from shared queue to local list, oldest first.
+        for (auto it = begin(m_forward_queue);
+             it != end(m_forward_queue) && inputs.size() < count; ) {
+            auto next = std::next(it);
+            if ((*it)->net == net) {
+                inputs.splice(end(inputs), m_forward_queue, it);
+            }
+            it = next;
+        }
+        m_queued[net] -= inputs.size();
+        nets = m_networks[net];
 
         return inputs;
     };
 
-    auto batch_input = std::vector<float>();
+    // fill the rest of an underfull batch with speculative evals, newest first.
+    // these slots would have gone idle anyway.
+    auto pickup_speculative = [this] (size_t count) {
+        std::vector<std::unique_ptr<SpeculativeEntry>> ret;
+        std::unique_lock<std::mutex> lk(m_mutex);
+        while (count + ret.size() < static_cast<size_t>(gmgm::globals::batch_size)
+               && !m_speculative_queue.empty()) {
+            ret.push_back(std::move(m_speculative_queue.back()));
+            m_speculative_queue.pop_back();
+            m_speculative_queue_size--;
+        }
+        return ret;
+    };
+
+    auto batch_input = std::vector<std::uint64_t>();
     auto batch_output_pol = std::vector<float>();
     auto batch_output_val = std::vector<float>();
+    auto spec_output_pol = std::vector<float>(out_pol_size);
+    auto spec_output_val = std::vector<float>(1);
 
     while (true) {
         auto inputs = pickup_task();
@@ -398,29 +508,52 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
             return;
         }
 
+        // speculative evals are all for the main net
+        std::vector<std::unique_ptr<SpeculativeEntry>> speculative;
+        if (net == 0) {
+            speculative = pickup_speculative(count);
+        }
+        auto total_count = count + speculative.size();
+
 #ifndef NDEBUG
         if (count == 1) {
             batch_stats.single_evals++;
         } else {
             batch_stats.batch_evals++;
         }
+        batch_stats.speculative_evals += speculative.size();
 #endif
 
-        // prepare input for forward() call
-        batch_input.resize(in_size * count);
-        batch_output_pol.resize(out_pol_size * count);
-        batch_output_val.resize(out_val_size * count);
+        // prepare input for forward() call.  fill entries write their
+        // features straight into their slot.  the batch is uploaded packed
+        // and expanded on the device
+        batch_input.resize(in_size * total_count);
+        batch_output_pol.resize(out_pol_size * total_count);
+        batch_output_val.resize(out_val_size * total_count);
 
         auto index = size_t{0};
         for (auto & x : inputs) {
             std::unique_lock<std::mutex> lk(x->mutex);
+            const auto slot = batch_input.data() + in_size * index;
+            if (x->fill != nullptr) {
+                (*x->fill)(slot);
+            } else {
+                PackedInput::pack(x->in->data(), slot);
+            }
+            index++;
+        }
+        for (auto & x : speculative) {
             std::copy(begin(x->in), end(x->in), begin(batch_input) + in_size * index);
             index++;
         }
 
         // run the NN evaluation
-        m_networks[gnum]->forward(
-            batch_input, batch_output_pol, batch_output_val, context, count);
+        nets->networks[gnum]->forward(
+            batch_input, batch_output_pol, batch_output_val, contexts[net], total_count);
+        // packed in place : value i never overwrites a later position's hidden layer
+        for (auto i = size_t{0}; i < total_count; i++) {
+            batch_output_val[i] = nets->weights->value_output(&batch_output_val[out_val_size * i]);
+        }
 
         // Get output and copy back
         index = 0;
@@ -428,9 +561,7 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
             std::copy(begin(batch_output_pol) + out_pol_size * index,
                       begin(batch_output_pol) + out_pol_size * (index + 1),
                       begin(x->out_p));
-            std::copy(begin(batch_output_val) + out_val_size * index,
-                      begin(batch_output_val) + out_val_size * (index + 1),
-                      begin(x->out_v));
+            x->out_v[0] = batch_output_val[index];
             x->cv.notify_all();
             index++;
         }
@@ -438,6 +569,16 @@ void OpenCLScheduler<net_t>::batch_worker(const size_t gnum) {
         if (count == 1) {
             m_single_eval_in_progress = false;
         }
+
+        // speculative results go last, after everybody waiting got their results
+        for (auto & x : speculative) {
+            std::copy(begin(batch_output_pol) + out_pol_size * index,
+                      begin(batch_output_pol) + out_pol_size * (index + 1),
+                      begin(spec_output_pol));
+            spec_output_val[0] = batch_output_val[index];
+            x->callback(spec_output_pol, spec_output_val);
+            index++;
+        }
     }
 }
 
@@ -22,7 +22,9 @@
 #ifndef OPENCLSCHEDULER_H_INCLUDED
 #define OPENCLSCHEDULER_H_INCLUDED
 
+#include <array>
 #include <list>
+#include <memory>
 #include <vector>
 #include <thread>
 #include <condition_variable>
@@ -34,6 +36,7 @@
 struct batch_stats_t {
     std::atomic<size_t> single_evals{0};
     std::atomic<size_t> batch_evals{0};
+    std::atomic<size_t> speculative_evals{0};
 };
 extern batch_stats_t batch_stats;
 #endif
@@ -44,13 +47,31 @@ class OpenCLScheduler : public ForwardPipe {
     public:
         std::mutex mutex;
         std::condition_variable cv;
-        const std::vector<float>& in;
+        int net;
+        // one of the two is set : the input, or what writes it
+        const std::vector<float>* in = nullptr;
+        const InputFiller* fill = nullptr;
         std::vector<float>& out_p;
         std::vector<float>& out_v;
-        ForwardQueueEntry(const std::vector<float>& input,
+        ForwardQueueEntry(int net_index,
+                          const std::vector<float>& input,
                           std::vector<float>& output_pol,
                           std::vector<float>& output_val)
-        : in(input), out_p(output_pol), out_v(output_val)
+        : net(net_index), in(&input), out_p(output_pol), out_v(output_val)
+          {}
+        ForwardQueueEntry(int net_index,
+                          const InputFiller& filler,
+                          std::vector<float>& output_pol,
+                          std::vector<float>& output_val)
+        : net(net_index), fill(&filler), out_p(output_pol), out_v(output_val)
+          {}
+    };
+    class SpeculativeEntry {
+    public:
+        std::vector<std::uint64_t> in;
+        SpeculativeCallback callback;
+        SpeculativeEntry(std::vector<std::uint64_t>&& input, SpeculativeCallback cb)
+        : in(std::move(input)), callback(cb)
           {}
     };
 public:
@@ -66,9 +87,38 @@ public:
                               unsigned int channels,
                               unsigned int outputs,
                               std::shared_ptr<const ForwardPipeWeights> weights);
+    virtual bool supports_second_net() { return true; }
+    virtual void push_net_weights(int net,
+                                  unsigned int filter_size,
+                                  unsigned int channels,
+                                  unsigned int outputs,
+                                  std::shared_ptr<const ForwardPipeWeights> weights);
+    virtual void forward_net(int net,
+                             const std::vector<float>& input,
+                             std::vector<float>& output_pol,
+                             std::vector<float>& output_val);
+    virtual void forward_fill(int net,
+                              const InputFiller& fill,
+                              std::vector<float>& output_pol,
+                              std::vector<float>& output_val);
+    virtual bool can_forward_speculative();
+    virtual bool forward_speculative(std::vector<std::uint64_t>&& input, SpeculativeCallback callback);
 private:
+    using NetworkList = std::vector<std::unique_ptr<OpenCL_Network<net_t>>>;
+
+    // one OpenCL_Network per GPU, and the weights they were built from (for
+    // the last value layer, done on the host).  push_weights() builds a new
+    // set and swaps it in : workers take a reference at batch pickup, so
+    // batches in flight finish on the set they started with.  there is one
+    // set per net, the second one being empty unless the cascade is used
+    class NetworkSet {
+    public:
+        NetworkList networks;
+        std::shared_ptr<const ForwardPipeWeights> weights;
+    };
+
     bool m_running = true;
-    std::vector<std::unique_ptr<OpenCL_Network<net_t>>> m_networks;
+    std::array<std::shared_ptr<NetworkSet>, NUM_NETS> m_networks; // lock protected
     std::vector<std::unique_ptr<OpenCL<net_t>>> m_opencl;
 
     std::mutex m_mutex;
@@ -80,18 +130,28 @@ private:
     // set to true when single (non-batch) eval is in progress
     std::atomic<bool> m_single_eval_in_progress{false};
 
+    // evals of both nets, oldest first.  m_queued counts them per net : lock protected
     std::list<std::shared_ptr<ForwardQueueEntry>> m_forward_queue;
+    std::array<size_t, NUM_NETS> m_queued{};
+
+    // speculative evals, only used for filling underfull batches : lock protected
+    // (size is kept separately so that callers can check for room without locking)
+    std::list<std::unique_ptr<SpeculativeEntry>> m_speculative_queue;
+    std::atomic<size_t> m_speculative_queue_size{0};
     std::list<std::thread> m_worker_threads;
 
+    void run(std::shared_ptr<ForwardQueueEntry> entry);
     void batch_worker(const size_t gnum);
-    void push_input_convolution(unsigned int filter_size,
+    void push_input_convolution(const NetworkList& networks,
+                                unsigned int filter_size,
                                 unsigned int channels,
                                 unsigned int outputs,
                                 const std::vector<float>& weights,
                                 const std::vector<float>& means,
                                 const std::vector<float>& variances);
 
-    void push_residual(unsigned int filter_size,
+    void push_residual(const NetworkList& networks,
+                       unsigned int filter_size,
                        unsigned int channels,
                        unsigned int outputs,
                        const std::vector<float>& weights_1,
@@ -103,7 +163,8 @@ private:
                        const std::vector<float>& se_1,
                        const std::vector<float>& se_2);
 
-    void push_convolve(unsigned int filter_size,
+    void push_convolve(const NetworkList& networks,
+                       unsigned int filter_size,
                        unsigned int channels,
                        unsigned int outputs,
                        const std::vector<float>& conv_weights,
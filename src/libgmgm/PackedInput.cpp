@@ -0,0 +1,96 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <immintrin.h>
+
+#include "PackedInput.h"
+
+namespace PackedInput {
+
+// bits [16 * chunk, 16 * chunk + 16) of a position
+static inline unsigned chunk16(const std::uint64_t* packed, int chunk) {
+    return static_cast<unsigned>(packed[chunk / 4] >> (16 * (chunk % 4))) & 0xffff;
+}
+
+void pack(const float* in, std::uint64_t* packed) {
+    std::memset(packed, 0, sizeof(std::uint64_t) * WORDS);
+    for (auto i = 0; i < BITS; i++) {
+        if (in[i] > 0.5f) {
+            set(packed, i);
+        }
+    }
+}
+
+static void unpack_scalar(const std::uint64_t* packed, float* out) {
+    for (auto i = 0; i < BITS; i++) {
+        out[i] = static_cast<float>((packed[i / 64] >> (i % 64)) & 1);
+    }
+}
+
+// a set lane for every bit of the chunk : one masked move per 16 floats
+__attribute__((target("avx512f")))
+static void unpack_avx512(const std::uint64_t* packed, float* out) {
+    const auto ones = _mm512_set1_ps(1.0f);
+    constexpr auto full = BITS / 16;
+    for (auto c = 0; c < full; c++) {
+        const auto m = static_cast<__mmask16>(chunk16(packed, c));
+        _mm512_storeu_ps(out + 16 * c, _mm512_maskz_mov_ps(m, ones));
+    }
+    constexpr auto tail = BITS % 16;
+    if (tail != 0) {
+        const auto m = static_cast<__mmask16>(chunk16(packed, full));
+        _mm512_mask_storeu_ps(out + 16 * full, (1u << tail) - 1,
+                              _mm512_maskz_mov_ps(m, ones));
+    }
+}
+
+// each lane tests its own bit of the byte, and keeps 1.0f where it is set
+__attribute__((target("avx2")))
+static void unpack_avx2(const std::uint64_t* packed, float* out) {
+    const auto ones = _mm256_set1_ps(1.0f);
+    const auto lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    constexpr auto full = BITS / 8;
+    for (auto c = 0; c < full; c++) {
+        const auto byte = static_cast<int>((packed[c / 8] >> (8 * (c % 8))) & 0xff);
+        const auto set = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(byte), lanes), lanes);
+        _mm256_storeu_ps(out + 8 * c, _mm256_and_ps(_mm256_castsi256_ps(set), ones));
+    }
+    for (auto i = full * 8; i < BITS; i++) {
+        out[i] = static_cast<float>((packed[i / 64] >> (i % 64)) & 1);
+    }
+}
+
+void unpack(WinogradKernels::Isa isa, const std::uint64_t* packed, float* out, size_t count) {
+    for (auto n = size_t{0}; n < count; n++) {
+        const auto p = packed + n * WORDS;
+        const auto o = out + n * BITS;
+        switch (isa) {
+        case WinogradKernels::Isa::AVX512:
+            unpack_avx512(p, o);
+            break;
+        case WinogradKernels::Isa::AVX2:
+            unpack_avx2(p, o);
+            break;
+        default:
+            unpack_scalar(p, o);
+            break;
+        }
+    }
+}
+
+}
@@ -0,0 +1,48 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PACKEDINPUT_H_INCLUDED
+#define PACKEDINPUT_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Board.h"
+#include "WinogradKernels.h"
+
+// the input planes of a position as bits : every input feature is 0 or 1,
+// so a position fits in 744 bytes instead of 23760 bytes of floats.  this
+// is what evals get queued, batched and uploaded as, and the backends
+// expand it to floats (net_t for OpenCL) right before the first convolution.
+// bit i of a position, i being plane * 90 + y * 9 + x as in the float
+// planes, is bit i % 64 of word i / 64
+namespace PackedInput {
+    constexpr auto PLANES = 66;
+    constexpr auto BITS = PLANES * gmgm::BOARD_W * gmgm::BOARD_H;
+    constexpr auto WORDS = (BITS + 63) / 64;
+
+    inline void set(std::uint64_t* packed, int i) {
+        packed[i / 64] |= std::uint64_t{1} << (i % 64);
+    }
+
+    // in is BITS floats, each either 0 or 1
+    void pack(const float* in, std::uint64_t* packed);
+    // count positions, WORDS words each, into count * BITS floats
+    void unpack(WinogradKernels::Isa isa, const std::uint64_t* packed, float* out, size_t count);
+}
+
+#endif
@@ -17,9 +17,13 @@
 
 #include <cassert>
 #include <cmath>
+#include <cstring>
 
 #include "PositionEval.h"
 
+// xored into the hash of positions evaluated by the large net
+static constexpr std::uint64_t LARGE_NET_KEY = 0x9e3779b97f4a7c15ULL;
+
 gmgm::PositionEval::PositionEval() {
     for(auto & p : primary_cache) {
         p.reserve(gmgm::globals::cache_size*2);
@@ -77,17 +81,41 @@ gmgm::PositionOutputFeatures gmgm::PositionEval::extract_output_features(
 
 gmgm::PositionInputFeatures gmgm::PositionEval::extract_input_features(const gmgm::Board & b)
 {
-    constexpr int feature_map_size = 66;
+    return extract_input_features(b, b.get_legal_moves());
+}
+
+gmgm::PositionInputFeatures gmgm::PositionEval::extract_input_features(
+    const gmgm::Board & b,
+    const std::vector<gmgm::Move> & legal_moves)
+{
+    static_assert(sizeof(std::array<float, BOARD_W * BOARD_H>) == sizeof(float) * BOARD_W * BOARD_H,
+                  "feature planes have to be back to back");
     PositionInputFeatures ret;
-    ret.features.resize(feature_map_size);
-    for(auto & x : ret.features) {
-        for(auto & xx : x) {
-            xx = 0.0f;
-        }
-    }
+    ret.features.resize(INPUT_PLANES);
+    extract_input_features(b, legal_moves, ret.features[0].data());
+    return ret;
+}
+
+void gmgm::PositionEval::extract_input_features(
+    const gmgm::Board & b,
+    const std::vector<gmgm::Move> & legal_moves,
+    float * out)
+{
+    std::array<std::uint64_t, PackedInput::WORDS> packed;
+    extract_input_features(b, legal_moves, packed.data());
+    PackedInput::unpack(WinogradKernels::Isa::SCALAR, packed.data(), out, 1);
+}
+
+void gmgm::PositionEval::extract_input_features(
+    const gmgm::Board & b,
+    const std::vector<gmgm::Move> & legal_moves,
+    std::uint64_t * packed)
+{
+    constexpr int plane_size = BOARD_W * BOARD_H;
+    std::memset(packed, 0, sizeof(std::uint64_t) * PackedInput::WORDS);
 
     bool han_to_move = b.to_move == Side::HAN;
-    for(int yx = 0; yx < BOARD_W * BOARD_H; yx++) {
+    for(int yx = 0; yx < plane_size; yx++) {
         auto p = b.board[(yx / BOARD_W) * 10 + (yx % BOARD_W)];
         if(han_to_move) {
             if(p < 0x10) {
@@ -97,17 +125,16 @@ gmgm::PositionInputFeatures gmgm::PositionEval::extract_input_features(const gmg
             }
         }
         if(p < 0x20) {
-            ret.features[p][yx] = 1.0f;
+            PackedInput::set(packed, p * plane_size + yx);
         }
     }
-    const auto & legal_moves = b.get_legal_moves();
     for(auto & m : legal_moves) {
         int y2 = m.yx_to / 10;
         int x2 = m.yx_to % 10;
         int p = b.board[m.yx_from];
         assert(p < 0x20);
         p = p % 16;
-        ret.features[0x20 + p][y2 * BOARD_W + x2] = 1.0f;
+        PackedInput::set(packed, (0x20 + p) * plane_size + y2 * BOARD_W + x2);
     }
 
     const auto & legal_moves_opp = b.get_legal_moves_if_opponent();
@@ -117,45 +144,88 @@ gmgm::PositionInputFeatures gmgm::PositionEval::extract_input_features(const gmg
         int p = b.board[m.yx_from];
         assert(p < 0x20);
         p = p % 16;
-        ret.features[0x30 + p][y2 * BOARD_W + x2] = 1.0f;
+        PackedInput::set(packed, (0x30 + p) * plane_size + y2 * BOARD_W + x2);
     }
 
-    if (han_to_move) {
-        std::fill(begin(ret.features[65]), end(ret.features[65]), 1.0f);
-    } else {
-        std::fill(begin(ret.features[64]), end(ret.features[64]), 1.0f);
+    const auto side_plane = (han_to_move ? 65 : 64) * plane_size;
+    for(int yx = 0; yx < plane_size; yx++) {
+        PackedInput::set(packed, side_plane + yx);
     }
-    return ret;
 }
 
-const std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::evaluate(Board & b) {
+bool gmgm::PositionEval::has_current(std::uint64_t h, std::uint32_t id) {
+    auto pos = h%16;
+    auto iter1 = primary_cache[pos].find(h);
+    auto iter2 = secondary_cache[pos].find(h);
+    return (iter1 != primary_cache[pos].end() && iter1->second->net_id == id)
+        || (iter2 != secondary_cache[pos].end() && iter2->second->net_id == id);
+}
+
+std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::find_current(std::uint64_t h, std::uint32_t id) {
+    auto pos = h%16;
+    auto iter1 = primary_cache[pos].find(h);
+    if(iter1 != primary_cache[pos].end() && iter1->second->net_id == id) {
+        assert(iter1->second != nullptr);
+        return iter1->second;
+    }
+    auto iter2 = secondary_cache[pos].find(h);
+    if(iter2 != secondary_cache[pos].end() && iter2->second->net_id == id) {
+        // used again, so promote it
+        auto ret = std::move(iter2->second);
+        secondary_cache[pos].erase(iter2);
+        primary_cache[pos][h] = ret;
+        assert(ret != nullptr);
+        return ret;
+    }
+    return nullptr;
+}
+
+bool gmgm::PositionEval::use_large_net(int depth, int parent_visits) {
+    if(!has_large_net()) {
+        return false;
+    }
+    if(depth < static_cast<int>(gmgm::globals::large_net_depth)) {
+        return true;
+    }
+    return gmgm::globals::large_net_visits > 0
+        && parent_visits >= static_cast<int>(gmgm::globals::large_net_visits);
+}
+
+const std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::evaluate(Board & b, bool large) {
 #if 0
     return evaluate_raw(b);
 #else
+    // large net results live under their own keys.  a clash with a main net
+    // key is just another hash collision, caught by the legal move check below
     auto h = b.get_hash();
+    if(large) {
+        h ^= LARGE_NET_KEY;
+    }
     auto pos = h%16;
+    auto id = current_net_id.load();
+    auto eval_raw = [this, &b, large]() {
+        return large ? evaluate_raw_large(b) : evaluate_raw(b);
+    };
+
+    // generate the legal moves once here; evaluate_raw() and the validation
+    // below both use the board's cached list
+    const auto & lm = b.get_legal_moves();
     std::shared_ptr<gmgm::EvalResult> ret;
     bool found_result = false;
 
     {
         std::unique_lock<std::mutex> lk(mutex[pos]);
-        auto iter1 = primary_cache[pos].find(h);
-        auto iter2 = secondary_cache[pos].find(h);
-        if(iter1 != primary_cache[pos].end()) {
-            ret = iter1->second;
-            assert(ret != nullptr);
-            found_result = true;
-        } else if(iter2 != secondary_cache[pos].end()) {
-            primary_cache[pos][h] = std::move(iter2->second);
-            secondary_cache[pos].erase(iter2);
-            ret = primary_cache[pos][h];
-            assert(ret != nullptr);
-            found_result = true;
+        ret = find_current(h, id);
+        found_result = ret != nullptr;
+        if(found_result && ret->prefetched) {
+            ret->prefetched = false;
+            prefetch_hits++;
         }
     }
 
     if(!found_result) {
-        ret = evaluate_raw(b);
+        ret = eval_raw();
+        ret->net_id = id;
         {
             std::unique_lock<std::mutex> lk(mutex[pos]);
             primary_cache[pos][h] = ret;
@@ -167,14 +237,14 @@ const std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::evaluate(Board & b)
         }
         assert(ret != nullptr);
     } else {
-        auto lm = b.get_legal_moves();
         // validate if legal move matches
         for(auto i=size_t{0}; i<lm.size(); i++) {
             if(ret->policy[i].first != lm[i]) {
 		// I don't know if we will ever touch this code, though.
 		// Happens on hash collision - that is, two states with a same hash value
                 std::cerr << "PositionEval collision" << std::endl;
-                ret = evaluate_raw(b);
+                ret = eval_raw();
+                ret->net_id = id;
                 std::unique_lock<std::mutex> lk(mutex[pos]);
                 primary_cache[pos][h] = ret;
                 return ret;
@@ -187,10 +257,50 @@ const std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::evaluate(Board & b)
 #endif
 }
 
+void gmgm::PositionEval::prefetch(Board & b, const std::vector<Move> & moves) {
+    for(const auto & m : moves) {
+        if(!can_evaluate_speculative()) {
+            return;
+        }
+
+        b.move(m);
+        auto h = b.get_hash();
+        auto pos = h%16;
+        auto id = current_net_id.load();
+        bool wanted = false;
+        if(b.winner() == Side::NONE) {
+            std::unique_lock<std::mutex> lk(mutex[pos]);
+            wanted = !has_current(h, id)
+                && prefetch_pending[pos].insert(h).second;
+        }
+
+        if(wanted) {
+            auto queued = evaluate_speculative(b, [this, h, pos, id](std::shared_ptr<EvalResult> ret) {
+                std::unique_lock<std::mutex> lk(mutex[pos]);
+                prefetch_pending[pos].erase(h);
+                prefetch_done++;
+                // low priority : this gets dropped on the next cache rotation unless somebody uses it
+                if(!has_current(h, id)) {
+                    ret->prefetched = true;
+                    ret->net_id = id;
+                    secondary_cache[pos][h] = ret;
+                }
+            });
+            if(queued) {
+                prefetch_queued++;
+            } else {
+                std::unique_lock<std::mutex> lk(mutex[pos]);
+                prefetch_pending[pos].erase(h);
+            }
+        }
+        b.unmove();
+    }
+}
+
 std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::evaluate_raw(Board & b) {
     auto sptr = std::make_shared<gmgm::EvalResult>();
     auto & policy = sptr->policy;
-    auto moves = b.get_legal_moves();
+    const auto & moves = b.get_legal_moves();
     policy.reserve(moves.size());
     float attack_delta = 0.0f;
     for(auto m : moves) {
@@ -223,7 +333,7 @@ std::shared_ptr<gmgm::EvalResult> gmgm::PositionEval::evaluate_raw(Board & b) {
             }
         }
     }
-    auto move_opponent = b.get_legal_moves_if_opponent();
+    const auto & move_opponent = b.get_legal_moves_if_opponent();
     for(auto m : move_opponent) {
         if(m.captured != 0x20 && m.yx_from != m.yx_to) {
             switch(m.captured % 16) {
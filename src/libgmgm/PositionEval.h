@@ -19,10 +19,14 @@
 #define __GMGM_POSITION_EVAL_HH__
 
 #include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <mutex>
 
 #include "Board.h"
+#include "PackedInput.h"
 #include "Search.h"
 
 namespace std {
@@ -45,6 +49,12 @@ public:
 
     /// likelihood of winning; -1 = opponent wins, 1 == player wins
     float value = 0.0f;
+
+    /// true if this came from a speculative prefetch and wasn't used yet
+    bool prefetched = false;
+
+    /// PositionEval::current_net_id at the time the eval started
+    std::uint32_t net_id = 0;
 };
 
 class PositionEval;
@@ -73,14 +83,58 @@ private:
     std::array<std::mutex,16> mutex;
     std::array<std::unordered_map<std::uint64_t, std::shared_ptr<EvalResult>>,16> primary_cache;
     std::array<std::unordered_map<std::uint64_t, std::shared_ptr<EvalResult>>,16> secondary_cache;
+    std::array<std::unordered_set<std::uint64_t>,16> prefetch_pending;
+
+    // cache lookups that skip entries of other nets than id.  need mutex[h%16].
+    // find_current() moves secondary cache hits to the primary cache
+    bool has_current(std::uint64_t h, std::uint32_t id);
+    std::shared_ptr<EvalResult> find_current(std::uint64_t h, std::uint32_t id);
+protected:
+    // bumped when the evaluator switches to another net.  cache entries
+    // from older nets are treated as misses, and get replaced
+    std::atomic<std::uint32_t> current_net_id{0};
+
+    // speculative evals.  'done' gets called from some other thread once the result is ready,
+    // and nobody waits for it.  evaluate_speculative() returns false if the eval was not queued
+    virtual bool can_evaluate_speculative() { return false; }
+    virtual bool evaluate_speculative(Board &, std::function<void(std::shared_ptr<EvalResult>)>) { return false; }
+
+    // two net cascade : evaluators may carry a second, larger net for the
+    // positions near the search root, see use_large_net()
+    virtual bool has_large_net() { return false; }
+    virtual std::shared_ptr<EvalResult> evaluate_raw_large(Board & b) { return evaluate_raw(b); }
 public:
+    // number of prefetches queued, finished, and later hit on the cache
+    std::atomic<size_t> prefetch_queued{0};
+    std::atomic<size_t> prefetch_done{0};
+    std::atomic<size_t> prefetch_hits{0};
+
     PositionEval();
     virtual ~PositionEval() {}
     PositionInputFeatures extract_input_features(const Board & b);
+    // same as above, using a legal move list the caller already has
+    PositionInputFeatures extract_input_features(const Board & b, const std::vector<Move> & legal_moves);
+    // same again, written straight to out as INPUT_PLANES planes of
+    // BOARD_W * BOARD_H floats, [plane][y][x].  out is cleared first
+    static constexpr int INPUT_PLANES = PackedInput::PLANES;
+    static void extract_input_features(const Board & b, const std::vector<Move> & legal_moves, float * out);
+    // same again, as PackedInput::WORDS words of bits
+    static void extract_input_features(const Board & b, const std::vector<Move> & legal_moves, std::uint64_t * packed);
     PositionOutputFeatures extract_output_features(const Board & b, const std::vector<SearchResult> & result, Side final_winner, int final_movenum);
     PositionOutputFeatures extract_output_features(const Board & b, const Move & m, Side final_winner, int final_movenum);
 
-    const std::shared_ptr<gmgm::EvalResult> evaluate(Board & b);
+    // large picks the large net of the cascade.  its results are cached
+    // apart from the main net's, so the same position can have both
+    const std::shared_ptr<gmgm::EvalResult> evaluate(Board & b, bool large = false);
+
+    // whether a position depth plies below the search root, expanded when
+    // its parent had parent_visits visits, goes to the large net.  see
+    // globals::large_net_depth and large_net_visits
+    bool use_large_net(int depth, int parent_visits);
+
+    // queue speculative evals of the positions after each of the given moves, if the
+    // evaluator has idle capacity.  results go to the low-priority (secondary) cache
+    void prefetch(Board & b, const std::vector<Move> & moves);
     virtual std::shared_ptr<gmgm::EvalResult> evaluate_raw(Board & b);
     virtual std::shared_ptr<RawResult> evaluate_raw(const std::vector<float> & v);
 
@@ -0,0 +1,141 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <tuple>
+#include <vector>
+#include <boost/format.hpp>
+
+#include "Profiler.h"
+
+namespace Profiler {
+
+std::atomic<bool> g_enabled{false};
+
+namespace {
+    // kind, backend, net, name, index
+    using Key = std::tuple<int, std::string, std::string, std::string, int>;
+    class Entry {
+    public:
+        size_t calls{0};
+        double seconds{0.0};
+        double bytes{0.0};
+        double flops{0.0};
+    };
+
+    std::mutex s_mutex;
+    std::map<Key, Entry> s_entries;
+
+    const char * name(Kind kind) {
+        return kind == Kind::LAYER ? "layer" : "kernel";
+    }
+
+    std::string label(const Key & key) {
+        const auto index = std::get<4>(key);
+        if (index < 0) {
+            return std::get<3>(key);
+        }
+        return std::get<3>(key) + "[" + std::to_string(index) + "]";
+    }
+}
+
+void set_enabled(bool on) {
+    g_enabled = on;
+}
+
+void reset() {
+    std::unique_lock<std::mutex> lk(s_mutex);
+    s_entries.clear();
+}
+
+void add(Kind kind, const char * backend, const char * net, const char * name,
+         int index, double seconds, double bytes, double flops) {
+    std::unique_lock<std::mutex> lk(s_mutex);
+    auto & entry = s_entries[Key{static_cast<int>(kind), backend, net, name, index}];
+    entry.calls++;
+    entry.seconds += seconds;
+    entry.bytes += bytes;
+    entry.flops += flops;
+}
+
+std::string report() {
+    std::unique_lock<std::mutex> lk(s_mutex);
+    std::ostringstream oss;
+
+    // one table per (kind, backend, net), which the map order keeps together
+    auto it = begin(s_entries);
+    while (it != end(s_entries)) {
+        const auto kind = std::get<0>(it->first);
+        const auto backend = std::get<1>(it->first);
+        const auto net = std::get<2>(it->first);
+        std::vector<decltype(it)> rows;
+        auto total = 0.0;
+        for (; it != end(s_entries) && std::get<0>(it->first) == kind
+               && std::get<1>(it->first) == backend && std::get<2>(it->first) == net; ++it) {
+            rows.push_back(it);
+            total += it->second.seconds;
+        }
+        std::sort(begin(rows), end(rows), [](const auto & a, const auto & b) {
+            return a->second.seconds > b->second.seconds;
+        });
+
+        oss << boost::format("%s %s net %ss, %.1f ms total\n")
+               % backend % net % name(static_cast<Kind>(kind)) % (total * 1000.0);
+        oss << boost::format("  %-16s %8s %10s %6s %9s %8s %8s\n")
+               % "name" % "calls" % "ms" % "share" % "us/call" % "GB/s" % "GFLOP/s";
+        for (const auto & row : rows) {
+            const auto & e = row->second;
+            const auto per_second = [&e](double x) {
+                return (x > 0.0 && e.seconds > 0.0)
+                    ? boost::str(boost::format("%.1f") % (x / e.seconds * 1e-9)) : std::string("-");
+            };
+            oss << boost::format("  %-16s %8d %10.2f %5.1f%% %9.1f %8s %8s\n")
+                   % label(row->first) % e.calls % (e.seconds * 1000.0)
+                   % (total > 0.0 ? 100.0 * e.seconds / total : 0.0)
+                   % (e.seconds * 1e6 / e.calls)
+                   % per_second(e.bytes) % per_second(e.flops);
+        }
+    }
+    if (s_entries.empty()) {
+        oss << "No samples.\n";
+    }
+    return oss.str();
+}
+
+std::string dump() {
+    std::unique_lock<std::mutex> lk(s_mutex);
+    std::ostringstream oss;
+    oss << "kind\tbackend\tnet\tname\tindex\tcalls\tseconds\tbytes\tflops\n";
+    for (const auto & x : s_entries) {
+        const auto & e = x.second;
+        oss << name(static_cast<Kind>(std::get<0>(x.first))) << '\t'
+            << std::get<1>(x.first) << '\t'
+            << std::get<2>(x.first) << '\t'
+            << std::get<3>(x.first) << '\t'
+            << std::get<4>(x.first) << '\t'
+            << e.calls << '\t'
+            << boost::format("%.9f") % e.seconds << '\t'
+            << boost::format("%.0f") % e.bytes << '\t'
+            << boost::format("%.0f") % e.flops << '\n';
+    }
+    return oss.str();
+}
+
+}
@@ -0,0 +1,107 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROFILER_H_INCLUDED
+#define PROFILER_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// per-layer and per-kernel timing of the forward passes.  off by default.
+// while enabled, the pipes add one sample per layer and per kernel they run,
+// with the bytes moved and flops done, if known.  samples of concurrent
+// forward passes add up, so the totals are busy time rather than wall time
+namespace Profiler {
+    enum class Kind {
+        LAYER,
+        KERNEL
+    };
+
+    extern std::atomic<bool> g_enabled;
+    inline bool enabled() {
+        return g_enabled.load(std::memory_order_relaxed);
+    }
+    void set_enabled(bool on);
+    void reset();
+
+    // net tells apart the pipes of one backend, see net_name().  index
+    // tells apart the blocks of the residual tower, -1 for the rest.
+    // bytes and flops are 0 if unknown.  convolution layers count the flops
+    // of a direct convolution, so that winograd gains show up as GFLOP/s,
+    // while kernels count the flops they actually do
+    void add(Kind kind, const char * backend, const char * net, const char * name,
+             int index, double seconds, double bytes, double flops);
+
+    // the net of a ForwardPipe::push_net_weights() index, "main" or "large".
+    // the OpenCL self-check pipe reports as "selfcheck"
+    inline const char * net_name(int net) {
+        return net == 0 ? "main" : "large";
+    }
+
+    // a table per backend, net and kind, slowest first
+    std::string report();
+    // tab separated, a header line then one line per layer or kernel :
+    // kind backend net name index calls seconds bytes flops
+    std::string dump();
+
+    // adds the time until it goes out of scope (or stop()), if profiling
+    // was enabled when it was created
+    class Timer {
+    public:
+        Timer(Kind kind, const char * backend, const char * net, const char * name,
+              int index = -1, double bytes = 0.0, double flops = 0.0)
+            : m_on(enabled()), m_kind(kind), m_backend(backend), m_net(net), m_name(name),
+              m_index(index), m_bytes(bytes), m_flops(flops) {
+            if (m_on) {
+                m_start = std::chrono::steady_clock::now();
+            }
+        }
+        ~Timer() {
+            stop();
+        }
+        // adds the time now rather than at the end of the scope
+        void stop() {
+            if (m_on) {
+                const auto elapsed = std::chrono::steady_clock::now() - m_start;
+                add(m_kind, m_backend, m_net, m_name, m_index,
+                    std::chrono::duration<double>(elapsed).count(), m_bytes, m_flops);
+                m_on = false;
+            }
+        }
+        // for costs that are only known once the work is done
+        void set_cost(double bytes, double flops) {
+            m_bytes = bytes;
+            m_flops = flops;
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    private:
+        bool m_on;
+        Kind m_kind;
+        const char * m_backend;
+        const char * m_net;
+        const char * m_name;
+        int m_index;
+        double m_bytes;
+        double m_flops;
+        std::chrono::steady_clock::time_point m_start;
+    };
+}
+
+#endif
@@ -15,6 +15,8 @@
     along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+
 #include "PositionEval.h"
 #include "Search.h"
 
@@ -73,9 +75,97 @@ std::vector<gmgm::SearchResult> gmgm::Search::analyze(SearchNode & root)
     return ret;
 }
 
+void gmgm::Search::enter_tree()
+{
+    while(true) {
+        while(prune_pending.load()) {
+            std::this_thread::yield();
+        }
+        active_walkers++;
+        if(!prune_pending.load()) {
+            return;
+        }
+        active_walkers--;
+    }
+}
+
+void gmgm::Search::leave_tree()
+{
+    active_walkers--;
+}
+
+bool gmgm::Search::prune_tree(SearchNode & root)
+{
+    // prune down to 3/4 of the budget so that we don't end up pruning on every visit
+    const auto target_bytes = static_cast<size_t>(max_tree_mb) * 1024 * 1024 / 4 * 3;
+
+    prune_pending = true;
+    while(active_walkers.load() > 0) {
+        std::this_thread::yield();
+    }
+
+    // collect every expanded node that is at least two plies deep.
+    // the root and its immediate children are never pruned, so that
+    // the move candidates and their statistics always stay intact.
+    std::vector<std::pair<int, SearchNode*>> candidates;
+    std::vector<std::pair<int, SearchNode*>> stack;
+    stack.emplace_back(0, &root);
+    while(!stack.empty()) {
+        auto depth = stack.back().first;
+        auto node = stack.back().second;
+        stack.pop_back();
+        if(depth >= 2 && !node->children.empty()) {
+            candidates.emplace_back(node->accum_visits.load(), node);
+        }
+        for(auto & x : node->children) {
+            if(x.get_child() != nullptr) {
+                stack.emplace_back(depth + 1, x.get_child());
+            }
+        }
+    }
+
+    // a parent always has more visits than any of its children, so sorting on
+    // visits means that descendants get pruned (and hence freed) before their
+    // ancestors, and we never touch a node after it is freed.
+    std::sort(begin(candidates), end(candidates),
+        [](const auto & x, const auto & y) {
+            return x.first < y.first;
+        }
+    );
+
+    auto pruned = size_t{0};
+    for(auto & x : candidates) {
+        if(SearchNode::get_tree_bytes() <= target_bytes) {
+            break;
+        }
+        x.second->prune();
+        pruned++;
+    }
+
+    // the root, its children and whatever other trees the process holds are
+    // out of reach.  if those alone are too big, another walk won't help
+    const auto tree_mb = SearchNode::get_tree_bytes() / 1024 / 1024;
+    const auto done = SearchNode::get_tree_bytes() <= target_bytes;
+    if(done) {
+        gmgm::globals::myprintf("Pruned %lu subtrees, tree size %lu MB\n", pruned, tree_mb);
+    } else {
+        gmgm::globals::myprintf("Pruned %lu subtrees, tree size %lu MB is still above the target, "
+            "not pruning again in this search\n", pruned, tree_mb);
+    }
+
+    prune_pending = false;
+    return done;
+}
+
 std::vector<gmgm::SearchResult> gmgm::Search::search(Board &b, PositionEval * eval, int visits, int ms)
 {
     std::unique_ptr<SearchNode> root;
+    // tree reuse may cost evals of its own, which count against ms, too
+    auto start = std::chrono::system_clock::now();
+    // the prefetch counters run for the life of the eval, report this search only
+    const auto prefetch_queued = eval->prefetch_queued.load();
+    const auto prefetch_done = eval->prefetch_done.load();
+    const auto prefetch_hits = eval->prefetch_hits.load();
 
     // see if we can create root from rootcache.  This means we have to compare the cache board
     // and this board
@@ -110,6 +200,26 @@ std::vector<gmgm::SearchResult> gmgm::Search::search(Board &b, PositionEval * ev
 
     if (root == nullptr) {
         root = std::make_unique<SearchNode>();
+    } else {
+        // the reused nodes near the new root were mostly expanded deeper
+        // down, by the main net.  bring them up to the cascade rule.  the evals
+        // go through num_threads threads first, so that the scheduler can batch
+        // them, and the serial pass below finds them in the cache
+        std::vector<Board> boards;
+        root->large_reevaluations(*eval, b, boards);
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> eval_threads;
+        for(auto i = size_t{0}; i < std::min(boards.size(), size_t{num_threads}); i++) {
+            eval_threads.emplace_back([&boards, &next, eval]() {
+                for(auto k = next++; k < boards.size(); k = next++) {
+                    eval->evaluate(boards[k], true);
+                }
+            });
+        }
+        for(auto & x : eval_threads) {
+            x.join();
+        }
+        root->reevaluate_large(*eval, b);
     }
     
     std::vector<std::thread> threads;
@@ -120,11 +230,18 @@ std::vector<gmgm::SearchResult> gmgm::Search::search(Board &b, PositionEval * ev
     }
 #endif
 
-    auto start = std::chrono::system_clock::now();
     auto next_print_time = start + std::chrono::milliseconds(2500);
+    const auto max_tree_bytes = static_cast<size_t>(max_tree_mb) * 1024 * 1024;
+    auto pruning = max_tree_bytes > 0;
     Board b2 = b;
     do {
+        if(pruning && SearchNode::get_tree_bytes() > max_tree_bytes) {
+            pruning = prune_tree(*root);
+        }
+
+        enter_tree();
         root->expand(*eval, b2);
+        leave_tree();
         runcount++;
 
         auto now = std::chrono::system_clock::now();
@@ -144,7 +261,9 @@ std::vector<gmgm::SearchResult> gmgm::Search::search(Board &b, PositionEval * ev
             auto work_thread = [this, start, visits, ms, &runcount, &b, eval, &root] () {
                 Board b2 = b;
                 while(runcount.load() < static_cast<size_t>(visits)) {
+                    enter_tree();
                     root->expand(*eval, b2);
+                    leave_tree();
                     runcount++;
     
                     auto now = std::chrono::system_clock::now();
@@ -162,6 +281,14 @@ std::vector<gmgm::SearchResult> gmgm::Search::search(Board &b, PositionEval * ev
         x.join();
     }
     
+    auto queued = eval->prefetch_queued.load() - prefetch_queued;
+    if(queued > 0) {
+        auto done = eval->prefetch_done.load() - prefetch_done;
+        auto hits = eval->prefetch_hits.load() - prefetch_hits;
+        gmgm::globals::myprintf("Prefetch : %lu queued, %lu done, %lu hits (%.1f%%)\n",
+            queued, done, hits, done > 0 ? 100.0 * hits / done : 0.0);
+    }
+
     boardcache = b;
     auto ret = analyze(*root);
     rootcache = std::move(root);
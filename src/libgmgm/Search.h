@@ -52,11 +52,25 @@ class Search {
 
     std::unique_ptr<SearchNode> rootcache;
     Board boardcache{StartingState::SMSM, StartingState::SMSM};
+
+    // tree pruning has to happen while nobody is walking the tree.
+    // search threads stay out while prune_pending is set, and the pruning
+    // thread waits until active_walkers drops to zero.
+    std::atomic<bool> prune_pending{false};
+    std::atomic<int> active_walkers{0};
 private:
     std::vector<SearchResult> analyze(SearchNode & root);
+    void enter_tree();
+    void leave_tree();
+    // returns false if the tree stayed above the target, so that the
+    // search stops pruning instead of walking the tree on every visit
+    bool prune_tree(SearchNode & root);
 public:
     unsigned int num_threads = 1;
     unsigned int print_period = 0;
+    // maximum tree size in megabytes, 0 is unlimited.  the size is counted
+    // over every SearchNode of the process, not just the tree of this Search
+    unsigned int max_tree_mb = 0;
     Search();
     ~Search();
     std::vector<SearchResult> search(Board & b, PositionEval * eval, int visits, int ms);
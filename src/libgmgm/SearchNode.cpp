@@ -17,11 +17,14 @@
 
 #include <cassert>
 #include <cmath>
+#include <algorithm>
 
 #include "SearchNode.h"
 #include "PositionEval.h"
 #include "Board.h"
 
+std::atomic<size_t> gmgm::SearchNode::tree_bytes{0};
+
 std::string gmgm::SearchNode::print_best_path()
 {
     std::string ret = "";
@@ -49,39 +52,193 @@ std::string gmgm::SearchNode::print_best_path()
     return ret;
 }
 
-void gmgm::SearchNode::create_children(std::shared_ptr<EvalResult> eval_result, Board & board)
+void gmgm::SearchNode::prune()
+{
+    assert(vloss == 0);
+    tree_bytes -= children.capacity() * sizeof(SearchCandidate);
+    std::vector<SearchCandidate>().swap(children);
+    state.store(0);
+}
+
+float gmgm::SearchNode::node_value(const EvalResult & eval_result, Board & board)
 {
-    accum_visits++;
-    accum_value = board.get_to_move() == Side::CHO ? (-eval_result->value) : eval_result->value;
+    float value = board.get_to_move() == Side::CHO ? (-eval_result.value) : eval_result.value;
 
     // net output is -1 ~ 1
     // we need 0 ~ 1 if we want to apply virtual loss
-    accum_value = (accum_value + 1.0f) * 0.5f;
+    value = (value + 1.0f) * 0.5f;
 
     // we have no short-term rewards.  Create some by putting score on bias
     float score_based_bias = board.score_han() - board.score_cho();
-    accum_value = accum_value * (1.0f - gmgm::globals::score_based_bias_rate);
-    accum_value = accum_value + gmgm::globals::score_based_bias_rate * 0.5f *
+    value = value * (1.0f - gmgm::globals::score_based_bias_rate);
+    value = value + gmgm::globals::score_based_bias_rate * 0.5f *
         (1.0f + std::tanh(score_based_bias / 14.4f));
+    return value;
+}
 
-    children.reserve(eval_result->policy.size());
+std::vector<std::pair<gmgm::Move, float>> gmgm::SearchNode::sorted_priors(const EvalResult & eval_result)
+{
     float total_policy = 0.0f;
-    for(auto & x : eval_result->policy) {
+    for(auto & x : eval_result.policy) {
         total_policy += x.second;
-        total_policy += gmgm::globals::score_based_bias_rate / eval_result->policy.size();
+        total_policy += gmgm::globals::score_based_bias_rate / eval_result.policy.size();
     }
-    for(auto & x : eval_result->policy) {
+
+    // children are kept sorted by prior, highest first.  the selection loop in expand()
+    // relies on this to stop scanning early.  the cached eval result is shared
+    // (and its order is used for collision checks) so sort a copy
+    auto sorted_policy = eval_result.policy;
+    std::stable_sort(begin(sorted_policy), end(sorted_policy),
+        [](const auto & x, const auto & y) {
+            return x.second > y.second;
+        }
+    );
+    for(auto & x : sorted_policy) {
         float policy = x.second;
         if(policy < 0) policy = 0;
-        policy = policy + gmgm::globals::score_based_bias_rate / eval_result->policy.size();
-        policy = policy / total_policy;
-        children.emplace_back(x.first, policy);
+        policy = policy + gmgm::globals::score_based_bias_rate / eval_result.policy.size();
+        x.second = policy / total_policy;
+    }
+    return sorted_policy;
+}
+
+float gmgm::SearchNode::create_children(std::shared_ptr<EvalResult> eval_result, Board & board)
+{
+    float value = node_value(*eval_result, board);
+
+    // a pruned node gets re-expanded with its old statistics intact,
+    // so accumulate rather than overwrite
+    add_value(value);
+    eval_value = value;
+
+    children.reserve(eval_result->policy.size());
+    tree_bytes += children.capacity() * sizeof(SearchCandidate);
+    for(auto & x : sorted_priors(*eval_result)) {
+        children.emplace_back(x.first, x.second);
+    }
+    sorted_by_prior = true;
+    return value;
+}
+
+bool gmgm::SearchNode::created_prefix() const
+{
+    auto it = std::find_if(begin(children), end(children),
+        [](const auto & x) { return x.get_child() == nullptr; });
+    return std::none_of(it, end(children),
+        [](const auto & x) { return x.get_child() != nullptr; });
+}
+
+void gmgm::SearchNode::large_reevaluations(PositionEval & eval, Board & board,
+    std::vector<Board> & boards, int depth, int parent_visits)
+{
+    if(!is_expanded() || !eval.use_large_net(depth, parent_visits)) {
+        return;
+    }
+    if(!large_eval) {
+        boards.push_back(board);
+    }
+    for(auto & candidate : children) {
+        auto child = candidate.get_child();
+        if(child == nullptr) {
+            continue;
+        }
+        auto jang = child->jang.load();
+        if(jang < 0) {
+            board.move(candidate.move);
+        } else {
+            board.move(candidate.move, jang != 0);
+        }
+        child->large_reevaluations(eval, board, boards, depth + 1, accum_visits.load());
+        board.unmove();
+    }
+}
+
+float gmgm::SearchNode::reevaluate_large(PositionEval & eval, Board & board, int depth, int parent_visits)
+{
+    if(!is_expanded() || !eval.use_large_net(depth, parent_visits)) {
+        return 0.0f;
     }
+
+    // the children first : a child can only qualify if this node does, and
+    // their value changes are part of this node's statistics, too
+    auto delta = 0.0f;
+    for(auto & candidate : children) {
+        auto child = candidate.get_child();
+        if(child == nullptr) {
+            continue;
+        }
+        auto jang = child->jang.load();
+        if(jang < 0) {
+            board.move(candidate.move);
+        } else {
+            board.move(candidate.move, jang != 0);
+        }
+        delta += child->reevaluate_large(eval, board, depth + 1, accum_visits.load());
+        board.unmove();
+    }
+
+    if(!large_eval) {
+        auto ev = eval.evaluate(board, true);
+
+        // swap the main net eval for the large net one in the accumulated
+        // value, the visit count stays the same
+        auto value = node_value(*ev, board);
+        delta += value - eval_value;
+        eval_value = value;
+        large_eval = true;
+
+        // same moves, new priors and so a new order.  the selection loop in
+        // expand() relies on created children forming a prefix, so the created
+        // ones go first and the rest after them, each group by the new prior.
+        // children are not copyable, so reorder them in place
+        auto priors = sorted_priors(*ev);
+        assert(priors.size() == children.size());
+        auto i = size_t{0};
+        for(auto created : {true, false}) {
+            for(auto & x : priors) {
+                for(auto j = i; j < children.size(); j++) {
+                    if(children[j].move == x.first) {
+                        if((children[j].get_child() != nullptr) == created) {
+                            children[i].swap(children[j]);
+                            children[i].policy = x.second;
+                            i++;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+        assert(i == children.size());
+
+        // the first uncreated child may now have a higher prior than the
+        // created ones before it
+        sorted_by_prior = std::is_sorted(begin(children), end(children),
+            [](const auto & x, const auto & y) {
+                return x.policy > y.policy;
+            }
+        );
+        assert(created_prefix());
+    }
+
+    while(true) {
+        float prev_v = accum_value.load();
+        if(accum_value.compare_exchange_weak(prev_v, prev_v + delta)) {
+            break;
+        }
+    }
+    return delta;
 }
 
-float gmgm::SearchNode::expand(PositionEval & eval, Board & board)
+float gmgm::SearchNode::expand(PositionEval & eval, Board & board, int depth, int parent_visits)
 {
-    auto winner = board.winner();
+    // the game result only depends on the path to this node, so check it
+    // once instead of on every visit
+    auto w = this->winner.load();
+    if(w < 0) {
+        w = static_cast<int8_t>(board.winner());
+        this->winner = w;
+    }
+    auto winner = static_cast<Side>(w);
     if(winner == Side::CHO) {
         add_value(0.0f);
         return 0.0f;
@@ -92,32 +249,62 @@ float gmgm::SearchNode::expand(PositionEval & eval, Board & board)
 
     
     std::shared_ptr<EvalResult> ev;
+    const auto large = eval.use_large_net(depth, parent_visits);
     
     if(!is_expanded()) {
         // pre-evaluate on the non-critical section
-        ev = eval.evaluate(board);
+        ev = eval.evaluate(board, large);
     }
 
     if(acquire_expand()) {
         if(ev->policy.empty()) {
-            ev = eval.evaluate(board);
+            ev = eval.evaluate(board, large);
         }
 
         assert(children.empty());
         vloss += VIRTUAL_LOSS;
-        create_children(ev, board);
-        float ret = accum_value;
+        float ret = create_children(ev, board);
+        large_eval = large;
         expand_done();
         vloss -= VIRTUAL_LOSS;
+
+        // the children with the highest priors are likely to be visited soon.
+        // give the evaluator a chance to work on them if it has nothing better to do.
+        // prefetches are main net only, so skip them if the children go to the large net
+        if(gmgm::globals::prefetch_children > 0
+            && !eval.use_large_net(depth + 1, accum_visits.load())) {
+            std::vector<Move> moves;
+            for(auto & x : children) {
+                if(moves.size() >= gmgm::globals::prefetch_children) {
+                    break;
+                }
+                moves.push_back(x.move);
+            }
+            eval.prefetch(board, moves);
+        }
         return ret;
     } else {
         SearchCandidate * best = nullptr;
         float best_val = -9999.0f;
         vloss += VIRTUAL_LOSS;
         expanded_rlock();
+        const auto numerator = std::sqrt(double(accum_visits + vloss));
         for(auto & candidate : children) {
             auto child = candidate.get_child();
 
+            // no child can have a winrate above 1 or a puct denominator below 1,
+            // and children are sorted by prior.  once that bound can't beat the
+            // best so far, nothing from here on can either.  after a large net
+            // re-evaluation only the created prefix and the rest are sorted each,
+            // so skip to the first uncreated child instead, whose prior bounds
+            // everything after it
+            if(1.0f + 3.0f * candidate.policy * numerator <= best_val) {
+                if(sorted_by_prior || child == nullptr) {
+                    break;
+                }
+                continue;
+            }
+
             float _value = 
                 (child != nullptr && child->accum_visits != 0)
                 ? child->accum_value.load() : accum_value.load()
@@ -136,7 +323,6 @@ float gmgm::SearchNode::expand(PositionEval & eval, Board & board)
             }
             auto winrate = _value / (_visits + _vloss);
 
-            const auto numerator = std::sqrt(double(accum_visits + vloss));
             const auto denom = 1.0 + (child != nullptr ? (child->accum_visits.load() + child->vloss.load()) : 0);
             const auto puct = candidate.policy * (numerator / denom);
             const auto value = winrate + 3.0f * puct;
@@ -144,6 +330,14 @@ float gmgm::SearchNode::expand(PositionEval & eval, Board & board)
                 best = &candidate;
                 best_val = value;
             }
+
+            // unvisited children all share the same winrate and denominator, so among
+            // them the one with the highest prior wins.  since we only ever create the
+            // first one we see, created children form a prefix of the list and
+            // everything after the first empty slot is empty, too.
+            if(child == nullptr) {
+                break;
+            }
         }
 
         if(best == nullptr) {
@@ -153,11 +347,20 @@ float gmgm::SearchNode::expand(PositionEval & eval, Board & board)
         best->createChild();
 
         auto m = best->move;
+        auto child = best->get_child();
         expanded_runlock();
 
-        board.move(m);
+        // remember the jang status on the child so that revisits don't
+        // need to generate the opponent moves just to find out
+        auto jang = child->jang.load();
+        if(jang < 0) {
+            board.move(m);
+            child->jang = board.last_move_was_jang() ? 1 : 0;
+        } else {
+            board.move(m, jang != 0);
+        }
 
-        float ret = best->get_child()->expand(eval, board);
+        float ret = child->expand(eval, board, depth + 1, accum_visits.load());
         add_value(ret);
         board.unmove();
 
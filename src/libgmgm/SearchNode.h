@@ -25,6 +25,8 @@
 #include <condition_variable>
 #include <thread>
 #include <cassert>
+#include <utility>
+#include <vector>
 
 #include "Board.h"
 
@@ -55,6 +57,12 @@ public:
         return ret;
     }
     void createChild();
+    // exchange everything with o.  only while nobody else walks the parent
+    void swap(SearchCandidate & o) {
+        child.store(o.child.exchange(child.load()));
+        std::swap(move, o.move);
+        std::swap(policy, o.policy);
+    }
 };
 
 constexpr int VIRTUAL_LOSS = 3;
@@ -65,11 +73,67 @@ public:
     std::atomic<int> accum_visits{0};
     std::atomic<int> vloss{0};
     std::vector<SearchCandidate> children;
-    float expand(PositionEval & eval, Board & board);
+
+    // whether the move leading to this node was a jang.  -1 : not known yet
+    std::atomic<int8_t> jang{-1};
+
+    // board.winner() of this position, cast from Side.  -1 : not known yet
+    std::atomic<int8_t> winner{-1};
+
+    SearchNode() {
+        tree_bytes += sizeof(SearchNode);
+    }
+    ~SearchNode() {
+        tree_bytes -= sizeof(SearchNode) + children.capacity() * sizeof(SearchCandidate);
+    }
+
+    // depth is the distance from the search root, and parent_visits the
+    // visits of the parent when this node was picked.  both only decide
+    // which net of the cascade evaluates the node
+    float expand(PositionEval & eval, Board & board, int depth = 0, int parent_visits = 0);
+
+    // tree reuse keeps nodes that the main net evaluated further away from
+    // the old root.  evaluate the ones that now fall under the large net rule
+    // (see PositionEval::use_large_net) again with the large net, replacing
+    // their priors and their own value.  returns the change of accum_value,
+    // which the caller adds to the parent.  Nobody else should be walking the
+    // subtree while doing this.
+    float reevaluate_large(PositionEval & eval, Board & board, int depth = 0, int parent_visits = 0);
+    // the positions reevaluate_large() is going to evaluate, so that the
+    // caller can get them into the cache in parallel first
+    void large_reevaluations(PositionEval & eval, Board & board, std::vector<Board> & boards,
+                             int depth = 0, int parent_visits = 0);
+
+    // free everything below this node and turn it back to an unexpanded leaf.
+    // accumulated visits and values are kept, so the parent's edge statistics
+    // do not change.  Nobody else should be walking the subtree while doing this.
+    void prune();
+
+    // estimated memory used by all search trees, in bytes
+    static size_t get_tree_bytes() {
+        return tree_bytes.load();
+    }
 
     std::string print_best_path();
 private:
-    void create_children(std::shared_ptr<EvalResult> eval_result, Board & board);
+    static std::atomic<size_t> tree_bytes;
+
+    // the value this node's own eval added to accum_value, and whether
+    // it came from the large net
+    float eval_value{0.0f};
+    bool large_eval{false};
+    // whether children are in descending prior order.  reevaluate_large()
+    // keeps created children first, which may break it
+    bool sorted_by_prior{true};
+
+    // created children come first, uncreated ones after them
+    bool created_prefix() const;
+
+    float create_children(std::shared_ptr<EvalResult> eval_result, Board & board);
+    // eval_result->value as seen from this node, 0 ~ 1
+    static float node_value(const EvalResult & eval_result, Board & board);
+    // eval_result->policy normalized and sorted by prior, highest first
+    static std::vector<std::pair<Move, float>> sorted_priors(const EvalResult & eval_result);
 
     void add_value(float v) {
         accum_visits += 1;
@@ -0,0 +1,126 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    This source originated from Leela Zero (http://github.com/leela-zero/leela-zero
+    Copyright (C) 2017-2019 Gian-Carlo Pascutto and contributors
+*/
+
+#ifndef THREADPOOL_H_INCLUDED
+#define THREADPOOL_H_INCLUDED
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace gmgm {
+
+// a fixed set of threads that stay alive for the lifetime of the pool,
+// so that handing out work is a queue push rather than a thread creation
+class ThreadPool {
+public:
+    ThreadPool() = default;
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_condvar.notify_all();
+        for (auto & worker : m_threads) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void initialize(std::size_t threads) {
+        for (auto i = std::size_t{0}; i < threads; i++) {
+            m_threads.emplace_back([this] {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(m_mutex);
+                        m_condvar.wait(lock, [this]{ return m_exit || !m_tasks.empty(); });
+                        if (m_exit && m_tasks.empty()) {
+                            return;
+                        }
+                        task = std::move(m_tasks.front());
+                        m_tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    std::size_t size() const {
+        return m_threads.size();
+    }
+
+    template<class F>
+    std::future<void> add_task(F&& f) {
+        auto task = std::make_shared<std::packaged_task<void()>>(std::forward<F>(f));
+        auto res = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_tasks.emplace([task](){ (*task)(); });
+        }
+        m_condvar.notify_one();
+        return res;
+    }
+
+    // split [0, n) into (at most) one contiguous range per thread, including the
+    // calling thread, and run f(begin, end) on each.  returns when all ranges are done
+    template<class F>
+    void parallel_for(std::size_t n, F&& f) {
+        const auto splits = std::min(n, m_threads.size() + 1);
+        if (splits <= 1) {
+            f(std::size_t{0}, n);
+            return;
+        }
+
+        std::vector<std::future<void>> futures;
+        futures.reserve(splits - 1);
+        for (auto i = std::size_t{1}; i < splits; i++) {
+            const auto begin = n * i / splits;
+            const auto end = n * (i + 1) / splits;
+            futures.emplace_back(add_task([&f, begin, end]() { f(begin, end); }));
+        }
+        f(std::size_t{0}, n / splits);
+        for (auto & x : futures) {
+            x.get();
+        }
+    }
+
+private:
+    std::vector<std::thread> m_threads;
+    std::queue<std::function<void()>> m_tasks;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condvar;
+    bool m_exit{false};
+};
+
+}
+
+#endif
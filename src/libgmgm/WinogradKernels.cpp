@@ -0,0 +1,1051 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WINOGRAD_X86 1
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "WinogradKernels.h"
+#include "Network.h"
+#include "half/half.hpp"
+
+namespace WinogradKernels {
+
+// gcc vector extensions.  the kernels below are written once against a generic
+// vector type and get instantiated inside target("avx2") / target("avx512f")
+// functions, so each instantiation is compiled to that instruction set only.
+typedef float v8sf __attribute__((vector_size(32)));
+typedef float v16sf __attribute__((vector_size(64)));
+
+#define WINOGRAD_INLINE inline __attribute__((always_inline))
+
+// same arithmetic (and the same order of operations) as the multiply_bt
+// and multiply_at lambdas in CPUPipe.cpp
+template <typename V>
+WINOGRAD_INLINE void multiply_bt(
+    V & o0, V & o1, V & o2, V & o3, V & o4, V & o5,
+    V i0, V i1, V i2, V i3, V i4, V i5
+) {
+    auto i3m1 = i1 * -SQ2 + i3 * (SQ2 / 2.0f);
+    auto i4m2 = i2 * -2.0f + i4 * 1.0f;
+
+    o0 = i0 + i2 * (-5.0f/2.0f) + i4;
+    o1 = i3m1 + i4m2;
+    o2 = -i3m1 + i4m2;
+
+    auto i3m1_2 = i3 * (SQ2) + i1 * (-SQ2/2.0f);
+    auto i4m2_2 = i2 * (-1.0f/2.0f) + i4;
+
+    o3 = i3m1_2 + i4m2_2;
+    o4 = -i3m1_2 + i4m2_2;
+
+    o5 = i1 + i3 * (-5.0f/2.0f) + i5;
+}
+
+template <typename V>
+WINOGRAD_INLINE void multiply_at(
+    V & o0, V & o1, V & o2, V & o3,
+    V i0, V i1, V i2, V i3, V i4, V i5
+) {
+    auto t1p2 = (i1 + i2) * (1.0f / 2.0f);
+    auto t1m2 = (i1 - i2) * (SQ2/4.0f);
+    auto t3p4 = i3 + i4;
+    auto t3m4 = (i3 - i4) * (SQ2);
+
+    o0 = i0 + t1p2 + t1p2 + t3p4;
+    o1 = t1m2 + t1m2 + t3m4;
+    o2 = t1p2 + t3p4 + t3p4;
+    o3 = t1m2 + t3m4 + t3m4 + i5;
+}
+
+// lane j of a vector, or the float itself for the scalar instantiations
+template <typename V>
+WINOGRAD_INLINE float & lane(V & v, int j) {
+    return v[j];
+}
+template <typename V>
+WINOGRAD_INLINE float lane(const V & v, int j) {
+    return v[j];
+}
+WINOGRAD_INLINE float & lane(float & v, int) {
+    return v;
+}
+WINOGRAD_INLINE float lane(const float & v, int) {
+    return v;
+}
+
+// copies channels [ch, ch + cnt) of position n into the padded input, one
+// channel per lane.  blocked inputs hold exactly those lanes at every
+// intersection, so that is a single vector load each
+template <Layout L, typename V, size_t Hpad, size_t Wpad>
+WINOGRAD_INLINE void load_planes(std::array<std::array<V, Wpad>, Hpad> & in_pad,
+                                 const float* in, const int C, const int n,
+                                 const int ch, const int cnt) {
+    constexpr auto W = gmgm::BOARD_W;
+    constexpr auto H = gmgm::BOARD_H;
+    if (L == Layout::BLOCKED) {
+        const auto src = &in[n*C*(W*H) + ch*(W*H)];
+        for (auto yin = 0; yin < H; yin++) {
+            for (auto xin = 0; xin < W; xin++) {
+                std::memcpy(&in_pad[yin + 1][xin + 1], src + (yin*W + xin) * (sizeof(V) / sizeof(float)),
+                            sizeof(V));
+            }
+        }
+        return;
+    }
+    for (auto j = 0; j < cnt; j++) {
+        const auto src = &in[n*C*(W*H) + (ch + j)*(W*H)];
+        for (auto yin = 0; yin < H; yin++) {
+            for (auto xin = 0; xin < W; xin++) {
+                lane(in_pad[yin + 1][xin + 1], j) = src[yin*W + xin];
+            }
+        }
+    }
+}
+
+// writes channels [k, k + cnt) of position n from y_out, one channel per
+// lane, and applies the epilogue.  blocked outputs get the epilogue on
+// whole vectors
+template <Layout L, typename V>
+WINOGRAD_INLINE void store_planes(const std::array<V, NUM_INTERSECTIONS> & y_out,
+                                  float* Y, const int K, const int n,
+                                  const int k, const int cnt, const Epilogue& ep) {
+    constexpr auto lanes = static_cast<int>(sizeof(V) / sizeof(float));
+    if (L == Layout::BLOCKED) {
+        const auto offset = n*K*NUM_INTERSECTIONS + k*NUM_INTERSECTIONS;
+        V mean{}, scale_stddev{}, sum{};
+        const auto zero = V{};
+        if (ep.means != nullptr) {
+            std::memcpy(&mean, ep.means + k, sizeof(V));
+            std::memcpy(&scale_stddev, ep.stddevs + k, sizeof(V));
+        }
+        for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+            auto v = y_out[idx];
+            if (ep.means != nullptr) {
+                v = scale_stddev * (v - mean);
+            }
+            if (ep.residual != nullptr) {
+                V res;
+                std::memcpy(&res, ep.residual + offset + idx * lanes, sizeof(V));
+                v += res;
+            }
+            if (ep.relu) {
+                v = v > zero ? v : zero;
+            }
+            sum += v;
+            std::memcpy(Y + offset + idx * lanes, &v, sizeof(V));
+        }
+        if (ep.pool != nullptr) {
+            for (auto j = 0; j < lanes; j++) {
+                ep.pool[n * K + k + j] = lane(sum, j) / NUM_INTERSECTIONS;
+            }
+        }
+        return;
+    }
+    for (auto j = 0; j < cnt; j++) {
+        const auto dst = &Y[n*K*NUM_INTERSECTIONS + (k + j)*NUM_INTERSECTIONS];
+        for (auto idx = 0; idx < NUM_INTERSECTIONS; idx++) {
+            dst[idx] = lane(y_out[idx], j);
+        }
+        finish_plane<NUM_INTERSECTIONS>(ep, dst, n, k + j, K);
+    }
+}
+
+template <Layout L, typename V>
+WINOGRAD_INLINE void transform_in_impl(const float* in, float* V_out,
+                                       const int C, const int batch_size,
+                                       const int ch_begin, const int ch_end) {
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    constexpr auto P = WINOGRAD_P;
+    constexpr auto Wpad = 2 + WINOGRAD_M * WTILES;
+    constexpr auto lanes = static_cast<int>(sizeof(V) / sizeof(float));
+    const auto PB = P * batch_size;
+
+    // lane j holds channel ch + j
+    std::array<std::array<V, Wpad>, Wpad> in_pad;
+    for (auto & row : in_pad) {
+        for (auto & x : row) {
+            x = V{};
+        }
+    }
+    std::array<std::array<V, P>, WINOGRAD_TILE> out;
+
+    for (auto ch = ch_begin; ch < ch_end; ch += lanes) {
+        const auto cnt = std::min(lanes, ch_end - ch);
+        for (auto n = 0; n < batch_size; n++) {
+            load_planes<L>(in_pad, in, C, n, ch, cnt);
+
+            for (auto block_y = 0; block_y < WTILES; block_y++) {
+                const auto yin = WINOGRAD_M * block_y;
+                for (auto block_x = 0; block_x < WTILES; block_x++) {
+                    const auto xin = WINOGRAD_M * block_x;
+                    const auto b = block_y * WTILES + block_x;
+
+                    // Calculates transpose(B).x.B
+                    std::array<std::array<V, WINOGRAD_ALPHA>, WINOGRAD_ALPHA> T1;
+                    for (auto xx = 0; xx < WINOGRAD_ALPHA; xx++) {
+                        multiply_bt(
+                            T1[0][xx], T1[1][xx], T1[2][xx], T1[3][xx], T1[4][xx], T1[5][xx],
+                            in_pad[yin + 0][xin + xx],
+                            in_pad[yin + 1][xin + xx],
+                            in_pad[yin + 2][xin + xx],
+                            in_pad[yin + 3][xin + xx],
+                            in_pad[yin + 4][xin + xx],
+                            in_pad[yin + 5][xin + xx]
+                        );
+                    }
+                    for (auto xx = 0; xx < WINOGRAD_ALPHA; xx++) {
+                        multiply_bt(
+                            out[xx * WINOGRAD_ALPHA + 0][b],
+                            out[xx * WINOGRAD_ALPHA + 1][b],
+                            out[xx * WINOGRAD_ALPHA + 2][b],
+                            out[xx * WINOGRAD_ALPHA + 3][b],
+                            out[xx * WINOGRAD_ALPHA + 4][b],
+                            out[xx * WINOGRAD_ALPHA + 5][b],
+                            T1[xx][0], T1[xx][1], T1[xx][2], T1[xx][3], T1[xx][4], T1[xx][5]
+                        );
+                    }
+                }
+            }
+
+            // V is [tile element][channel][tile], so each lane goes out as
+            // P contiguous floats
+            for (auto i = 0; i < WINOGRAD_TILE; i++) {
+                for (auto j = 0; j < cnt; j++) {
+                    const auto dst = &V_out[i*C*PB + (ch + j)*PB + n*P];
+                    for (auto b = 0; b < P; b++) {
+                        dst[b] = out[i][b][j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <Layout L, typename V>
+WINOGRAD_INLINE void transform_out_impl(const float* M, float* Y,
+                                        const int K, const int batch_size,
+                                        const int k_begin, const int k_end,
+                                        const Epilogue& ep) {
+    constexpr auto W = gmgm::BOARD_W;
+    constexpr auto H = gmgm::BOARD_H;
+    constexpr auto WTILES = WINOGRAD_WTILES;
+    constexpr auto P = WINOGRAD_P;
+    constexpr auto lanes = static_cast<int>(sizeof(V) / sizeof(float));
+    const auto PB = P * batch_size;
+
+    // lane j holds output channel k + j
+    std::array<std::array<V, P>, WINOGRAD_TILE> temp_m;
+    std::array<V, NUM_INTERSECTIONS> y_out;
+
+    for (auto k = k_begin; k < k_end; k += lanes) {
+        const auto cnt = std::min(lanes, k_end - k);
+        for (auto n = 0; n < batch_size; n++) {
+            for (auto i = 0; i < WINOGRAD_TILE; i++) {
+                for (auto j = 0; j < cnt; j++) {
+                    const auto src = &M[i*K*PB + (k + j)*PB + n*P];
+                    for (auto b = 0; b < P; b++) {
+                        temp_m[i][b][j] = src[b];
+                    }
+                }
+            }
+
+            for (auto block_x = 0; block_x < WTILES; block_x++) {
+                const auto x = WINOGRAD_M * block_x;
+                for (auto block_y = 0; block_y < WTILES; block_y++) {
+                    const auto y = WINOGRAD_M * block_y;
+                    const auto b = block_y * WTILES + block_x;
+
+                    std::array<std::array<V, WINOGRAD_ALPHA>, WINOGRAD_M> temp;
+                    std::array<std::array<V, WINOGRAD_M>, WINOGRAD_M> o;
+
+                    // Calculates transpose(A).temp_m.A
+                    for (auto j = 0; j < WINOGRAD_ALPHA; j++) {
+                        multiply_at(
+                            temp[0][j], temp[1][j], temp[2][j], temp[3][j],
+                            temp_m[0 * WINOGRAD_ALPHA + j][b],
+                            temp_m[1 * WINOGRAD_ALPHA + j][b],
+                            temp_m[2 * WINOGRAD_ALPHA + j][b],
+                            temp_m[3 * WINOGRAD_ALPHA + j][b],
+                            temp_m[4 * WINOGRAD_ALPHA + j][b],
+                            temp_m[5 * WINOGRAD_ALPHA + j][b]
+                        );
+                    }
+                    for (auto i = 0; i < WINOGRAD_M; i++) {
+                        multiply_at(
+                            o[i][0], o[i][1], o[i][2], o[i][3],
+                            temp[i][0], temp[i][1], temp[i][2], temp[i][3], temp[i][4], temp[i][5]
+                        );
+                    }
+
+                    for (auto i = 0; i < WINOGRAD_M; i++) {
+                        for (auto j = 0; j < WINOGRAD_M; j++) {
+                            if (y + i < H && x + j < W) {
+                                y_out[(y + i) * W + x + j] = o[i][j];
+                            }
+                        }
+                    }
+                }
+            }
+
+            store_planes<L>(y_out, Y, K, n, k, cnt, ep);
+        }
+    }
+}
+
+template <Layout L>
+__attribute__((target("avx2,fma")))
+static void transform_in_avx2(const float* in, float* V,
+                              int C, int batch_size, int ch_begin, int ch_end) {
+    transform_in_impl<L, v8sf>(in, V, C, batch_size, ch_begin, ch_end);
+}
+
+template <Layout L>
+__attribute__((target("avx2,fma")))
+static void transform_out_avx2(const float* M, float* Y,
+                               int K, int batch_size, int k_begin, int k_end,
+                               const Epilogue& ep) {
+    transform_out_impl<L, v8sf>(M, Y, K, batch_size, k_begin, k_end, ep);
+}
+
+template <Layout L>
+__attribute__((target("avx512f")))
+static void transform_in_avx512(const float* in, float* V,
+                                int C, int batch_size, int ch_begin, int ch_end) {
+    transform_in_impl<L, v16sf>(in, V, C, batch_size, ch_begin, ch_end);
+}
+
+template <Layout L>
+__attribute__((target("avx512f")))
+static void transform_out_avx512(const float* M, float* Y,
+                                 int K, int batch_size, int k_begin, int k_end,
+                                 const Epilogue& ep) {
+    transform_out_impl<L, v16sf>(M, Y, K, batch_size, k_begin, k_end, ep);
+}
+
+// the other tilings.  these are built from 1D F(m, 3) transforms (Toom-Cook
+// on the points 0, 1, -1, ... and infinity) applied along each axis, so a
+// tile can be m_h x m_w outputs with different m on each axis.  the loops all
+// have compile time bounds and get unrolled, which folds the zero and one
+// entries of the matrices away.
+
+// points 0, 1, -1
+struct Winograd2 {
+    static constexpr int M = 2;
+    static constexpr int ALPHA = 4;
+    static constexpr float BT[ALPHA][ALPHA] = {
+        {1.0f, 0.0f, -1.0f, 0.0f},
+        {0.0f, 1.0f, 1.0f, 0.0f},
+        {0.0f, -1.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f, 0.0f, -1.0f}};
+    static constexpr float AT[M][ALPHA] = {
+        {1.0f, 1.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f, -1.0f, -1.0f}};
+    static constexpr float G[ALPHA][3] = {
+        {1.0f, 0.0f, 0.0f},
+        {1.0f/2.0f, 1.0f/2.0f, 1.0f/2.0f},
+        {1.0f/2.0f, -1.0f/2.0f, 1.0f/2.0f},
+        {0.0f, 0.0f, 1.0f}};
+};
+
+// points 0, 1, -1, -2
+struct Winograd3 {
+    static constexpr int M = 3;
+    static constexpr int ALPHA = 5;
+    static constexpr float BT[ALPHA][ALPHA] = {
+        {-2.0f, -1.0f, 2.0f, 1.0f, 0.0f},
+        {0.0f, 2.0f, 3.0f, 1.0f, 0.0f},
+        {0.0f, -2.0f, 1.0f, 1.0f, 0.0f},
+        {0.0f, -1.0f, 0.0f, 1.0f, 0.0f},
+        {0.0f, -2.0f, -1.0f, 2.0f, 1.0f}};
+    static constexpr float AT[M][ALPHA] = {
+        {1.0f, 1.0f, 1.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f, -1.0f, -2.0f, 0.0f},
+        {0.0f, 1.0f, 1.0f, 4.0f, 1.0f}};
+    static constexpr float G[ALPHA][3] = {
+        {-1.0f/2.0f, 0.0f, 0.0f},
+        {1.0f/6.0f, 1.0f/6.0f, 1.0f/6.0f},
+        {1.0f/2.0f, -1.0f/2.0f, 1.0f/2.0f},
+        {-1.0f/6.0f, 1.0f/3.0f, -2.0f/3.0f},
+        {0.0f, 0.0f, 1.0f}};
+};
+
+// points 0, 1, -1, 1/2, -1/2, 2
+struct Winograd5 {
+    static constexpr int M = 5;
+    static constexpr int ALPHA = 7;
+    static constexpr float BT[ALPHA][ALPHA] = {
+        {-1.0f/2.0f, 1.0f/4.0f, 5.0f/2.0f, -5.0f/4.0f, -2.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f/2.0f, 1.0f/4.0f, -9.0f/4.0f, -1.0f, 1.0f, 0.0f},
+        {0.0f, -1.0f/2.0f, 3.0f/4.0f, 7.0f/4.0f, -3.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f, 3.0f/2.0f, -2.0f, -3.0f/2.0f, 1.0f, 0.0f},
+        {0.0f, -1.0f, 5.0f/2.0f, 0.0f, -5.0f/2.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f/4.0f, 0.0f, -5.0f/4.0f, 0.0f, 1.0f, 0.0f},
+        {0.0f, -1.0f/2.0f, 1.0f/4.0f, 5.0f/2.0f, -5.0f/4.0f, -2.0f, 1.0f}};
+    static constexpr float AT[M][ALPHA] = {
+        {1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 0.0f},
+        {0.0f, 1.0f, -1.0f, 1.0f/2.0f, -1.0f/2.0f, 2.0f, 0.0f},
+        {0.0f, 1.0f, 1.0f, 1.0f/4.0f, 1.0f/4.0f, 4.0f, 0.0f},
+        {0.0f, 1.0f, -1.0f, 1.0f/8.0f, -1.0f/8.0f, 8.0f, 0.0f},
+        {0.0f, 1.0f, 1.0f, 1.0f/16.0f, 1.0f/16.0f, 16.0f, 1.0f}};
+    static constexpr float G[ALPHA][3] = {
+        {-2.0f, 0.0f, 0.0f},
+        {-2.0f/3.0f, -2.0f/3.0f, -2.0f/3.0f},
+        {-2.0f/9.0f, 2.0f/9.0f, -2.0f/9.0f},
+        {16.0f/9.0f, 8.0f/9.0f, 4.0f/9.0f},
+        {16.0f/15.0f, -8.0f/15.0f, 4.0f/15.0f},
+        {2.0f/45.0f, 4.0f/45.0f, 8.0f/45.0f},
+        {0.0f, 0.0f, 1.0f}};
+};
+
+constexpr float Winograd2::BT[Winograd2::ALPHA][Winograd2::ALPHA];
+constexpr float Winograd2::AT[Winograd2::M][Winograd2::ALPHA];
+constexpr float Winograd2::G[Winograd2::ALPHA][3];
+constexpr float Winograd3::BT[Winograd3::ALPHA][Winograd3::ALPHA];
+constexpr float Winograd3::AT[Winograd3::M][Winograd3::ALPHA];
+constexpr float Winograd3::G[Winograd3::ALPHA][3];
+constexpr float Winograd5::BT[Winograd5::ALPHA][Winograd5::ALPHA];
+constexpr float Winograd5::AT[Winograd5::M][Winograd5::ALPHA];
+constexpr float Winograd5::G[Winograd5::ALPHA][3];
+
+// TH along the board height, TW along the width
+template <class TH, class TW>
+struct TileShape {
+    static constexpr int TILES_H = (gmgm::BOARD_H + TH::M - 1) / TH::M;
+    static constexpr int TILES_W = (gmgm::BOARD_W + TW::M - 1) / TW::M;
+    static constexpr int P = TILES_H * TILES_W;
+    static constexpr int TILE = TH::ALPHA * TW::ALPHA;
+};
+
+template <class TH, class TW, Layout L, typename V>
+WINOGRAD_INLINE void tiled_in_impl(const float* in, float* V_out,
+                                   const int C, const int batch_size,
+                                   const int ch_begin, const int ch_end) {
+    using Shape = TileShape<TH, TW>;
+    constexpr auto P = Shape::P;
+    constexpr auto AH = TH::ALPHA;
+    constexpr auto AW = TW::ALPHA;
+    constexpr auto Hpad = 2 + TH::M * Shape::TILES_H;
+    constexpr auto Wpad = 2 + TW::M * Shape::TILES_W;
+    constexpr auto lanes = static_cast<int>(sizeof(V) / sizeof(float));
+    const auto PB = P * batch_size;
+
+    std::array<std::array<V, Wpad>, Hpad> in_pad;
+    for (auto & row : in_pad) {
+        for (auto & x : row) {
+            x = V{};
+        }
+    }
+    std::array<std::array<V, P>, Shape::TILE> out;
+
+    for (auto ch = ch_begin; ch < ch_end; ch += lanes) {
+        const auto cnt = std::min(lanes, ch_end - ch);
+        for (auto n = 0; n < batch_size; n++) {
+            load_planes<L>(in_pad, in, C, n, ch, cnt);
+
+            for (auto block_y = 0; block_y < Shape::TILES_H; block_y++) {
+                const auto yin = TH::M * block_y;
+                for (auto block_x = 0; block_x < Shape::TILES_W; block_x++) {
+                    const auto xin = TW::M * block_x;
+                    const auto b = block_y * Shape::TILES_W + block_x;
+
+                    // transpose(BT_h).x.BT_w
+                    V t[AH][AW];
+#pragma GCC unroll 8
+                    for (auto i = 0; i < AH; i++) {
+#pragma GCC unroll 8
+                        for (auto x = 0; x < AW; x++) {
+                            auto acc = V{};
+#pragma GCC unroll 8
+                            for (auto l = 0; l < AH; l++) {
+                                acc += TH::BT[i][l] * in_pad[yin + l][xin + x];
+                            }
+                            t[i][x] = acc;
+                        }
+                    }
+#pragma GCC unroll 8
+                    for (auto i = 0; i < AH; i++) {
+#pragma GCC unroll 8
+                        for (auto j = 0; j < AW; j++) {
+                            auto acc = V{};
+#pragma GCC unroll 8
+                            for (auto l = 0; l < AW; l++) {
+                                acc += t[i][l] * TW::BT[j][l];
+                            }
+                            out[i * AW + j][b] = acc;
+                        }
+                    }
+                }
+            }
+
+            for (auto i = 0; i < Shape::TILE; i++) {
+                for (auto j = 0; j < cnt; j++) {
+                    const auto dst = &V_out[i*C*PB + (ch + j)*PB + n*P];
+                    for (auto b = 0; b < P; b++) {
+                        dst[b] = lane(out[i][b], j);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <class TH, class TW, Layout L, typename V>
+WINOGRAD_INLINE void tiled_out_impl(const float* M, float* Y,
+                                    const int K, const int batch_size,
+                                    const int k_begin, const int k_end,
+                                    const Epilogue& ep) {
+    using Shape = TileShape<TH, TW>;
+    constexpr auto W = gmgm::BOARD_W;
+    constexpr auto H = gmgm::BOARD_H;
+    constexpr auto P = Shape::P;
+    constexpr auto AH = TH::ALPHA;
+    constexpr auto AW = TW::ALPHA;
+    constexpr auto lanes = static_cast<int>(sizeof(V) / sizeof(float));
+    const auto PB = P * batch_size;
+
+    std::array<std::array<V, P>, Shape::TILE> temp_m;
+    std::array<V, NUM_INTERSECTIONS> y_out;
+
+    for (auto k = k_begin; k < k_end; k += lanes) {
+        const auto cnt = std::min(lanes, k_end - k);
+        for (auto n = 0; n < batch_size; n++) {
+            for (auto i = 0; i < Shape::TILE; i++) {
+                for (auto j = 0; j < cnt; j++) {
+                    const auto src = &M[i*K*PB + (k + j)*PB + n*P];
+                    for (auto b = 0; b < P; b++) {
+                        lane(temp_m[i][b], j) = src[b];
+                    }
+                }
+            }
+
+            for (auto block_y = 0; block_y < Shape::TILES_H; block_y++) {
+                const auto y = TH::M * block_y;
+                for (auto block_x = 0; block_x < Shape::TILES_W; block_x++) {
+                    const auto x = TW::M * block_x;
+                    const auto b = block_y * Shape::TILES_W + block_x;
+
+                    // transpose(AT_h).m.AT_w
+                    V t[TH::M][AW];
+#pragma GCC unroll 8
+                    for (auto i = 0; i < TH::M; i++) {
+#pragma GCC unroll 8
+                        for (auto xx = 0; xx < AW; xx++) {
+                            auto acc = V{};
+#pragma GCC unroll 8
+                            for (auto l = 0; l < AH; l++) {
+                                acc += TH::AT[i][l] * temp_m[l * AW + xx][b];
+                            }
+                            t[i][xx] = acc;
+                        }
+                    }
+#pragma GCC unroll 8
+                    for (auto i = 0; i < TH::M; i++) {
+#pragma GCC unroll 8
+                        for (auto j = 0; j < TW::M; j++) {
+                            auto acc = V{};
+#pragma GCC unroll 8
+                            for (auto l = 0; l < AW; l++) {
+                                acc += t[i][l] * TW::AT[j][l];
+                            }
+                            if (y + i < H && x + j < W) {
+                                y_out[(y + i) * W + x + j] = acc;
+                            }
+                        }
+                    }
+                }
+            }
+
+            store_planes<L>(y_out, Y, K, n, k, cnt, ep);
+        }
+    }
+}
+
+template <class TH, class TW>
+static std::vector<float> tiled_transform_f(const std::vector<float>& f,
+                                            const int outputs, const int channels) {
+    // transpose(G_h.f.G_w), in double as it only runs at load time
+    constexpr auto AH = TH::ALPHA;
+    constexpr auto AW = TW::ALPHA;
+    auto U = std::vector<float>(AH * AW * outputs * channels);
+    for (auto o = 0; o < outputs; o++) {
+        for (auto c = 0; c < channels; c++) {
+            const auto filter = &f[o*channels*9 + c*9];
+            double temp[AH][3];
+            for (auto i = 0; i < AH; i++) {
+                for (auto j = 0; j < 3; j++) {
+                    auto acc = 0.0;
+                    for (auto k = 0; k < 3; k++) {
+                        acc += double{TH::G[i][k]} * filter[k*3 + j];
+                    }
+                    temp[i][j] = acc;
+                }
+            }
+            for (auto xi = 0; xi < AH; xi++) {
+                for (auto nu = 0; nu < AW; nu++) {
+                    auto acc = 0.0;
+                    for (auto k = 0; k < 3; k++) {
+                        acc += temp[xi][k] * double{TW::G[nu][k]};
+                    }
+                    U[(xi * AW + nu) * outputs * channels + c * outputs + o] = acc;
+                }
+            }
+        }
+    }
+    return U;
+}
+
+// one set of entry points per tiling, compiled for each instruction set
+template <class TH, class TW>
+struct TiledKernels {
+    template <Layout L>
+    static void in_scalar(const float* in, float* V, int C, int batch_size, int ch_begin, int ch_end) {
+        tiled_in_impl<TH, TW, L, float>(in, V, C, batch_size, ch_begin, ch_end);
+    }
+    template <Layout L>
+    static void out_scalar(const float* M, float* Y, int K, int batch_size, int k_begin, int k_end,
+                           const Epilogue& ep) {
+        tiled_out_impl<TH, TW, L, float>(M, Y, K, batch_size, k_begin, k_end, ep);
+    }
+    template <Layout L>
+    __attribute__((target("avx2,fma")))
+    static void in_avx2(const float* in, float* V, int C, int batch_size, int ch_begin, int ch_end) {
+        tiled_in_impl<TH, TW, L, v8sf>(in, V, C, batch_size, ch_begin, ch_end);
+    }
+    template <Layout L>
+    __attribute__((target("avx2,fma")))
+    static void out_avx2(const float* M, float* Y, int K, int batch_size, int k_begin, int k_end,
+                         const Epilogue& ep) {
+        tiled_out_impl<TH, TW, L, v8sf>(M, Y, K, batch_size, k_begin, k_end, ep);
+    }
+    template <Layout L>
+    __attribute__((target("avx512f")))
+    static void in_avx512(const float* in, float* V, int C, int batch_size, int ch_begin, int ch_end) {
+        tiled_in_impl<TH, TW, L, v16sf>(in, V, C, batch_size, ch_begin, ch_end);
+    }
+    template <Layout L>
+    __attribute__((target("avx512f")))
+    static void out_avx512(const float* M, float* Y, int K, int batch_size, int k_begin, int k_end,
+                           const Epilogue& ep) {
+        tiled_out_impl<TH, TW, L, v16sf>(M, Y, K, batch_size, k_begin, k_end, ep);
+    }
+
+    template <Layout L>
+    static void in(Isa isa, const float* in, float* V, int C, int batch_size, int ch_begin, int ch_end) {
+        switch (isa) {
+            case Isa::AVX512: in_avx512<L>(in, V, C, batch_size, ch_begin, ch_end); break;
+            case Isa::AVX2: in_avx2<L>(in, V, C, batch_size, ch_begin, ch_end); break;
+            default: in_scalar<Layout::NCHW>(in, V, C, batch_size, ch_begin, ch_end); break;
+        }
+    }
+    template <Layout L>
+    static void out(Isa isa, const float* M, float* Y, int K, int batch_size, int k_begin, int k_end,
+                    const Epilogue& ep) {
+        switch (isa) {
+            case Isa::AVX512: out_avx512<L>(M, Y, K, batch_size, k_begin, k_end, ep); break;
+            case Isa::AVX2: out_avx2<L>(M, Y, K, batch_size, k_begin, k_end, ep); break;
+            default: out_scalar<Layout::NCHW>(M, Y, K, batch_size, k_begin, k_end, ep); break;
+        }
+    }
+    static void in(Isa isa, Layout layout, const float* in, float* V, int C, int batch_size,
+                   int ch_begin, int ch_end) {
+        if (layout == Layout::BLOCKED) {
+            TiledKernels::in<Layout::BLOCKED>(isa, in, V, C, batch_size, ch_begin, ch_end);
+        } else {
+            TiledKernels::in<Layout::NCHW>(isa, in, V, C, batch_size, ch_begin, ch_end);
+        }
+    }
+    static void out(Isa isa, Layout layout, const float* M, float* Y, int K, int batch_size,
+                    int k_begin, int k_end, const Epilogue& ep) {
+        if (layout == Layout::BLOCKED) {
+            TiledKernels::out<Layout::BLOCKED>(isa, M, Y, K, batch_size, k_begin, k_end, ep);
+        } else {
+            TiledKernels::out<Layout::NCHW>(isa, M, Y, K, batch_size, k_begin, k_end, ep);
+        }
+    }
+};
+
+using TiledF5X3 = TiledKernels<Winograd5, Winograd3>;
+using TiledF2X2 = TiledKernels<Winograd2, Winograd2>;
+
+#ifdef WINOGRAD_X86
+
+// 16 bit weight GEMM.  the micro-kernels hold NP pixels x NK vectors of output
+// channels in registers : every input channel c widens NK vectors of U[c][k..]
+// once and broadcasts V[c][p] for each of the NP pixels.  results come out
+// k-major per pixel, so they get transposed into M[k][p] through a small buffer.
+
+template <Storage S>
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 load8(const uint16_t* p) {
+    const auto h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    if (S == Storage::FP16) {
+        return _mm256_cvtph_ps(h);
+    }
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+template <Storage S, int NP, int NK>
+__attribute__((target("avx2,fma,f16c")))
+static inline void block_avx2(const uint16_t* U, const float* V, float* M,
+                              const int C, const int K, const int P,
+                              const int p, const int k) {
+    __m256 acc[NP][NK];
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            acc[i][j] = _mm256_setzero_ps();
+        }
+    }
+    for (auto c = 0; c < C; c++) {
+        __m256 u[NK];
+        for (auto j = 0; j < NK; j++) {
+            u[j] = load8<S>(U + c * K + k + 8 * j);
+        }
+        for (auto i = 0; i < NP; i++) {
+            const auto v = _mm256_set1_ps(V[c * P + p + i]);
+            for (auto j = 0; j < NK; j++) {
+                acc[i][j] = _mm256_fmadd_ps(u[j], v, acc[i][j]);
+            }
+        }
+    }
+    alignas(32) float out[NP][NK * 8];
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            _mm256_store_ps(&out[i][8 * j], acc[i][j]);
+        }
+    }
+    for (auto kk = 0; kk < NK * 8; kk++) {
+        for (auto i = 0; i < NP; i++) {
+            M[(k + kk) * P + p + i] = out[i][kk];
+        }
+    }
+}
+
+template <Storage S, int NK>
+__attribute__((target("avx2,fma,f16c")))
+static inline void pixels_avx2(const uint16_t* U, const float* V, float* M,
+                               const int C, const int K, const int P, const int k) {
+    auto p = 0;
+    for (; p + 4 <= P; p += 4) {
+        block_avx2<S, 4, NK>(U, V, M, C, K, P, p, k);
+    }
+    for (; p < P; p++) {
+        block_avx2<S, 1, NK>(U, V, M, C, K, P, p, k);
+    }
+}
+
+template <Storage S>
+__attribute__((target("avx2,fma,f16c")))
+static void sgemm16_avx2(const uint16_t* U, const float* V, float* M,
+                         const int C, const int K, const int P,
+                         const int tile_begin, const int tile_end) {
+    for (auto b = tile_begin; b < tile_end; b++) {
+        const auto Ub = U + b * K * C;
+        const auto Vb = V + b * C * P;
+        const auto Mb = M + b * K * P;
+        auto k = 0;
+        for (; k + 16 <= K; k += 16) {
+            pixels_avx2<S, 2>(Ub, Vb, Mb, C, K, P, k);
+        }
+        for (; k < K; k += 8) {
+            pixels_avx2<S, 1>(Ub, Vb, Mb, C, K, P, k);
+        }
+    }
+}
+
+template <Storage S>
+__attribute__((target("avx512f")))
+static inline __m512 load16(const uint16_t* p) {
+    const auto h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    if (S == Storage::FP16) {
+        return _mm512_cvtph_ps(h);
+    }
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+}
+
+template <Storage S, int NP, int NK>
+__attribute__((target("avx512f")))
+static inline void block_avx512(const uint16_t* U, const float* V, float* M,
+                                const int C, const int K, const int P,
+                                const int p, const int k) {
+    __m512 acc[NP][NK];
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            acc[i][j] = _mm512_setzero_ps();
+        }
+    }
+    for (auto c = 0; c < C; c++) {
+        __m512 u[NK];
+        for (auto j = 0; j < NK; j++) {
+            u[j] = load16<S>(U + c * K + k + 16 * j);
+        }
+        for (auto i = 0; i < NP; i++) {
+            const auto v = _mm512_set1_ps(V[c * P + p + i]);
+            for (auto j = 0; j < NK; j++) {
+                acc[i][j] = _mm512_fmadd_ps(u[j], v, acc[i][j]);
+            }
+        }
+    }
+    alignas(64) float out[NP][NK * 16];
+    for (auto i = 0; i < NP; i++) {
+        for (auto j = 0; j < NK; j++) {
+            _mm512_store_ps(&out[i][16 * j], acc[i][j]);
+        }
+    }
+    for (auto kk = 0; kk < NK * 16; kk++) {
+        for (auto i = 0; i < NP; i++) {
+            M[(k + kk) * P + p + i] = out[i][kk];
+        }
+    }
+}
+
+template <Storage S, int NK>
+__attribute__((target("avx512f")))
+static inline void pixels_avx512(const uint16_t* U, const float* V, float* M,
+                                 const int C, const int K, const int P, const int k) {
+    auto p = 0;
+    for (; p + 6 <= P; p += 6) {
+        block_avx512<S, 6, NK>(U, V, M, C, K, P, p, k);
+    }
+    for (; p + 3 <= P; p += 3) {
+        block_avx512<S, 3, NK>(U, V, M, C, K, P, p, k);
+    }
+    for (; p < P; p++) {
+        block_avx512<S, 1, NK>(U, V, M, C, K, P, p, k);
+    }
+}
+
+template <Storage S>
+__attribute__((target("avx512f")))
+static void sgemm16_avx512(const uint16_t* U, const float* V, float* M,
+                           const int C, const int K, const int P,
+                           const int tile_begin, const int tile_end) {
+    for (auto b = tile_begin; b < tile_end; b++) {
+        const auto Ub = U + b * K * C;
+        const auto Vb = V + b * C * P;
+        const auto Mb = M + b * K * P;
+        auto k = 0;
+        for (; k + 32 <= K; k += 32) {
+            pixels_avx512<S, 2>(Ub, Vb, Mb, C, K, P, k);
+        }
+        for (; k < K; k += 16) {
+            pixels_avx512<S, 1>(Ub, Vb, Mb, C, K, P, k);
+        }
+    }
+}
+
+#endif
+
+uint16_t narrow(Storage s, float x) {
+    if (s == Storage::FP16) {
+        return half_float::detail::float2half<std::round_to_nearest>(x);
+    }
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    // round to nearest even on the 16 bits we drop
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+float widen(Storage s, uint16_t x) {
+    if (s == Storage::FP16) {
+        return half_float::detail::half2float<float>(x);
+    }
+    const auto bits = static_cast<uint32_t>(x) << 16;
+    float ret;
+    std::memcpy(&ret, &bits, sizeof(ret));
+    return ret;
+}
+
+bool sgemm16(Isa isa, Storage s, const uint16_t* U, const float* V, float* M,
+             int C, int K, int P, int tile_begin, int tile_end) {
+    switch (isa) {
+#ifdef WINOGRAD_X86
+        case Isa::AVX512:
+            if (K % 16 == 0) {
+                if (s == Storage::FP16) {
+                    sgemm16_avx512<Storage::FP16>(U, V, M, C, K, P, tile_begin, tile_end);
+                } else {
+                    sgemm16_avx512<Storage::BF16>(U, V, M, C, K, P, tile_begin, tile_end);
+                }
+                return true;
+            }
+            // fall through
+        case Isa::AVX2:
+            if (K % 8 == 0) {
+                if (s == Storage::FP16) {
+                    sgemm16_avx2<Storage::FP16>(U, V, M, C, K, P, tile_begin, tile_end);
+                } else {
+                    sgemm16_avx2<Storage::BF16>(U, V, M, C, K, P, tile_begin, tile_end);
+                }
+                return true;
+            }
+            return false;
+#endif
+        default:
+            return false;
+    }
+}
+
+Isa select(const std::string & requested) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    const auto has_avx512 = __builtin_cpu_supports("avx512f");
+    const auto has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    const auto has_avx512 = false;
+    const auto has_avx2 = false;
+#endif
+    if (has_avx512 && (requested == "auto" || requested == "avx512")) {
+        return Isa::AVX512;
+    }
+    if (has_avx2 && requested != "scalar") {
+        return Isa::AVX2;
+    }
+    return Isa::SCALAR;
+}
+
+const char * name(Isa isa) {
+    switch (isa) {
+        case Isa::AVX512: return "avx512";
+        case Isa::AVX2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+int block_width(Isa isa) {
+    switch (isa) {
+        case Isa::AVX512: return 16;
+        case Isa::AVX2: return 8;
+        default: return 0;
+    }
+}
+
+bool transform_in(Isa isa, const float* in, float* V,
+                  int C, int batch_size, int ch_begin, int ch_end, Layout layout) {
+    const auto blocked = layout == Layout::BLOCKED;
+    switch (isa) {
+        case Isa::AVX512:
+            if (blocked) {
+                transform_in_avx512<Layout::BLOCKED>(in, V, C, batch_size, ch_begin, ch_end);
+            } else {
+                transform_in_avx512<Layout::NCHW>(in, V, C, batch_size, ch_begin, ch_end);
+            }
+            return true;
+        case Isa::AVX2:
+            if (blocked) {
+                transform_in_avx2<Layout::BLOCKED>(in, V, C, batch_size, ch_begin, ch_end);
+            } else {
+                transform_in_avx2<Layout::NCHW>(in, V, C, batch_size, ch_begin, ch_end);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool transform_out(Isa isa, const float* M, float* Y,
+                   int K, int batch_size, int k_begin, int k_end,
+                   const Epilogue& ep, Layout layout) {
+    const auto blocked = layout == Layout::BLOCKED;
+    switch (isa) {
+        case Isa::AVX512:
+            if (blocked) {
+                transform_out_avx512<Layout::BLOCKED>(M, Y, K, batch_size, k_begin, k_end, ep);
+            } else {
+                transform_out_avx512<Layout::NCHW>(M, Y, K, batch_size, k_begin, k_end, ep);
+            }
+            return true;
+        case Isa::AVX2:
+            if (blocked) {
+                transform_out_avx2<Layout::BLOCKED>(M, Y, K, batch_size, k_begin, k_end, ep);
+            } else {
+                transform_out_avx2<Layout::NCHW>(M, Y, K, batch_size, k_begin, k_end, ep);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+Tiling select_tiling(const std::string & requested) {
+    if (requested == "f5x3") {
+        return Tiling::F5X3;
+    }
+    if (requested == "f2x2") {
+        return Tiling::F2X2;
+    }
+    return Tiling::F4X4;
+}
+
+const char * name(Tiling tiling) {
+    switch (tiling) {
+        case Tiling::F5X3: return "f5x3";
+        case Tiling::F2X2: return "f2x2";
+        default: return "f4x4";
+    }
+}
+
+int tile_elements(Tiling tiling) {
+    switch (tiling) {
+        case Tiling::F5X3: return TileShape<Winograd5, Winograd3>::TILE;
+        case Tiling::F2X2: return TileShape<Winograd2, Winograd2>::TILE;
+        default: return WINOGRAD_TILE;
+    }
+}
+
+int tiles(Tiling tiling) {
+    switch (tiling) {
+        case Tiling::F5X3: return TileShape<Winograd5, Winograd3>::P;
+        case Tiling::F2X2: return TileShape<Winograd2, Winograd2>::P;
+        default: return WINOGRAD_P;
+    }
+}
+
+std::vector<float> transform_f(Tiling tiling, const std::vector<float>& f,
+                               int outputs, int channels) {
+    if (tiling == Tiling::F2X2) {
+        return tiled_transform_f<Winograd2, Winograd2>(f, outputs, channels);
+    }
+    return tiled_transform_f<Winograd5, Winograd3>(f, outputs, channels);
+}
+
+void transform_in(Isa isa, Tiling tiling, const float* in, float* V,
+                  int C, int batch_size, int ch_begin, int ch_end, Layout layout) {
+    if (tiling == Tiling::F2X2) {
+        TiledF2X2::in(isa, layout, in, V, C, batch_size, ch_begin, ch_end);
+    } else {
+        TiledF5X3::in(isa, layout, in, V, C, batch_size, ch_begin, ch_end);
+    }
+}
+
+void transform_out(Isa isa, Tiling tiling, const float* M, float* Y,
+                   int K, int batch_size, int k_begin, int k_end,
+                   const Epilogue& ep, Layout layout) {
+    if (tiling == Tiling::F2X2) {
+        TiledF2X2::out(isa, layout, M, Y, K, batch_size, k_begin, k_end, ep);
+    } else {
+        TiledF5X3::out(isa, layout, M, Y, K, batch_size, k_begin, k_end, ep);
+    }
+}
+
+}
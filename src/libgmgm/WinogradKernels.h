@@ -0,0 +1,164 @@
+/*
+    This code is part of gmgm, copyright (C) 2020 Junhee Yoo
+
+    gmgm is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    gmgm is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with gmgm.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WINOGRADKERNELS_H_INCLUDED
+#define WINOGRADKERNELS_H_INCLUDED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// SIMD versions of the CPUPipe winograd transforms.  these work on a block
+// of 8 (AVX2) or 16 (AVX-512) channels at a time, one channel per vector lane.
+// data layouts are identical to CPUPipe::winograd_transform_in / _out.
+namespace WinogradKernels {
+    enum class Isa {
+        SCALAR,
+        AVX2,
+        AVX512
+    };
+
+    // what to do with each output plane of the output transform, so that
+    // batchnorm, residual add, relu and SE pooling happen while the plane is
+    // still in L1 instead of in separate passes over the whole tensor
+    struct Epilogue {
+        // [K], batchnorm is applied when non-null
+        const float* means = nullptr;
+        const float* stddevs = nullptr;
+        // same layout as the output, added after batchnorm
+        const float* residual = nullptr;
+        bool relu = false;
+        // [batch][K] channel averages, written when non-null
+        float* pool = nullptr;
+    };
+
+    // applies ep to the freshly written plane (n, k) of a K-channel output
+    template <size_t spatial_size>
+    inline void finish_plane(const Epilogue& ep, float* plane,
+                             const int n, const int k, const int K) {
+        const auto offset = (n * K + k) * spatial_size;
+        if (ep.means != nullptr) {
+            const auto mean = ep.means[k];
+            const auto scale_stddev = ep.stddevs[k];
+            for (auto b = size_t{0}; b < spatial_size; b++) {
+                plane[b] = scale_stddev * (plane[b] - mean);
+            }
+        }
+        if (ep.residual != nullptr) {
+            const auto res = ep.residual + offset;
+            for (auto b = size_t{0}; b < spatial_size; b++) {
+                plane[b] = plane[b] + res[b];
+            }
+        }
+        if (ep.relu) {
+            for (auto b = size_t{0}; b < spatial_size; b++) {
+                plane[b] = std::max(plane[b], 0.0f);
+            }
+        }
+        if (ep.pool != nullptr) {
+            float sum = 0.0f;
+            for (auto b = size_t{0}; b < spatial_size; b++) {
+                sum += plane[b];
+            }
+            ep.pool[n * K + k] = sum / spatial_size;
+        }
+    }
+
+    // 16 bit storage formats for the transformed 3x3 weights
+    enum class Storage {
+        FP16,
+        BF16
+    };
+
+    // round to nearest even, and back
+    uint16_t narrow(Storage s, float x);
+    float widen(Storage s, uint16_t x);
+
+    // M = U x V on winograd tiles [tile_begin, tile_end), U being stored in
+    // 16 bits and widened to fp32 as it is loaded.  same layouts as
+    // CPUPipe::winograd_sgemm : U is [tile][C][K], V is [tile][C][P] and
+    // M is [tile][K][P].  returns false if isa is SCALAR or K isn't a
+    // multiple of the vector width, in which case the caller should widen
+    // U itself
+    bool sgemm16(Isa isa, Storage s, const uint16_t* U, const float* V, float* M,
+                 int C, int K, int P, int tile_begin, int tile_end);
+
+    // best instruction set that is both requested and supported by this cpu.
+    // requested is one of auto, avx512, avx2 or scalar
+    Isa select(const std::string & requested);
+    const char * name(Isa isa);
+
+    // layout of the activations going into transform_in and out of
+    // transform_out.  NCHW is [batch][channels][90].  BLOCKED is
+    // [batch][channels / width][90][width], width being block_width(isa),
+    // so the channels of a vector sit next to each other at every
+    // intersection.  BLOCKED needs a vector isa and channel ranges that
+    // are multiples of the width.  the epilogue residual uses the output layout
+    enum class Layout {
+        NCHW,
+        BLOCKED
+    };
+    // 0 for SCALAR
+    int block_width(Isa isa);
+
+    // both return false if isa is SCALAR, in which case the caller
+    // should run its own scalar version
+    bool transform_in(Isa isa, const float* in, float* V,
+                      int C, int batch_size, int ch_begin, int ch_end,
+                      Layout layout = Layout::NCHW);
+    bool transform_out(Isa isa, const float* M, float* Y,
+                       int K, int batch_size, int k_begin, int k_end,
+                       const Epilogue& ep, Layout layout = Layout::NCHW);
+
+    // how the 9 x 10 board is covered with winograd tiles.  tile elements
+    // are the GEMMs per convolution, and tiles the GEMM columns per position :
+    //  F4X4 : 3 x 3 tiles of F(4x4, 3x3), 36 elements.  computes 12 x 12
+    //         outputs for 90, and is what the OpenCL backend and binary nets use
+    //  F5X3 : 2 x 3 tiles of F(5x3, 3x3) (5 rows, 3 columns), 7 x 5 = 35
+    //         elements.  covers the board exactly, 35% less GEMM work than F4X4
+    //  F2X2 : 5 x 5 tiles of F(2x2, 3x3), 16 elements.  23% more GEMM work
+    //         than F4X4 but the smallest transform error, for 16 bit weights
+    enum class Tiling {
+        F4X4,
+        F5X3,
+        F2X2
+    };
+    // requested is one of f4x4, f5x3 or f2x2
+    Tiling select_tiling(const std::string & requested);
+    const char * name(Tiling tiling);
+    int tile_elements(Tiling tiling);
+    int tiles(Tiling tiling);
+
+    // filter transform for the tilings other than F4X4, whose transform is
+    // Network::winograd_transform_f.  f is [outputs][channels][3][3] and the
+    // result [tile element][channels][outputs]
+    std::vector<float> transform_f(Tiling tiling, const std::vector<float>& f,
+                                   int outputs, int channels);
+
+    // the same transforms for the tilings other than F4X4.  these handle
+    // every isa, SCALAR included (NCHW only)
+    void transform_in(Isa isa, Tiling tiling, const float* in, float* V,
+                      int C, int batch_size, int ch_begin, int ch_end,
+                      Layout layout = Layout::NCHW);
+    void transform_out(Isa isa, Tiling tiling, const float* M, float* Y,
+                       int K, int batch_size, int k_begin, int k_end,
+                       const Epilogue& ep, Layout layout = Layout::NCHW);
+}
+
+#endif
@@ -31,6 +31,17 @@ bool board_based_repetitive_move = false;
 bool jang_move_is_illegal = false;
 float score_based_bias_rate = 0.0f;
 bool verbose_mode = true;
+unsigned int prefetch_children = 2;
+unsigned int cpu_threads = 1;
+std::string cpu_simd = "auto";
+std::string cpu_precision = "fp32";
+std::string cpu_weights = "fp32";
+std::string cpu_winograd = "f4x4";
+std::string cpu_layout = "nchw";
+std::string backend = "auto";
+std::string opencl_precision = "fp16";
+unsigned int large_net_depth = 2;
+unsigned int large_net_visits = 0;
 
 void myprintf(const char *fmt, ...) {
     if (verbose_mode) {
@@ -19,6 +19,7 @@
 #define __GMGM__GLOBALS_H__
 
 #include <cstdlib>
+#include <string>
 
 namespace gmgm {
 namespace globals {
@@ -31,6 +32,30 @@ extern bool board_based_repetitive_move;
 extern float score_based_bias_rate;
 extern bool jang_move_is_illegal;
 extern bool verbose_mode;
+extern unsigned int prefetch_children;
+// number of threads a single cpu backend forward pass is split across
+extern unsigned int cpu_threads;
+// auto, avx512, avx2 or scalar
+extern std::string cpu_simd;
+// fp32 or int8, for the cpu backend residual tower
+extern std::string cpu_precision;
+// storage of the winograd transformed cpu weights : fp32, fp16 or bf16
+extern std::string cpu_weights;
+// winograd tiles of the cpu backend 3x3 convolutions : f4x4, f5x3 or f2x2
+extern std::string cpu_winograd;
+// activation layout of the cpu backend residual tower : nchw or blocked
+extern std::string cpu_layout;
+// cpu, opencl or auto
+extern std::string backend;
+// arithmetic of the OpenCL backend : fp16 or fp32
+extern std::string opencl_precision;
+// two net cascade : positions less than large_net_depth plies below the
+// search root, and children of nodes with at least large_net_visits visits
+// (0 is off), are evaluated by the large net if one is loaded.  reused
+// nodes are evaluated again when they fall under the rule, see
+// SearchNode::reevaluate_large()
+extern unsigned int large_net_depth;
+extern unsigned int large_net_visits;
 
 void myprintf(const char *fmt, ...);
 }
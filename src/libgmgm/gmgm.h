@@ -24,5 +24,6 @@
 #include "SearchNode.h"
 #include "Search.h"
 #include "Network.h"
+#include "Profiler.h"
 
 #endif // __GMGM_H__